@@ -0,0 +1,364 @@
+#define DUMMY /* \
+  set -ex; \
+  CFLAGS="-O2 -s -DNDEBUG=1";  [ "$1" ] && CFLAGS="-g"; \
+  CC=gcc; \
+  $CC $CFLAGS -ansi -pedantic -Wunused \
+    -Wall -W -Wstrict-prototypes -Wnested-externs -Winline \
+    -Wpointer-arith -Wbad-function-cast -Wcast-qual -Wmissing-prototypes \
+    -Wmissing-declarations "$0" -o pdfbench; \
+  exit
+*/
+/* pdfbench.c: benchmark for pdfconcat, with a synthetic PDF generator
+ *
+ * Build with `sh pdfbench.c', then:
+ *
+ *   $ ./pdfbench run ./pdfconcat             # the whole corpus
+ *   $ ./pdfbench run -n 5 ./pdfconcat -j 2   # best of 5, pdfconcat -j 2
+ *   $ ./pdfbench gen out.pdf objs=1000 updates=3
+ *
+ * `run' generates the corpus to a directory (bench.tmp by default), runs
+ * pdfconcat on each case, and prints a line of key=value pairs per case,
+ * which can be diffed between versions. The generator is deterministic: the
+ * same parameters give the same bytes.
+ *
+ * Needs POSIX and wait4(); the read and write syscall counts are taken
+ * from /proc/self/io (Linux), they are -1 elsewhere.
+ *
+ * The license of pdfbench is GPL v2 or later, like pdfconcat.
+ */
+
+#define _DEFAULT_SOURCE 1  /* for wait4() */
+#define _BSD_SOURCE 1
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h> /* mkdir() */
+#include <sys/time.h> /* gettimeofday() */
+#include <sys/resource.h> /* struct rusage */
+#include <sys/wait.h> /* wait4() */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* fork(), execvp() */
+
+#define PROGNAME "pdfbench"
+
+typedef char sbool;
+#define TRUE 1
+#define FALSE 0
+
+/* --- Generator */
+
+/** Parameters of a synthetic PDF */
+struct GenParams {
+  unsigned long seed;
+  unsigned long objs; /* number of objects, at least 8 */
+  unsigned long streamlen; /* bytes in each content stream */
+  unsigned long numdens; /* numbers in each filler dict */
+  unsigned long strdens; /* strings in each filler dict */
+  unsigned long xrefsecs; /* subsections in the first xref table */
+  unsigned long updates; /* incremental updates */
+};
+
+static struct GenState {
+  FILE *f;
+  unsigned long ofs; /* bytes written */
+  unsigned long rnd;
+  unsigned long *offs; /* offs[I] is the offset of `I 0 obj' */
+} gs;
+
+static void die(char const *msg1, char const *msg2) {
+  fprintf(stderr, "%s: %s%s\n", PROGNAME, msg1, msg2 ? msg2 : "");
+  exit(2);
+}
+
+/** @return a pseudo-random number in [0,n), deterministic from the seed */
+static unsigned long g_rand(unsigned long n) {
+  gs.rnd=(gs.rnd*1103515245UL+12345UL)&0xFFFFFFFFUL;
+  return (gs.rnd>>8)%n;
+}
+
+static void g_write(char const *p, unsigned long len) {
+  if (len!=fwrite(p, 1, len, gs.f)) die("write error", 0);
+  gs.ofs+=len;
+}
+
+static void g_puts(char const *s) { g_write(s, strlen(s)); }
+
+static void g_printf1(char const *fmt, unsigned long v) {
+  char tmp[64];
+  sprintf(tmp, fmt, v);
+  g_puts(tmp);
+}
+
+static void g_obj_begin(unsigned long num) {
+  gs.offs[num]=gs.ofs;
+  g_printf1("%lu 0 obj\n", num);
+}
+
+/** Writes a filler dict with numbers and strings, version ver. */
+static void g_filler(struct GenParams const *gp, unsigned long num, unsigned long ver) {
+  static char const *const words[]={"alpha", "beta", "gamma", "delta", "(nested)", "back\\\\slash", "tab\\t", "x"};
+  unsigned long i, n;
+  char tmp[64];
+  g_obj_begin(num);
+  g_printf1("<</Type/Bench/Ver %lu/N[", ver);
+  for (i=0; i<gp->numdens; i++) {
+    n=g_rand(100000);
+    switch (g_rand(3)) {
+     case 0: sprintf(tmp, "%lu ", n); break;
+     case 1: sprintf(tmp, "-%lu ", n); break;
+     default: sprintf(tmp, "%lu.%02lu ", n/100, n%100);
+    }
+    g_puts(tmp);
+  }
+  g_puts("]/S[");
+  for (i=0; i<gp->strdens; i++) {
+    if (g_rand(4)==0) {
+      g_printf1("<%08lX>", g_rand(0xFFFFFFFUL));
+    } else {
+      g_puts("("); g_puts(words[g_rand(8)]); g_puts(" "); g_puts(words[g_rand(8)]); g_puts(")");
+    }
+  }
+  g_puts("]>>\nendobj\n");
+}
+
+/** Writes an xref section of the objects with offs[I]!=0 in [from,to). The
+ * first section is split into gp->xrefsecs subsections.
+ */
+static unsigned long g_xref(struct GenParams const *gp, unsigned long from, unsigned long to, unsigned long prev) {
+  unsigned long xofs=gs.ofs, i, j, secs=from!=0 ? 0 : gp->xrefsecs!=0 ? gp->xrefsecs : 1, sublen;
+  char tmp[64];
+  g_puts("xref\n");
+  if (secs!=0) {
+    sublen=(to+secs-1)/secs;
+    for (i=0; i<to; i=j) {
+      j=i+sublen<to ? i+sublen : to;
+      sprintf(tmp, "%lu %lu\n", i, j-i); g_puts(tmp);
+      for (; i<j; i++) {
+        if (i==0) g_puts("0000000000 65535 f \n");
+        else { sprintf(tmp, "%010lu 00000 n \n", gs.offs[i]); g_puts(tmp); }
+      }
+    }
+  } else { /* Dat: only the changed objects, in runs */
+    g_puts("0 1\n0000000000 65535 f \n");
+    for (i=from; i<to; i=j) {
+      if (gs.offs[i]==0) { j=i+1; continue; }
+      for (j=i; j<to && gs.offs[j]!=0; j++) {}
+      sprintf(tmp, "%lu %lu\n", i, j-i); g_puts(tmp);
+      for (; i<j; i++) { sprintf(tmp, "%010lu 00000 n \n", gs.offs[i]); g_puts(tmp); }
+    }
+  }
+  sprintf(tmp, "trailer\n<</Size %lu/Root 1 0 R", gp->objs);
+  g_puts(tmp);
+  if (prev!=0) g_printf1("/Prev %lu", prev);
+  g_printf1(">>\nstartxref\n%lu\n%%%%EOF\n", xofs);
+  return xofs;
+}
+
+/** Generates a PDF to filename: /Catalog, /Pages, a /Font, pages with a
+ * content stream each, and filler dicts referred to by the pages.
+ * @return number of objects
+ */
+static unsigned long gen_pdf(char const *filename, struct GenParams const *gp) {
+  unsigned long npages, nfill, firstfill, i, j, k, n, xofs, u;
+  char tmp[96];
+  if (gp->objs<8) die("objs must be at least 8", 0);
+  npages=(gp->objs-3)/16+1;
+  firstfill=4+2*npages;
+  nfill=gp->objs>firstfill ? gp->objs-firstfill : 0;
+  if (NULL==(gs.offs=(unsigned long*)calloc(gp->objs+1, sizeof(gs.offs[0])))) die("out of memory", 0);
+  if (NULL==(gs.f=fopen(filename, "wb"))) die("cannot create: ", filename);
+  gs.ofs=0; gs.rnd=gp->seed;
+  g_puts("%PDF-1.4\n%\xE1\xE9\xF3\xFA\n");
+  g_obj_begin(1); g_puts("<</Type/Catalog/Pages 2 0 R>>\nendobj\n");
+  g_obj_begin(2); g_puts("<</Type/Pages/Kids[");
+  for (i=0; i<npages; i++) { g_printf1("%lu 0 R ", 4+2*i); }
+  g_printf1("]/Count %lu/MediaBox[0 0 612 792]>>\nendobj\n", npages);
+  g_obj_begin(3); g_puts("<</Type/Font/Subtype/Type1/BaseFont/Helvetica>>\nendobj\n");
+  for (i=0; i<npages; i++) {
+    g_obj_begin(4+2*i);
+    sprintf(tmp, "<</Type/Page/Parent 2 0 R/Resources<</Font<</F1 3 0 R>>>>/Contents %lu 0 R/X[", 5+2*i);
+    g_puts(tmp);
+    for (j=i; j<nfill; j+=npages) g_printf1("%lu 0 R ", firstfill+j);
+    g_puts("]>>\nendobj\n");
+    g_obj_begin(5+2*i);
+    g_printf1("<</Length %lu>>stream\n", gp->streamlen);
+    for (n=gp->streamlen; n!=0; n-=k) {
+      sprintf(tmp, "BT /F1 12 Tf %lu %lu Td (page %lu line %lu) Tj ET\n", 72+g_rand(400), 72+g_rand(600), i+1, g_rand(1000));
+      if ((k=strlen(tmp))>n) { memset(tmp, ' ', n); tmp[(k=n)-1]='\n'; }
+      g_write(tmp, k);
+    }
+    g_puts("\nendstream\nendobj\n");
+  }
+  for (j=0; j<nfill; j++) g_filler(gp, firstfill+j, 0);
+  xofs=g_xref(gp, 0, gp->objs, 0);
+  for (u=1; u<=gp->updates; u++) { /* Dat: rewrites every updates-th filler */
+    memset(gs.offs, '\0', (gp->objs+1)*sizeof(gs.offs[0]));
+    for (j=u-1; j<nfill; j+=gp->updates) g_filler(gp, firstfill+j, u);
+    xofs=g_xref(gp, 1, gp->objs, xofs);
+  }
+  if (0!=fclose(gs.f)) die("error writing: ", filename);
+  free(gs.offs);
+  return gp->objs;
+}
+
+/** Sets a parameter from a key=value string. @return FALSE if invalid */
+static sbool gen_param(struct GenParams *gp, char const *arg) {
+  static char const *const keys[]={"seed", "objs", "streamlen", "numdens", "strdens", "xrefsecs", "updates", NULL};
+  unsigned long *vals[7];
+  char const *eq=strchr(arg, '=');
+  char *end;
+  unsigned i;
+  vals[0]=&gp->seed; vals[1]=&gp->objs; vals[2]=&gp->streamlen; vals[3]=&gp->numdens;
+  vals[4]=&gp->strdens; vals[5]=&gp->xrefsecs; vals[6]=&gp->updates;
+  if (eq==NULL) return FALSE;
+  for (i=0; keys[i]!=NULL; i++) {
+    if (strlen(keys[i])==(size_t)(eq-arg) && 0==memcmp(keys[i], arg, eq-arg)) {
+      *vals[i]=strtoul(eq+1, &end, 10);
+      return *end=='\0' && end!=eq+1;
+    }
+  }
+  return FALSE;
+}
+
+static void gen_defaults(struct GenParams *gp) {
+  gp->seed=1; gp->objs=10000; gp->streamlen=2000; gp->numdens=8; gp->strdens=2;
+  gp->xrefsecs=1; gp->updates=0;
+}
+
+/* --- Harness */
+
+/** Cases of the corpus: each is merged from 2 inputs (seeds 1 and 2) */
+static struct BenchCase {
+  char const *name;
+  char const *params;
+} const cases[]={
+  {"small-objs", "objs=200000 streamlen=200 numdens=4 strdens=1"},
+  {"big-streams", "objs=2000 streamlen=200000 numdens=4 strdens=1"},
+  {"numbers", "objs=50000 streamlen=500 numdens=200 strdens=0"},
+  {"strings", "objs=50000 streamlen=500 numdens=0 strdens=100"},
+  {"xref-sections", "objs=100000 streamlen=500 xrefsecs=5000"},
+  {"updates", "objs=50000 streamlen=500 updates=20"},
+  {"tiny-objs", "objs=500000 streamlen=16 numdens=1 strdens=0"},
+  {NULL, NULL}
+};
+
+/** @return the read or write syscall count of this process and its waited
+ *   children, or -1
+ */
+static long proc_io(char const *key) {
+  FILE *f=fopen("/proc/self/io", "r");
+  char line[128];
+  long v=-1;
+  size_t keylen=strlen(key);
+  if (f==NULL) return -1;
+  while (fgets(line, sizeof(line), f)) {
+    if (0==strncmp(line, key, keylen) && line[keylen]==':') { v=atol(line+keylen+1); break; }
+  }
+  fclose(f);
+  return v;
+}
+
+/** Runs argv with stdout to /dev/null. @return wall time in seconds */
+static double run_once(char **argv, struct rusage *ru) {
+  struct timeval t0, t1;
+  int status, fd;
+  pid_t pid;
+  gettimeofday(&t0, NULL);
+  if ((pid=fork())<0) die("fork: ", strerror(errno));
+  if (pid==0) {
+    if ((fd=open("/dev/null", O_WRONLY))>=0) dup2(fd, 1);
+    execvp(argv[0], argv);
+    fprintf(stderr, "%s: exec %s: %s\n", PROGNAME, argv[0], strerror(errno));
+    _exit(127);
+  }
+  while (wait4(pid, &status, 0, ru)<0) {
+    if (errno!=EINTR) die("wait4: ", strerror(errno));
+  }
+  gettimeofday(&t1, NULL);
+  if (!WIFEXITED(status) || WEXITSTATUS(status)!=0) die("pdfconcat failed: ", argv[0]);
+  return (t1.tv_sec-t0.tv_sec)+(t1.tv_usec-t0.tv_usec)/1e6;
+}
+
+static int bench_run(char const *dir, unsigned runs, char **cmd, int cmdc) {
+  struct BenchCase const *c;
+  struct GenParams gp;
+  struct rusage ru;
+  struct stat st;
+  char in1[512], in2[512], out[512], params[256], *p, **argv;
+  unsigned long objs;
+  double best, wall, inbytes;
+  long syscr, syscw, syscr0, syscw0;
+  unsigned r;
+  int i;
+  if (strlen(dir)>400) die("dir name too long", 0);
+  if (0!=mkdir(dir, 0777) && errno!=EEXIST) die("mkdir: ", dir);
+  if (NULL==(argv=(char**)malloc((cmdc+6)*sizeof(argv[0])))) die("out of memory", 0);
+  for (i=0; i<cmdc; i++) argv[i]=cmd[i];
+  sprintf(out, "%s/out.pdf", dir);
+  argv[cmdc]=(char*)"-o"; argv[cmdc+1]=out; argv[cmdc+2]=in1; argv[cmdc+3]=in2; argv[cmdc+4]=NULL;
+  printf("# pdfbench 1: key=value per case, times in seconds, best of %u runs\n", runs);
+  for (c=cases; c->name!=NULL; c++) {
+    objs=0; inbytes=0;
+    for (i=1; i<=2; i++) { /* Dat: regenerated if the parameters change */
+      gen_defaults(&gp);
+      strcpy(params, c->params);
+      for (p=strtok(params, " "); p!=NULL; p=strtok(NULL, " ")) {
+        if (!gen_param(&gp, p)) die("bad case parameter: ", p);
+      }
+      gp.seed=i;
+      sprintf(i==1 ? in1 : in2, "%s/%s.%d.pdf", dir, c->name, i);
+      objs+=gen_pdf(i==1 ? in1 : in2, &gp);
+      if (0!=stat(i==1 ? in1 : in2, &st)) die("stat: ", in1);
+      inbytes+=st.st_size;
+    }
+    best=-1;
+    syscr0=proc_io("syscr"); syscw0=proc_io("syscw");
+    for (r=0; r<runs; r++) {
+      wall=run_once(argv, &ru);
+      if (best<0 || wall<best) best=wall;
+    }
+    syscr=proc_io("syscr"); syscw=proc_io("syscw");
+    if (syscr>=0 && syscr0>=0) syscr=(syscr-syscr0)/(long)runs; else syscr=-1;
+    if (syscw>=0 && syscw0>=0) syscw=(syscw-syscw0)/(long)runs; else syscw=-1;
+    if (best<=0) best=1e-6;
+    printf("case=%s in_bytes=%.0f objs=%lu wall=%.4f user=%.4f sys=%.4f mb_s=%.1f objs_s=%.0f ns_obj=%.1f maxrss_kb=%ld minflt=%ld syscr=%ld syscw=%ld\n",
+      c->name, inbytes, objs, best,
+      ru.ru_utime.tv_sec+ru.ru_utime.tv_usec/1e6, ru.ru_stime.tv_sec+ru.ru_stime.tv_usec/1e6,
+      inbytes/1e6/best, objs/best, best*1e9/objs, (long)ru.ru_maxrss, (long)ru.ru_minflt, syscr, syscw);
+    fflush(stdout);
+  }
+  free(argv);
+  return 0;
+}
+
+static void usage(char const *argv0) {
+  fprintf(stderr, "Usage: %s gen <output.pdf> [<key>=<value> ...]\n"
+    "  keys: seed objs streamlen numdens strdens xrefsecs updates\n"
+    "Usage: %s run [-n <runs>] [-d <dir>] <pdfconcat> [<option> ...]\n", argv0, argv0);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  struct GenParams gp;
+  char const *dir="bench.tmp";
+  unsigned runs=3;
+  int i;
+  if (argc>=3 && 0==strcmp(argv[1], "gen")) {
+    gen_defaults(&gp);
+    for (i=3; i<argc; i++) if (!gen_param(&gp, argv[i])) usage(argv[0]);
+    gen_pdf(argv[2], &gp);
+    return 0;
+  }
+  if (argc<3 || 0!=strcmp(argv[1], "run")) usage(argv[0]);
+  for (i=2; i+1<argc && argv[i][0]=='-'; i+=2) {
+    if (0==strcmp(argv[i], "-n") && (runs=atoi(argv[i+1]))>0) {}
+    else if (0==strcmp(argv[i], "-d")) dir=argv[i+1];
+    else usage(argv[0]);
+  }
+  if (i>=argc) usage(argv[0]);
+  return bench_run(dir, runs, argv+i, argc-i);
+}
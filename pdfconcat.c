@@ -37,10 +37,101 @@
  * Imp: optional safe mode, emitting more '\0'
  * Imp: true generation handling
  * Imp: extensive documentation
- * Dat: output must be seekable, so it cannot be a pipe
+ * Dat: output may be a pipe, output offsets are counted in curws.ofs
  * Dat: ungetc() destroys value of ftell(), even after getc()...
  */
 
+/* Dat: USE_MMAP=1 maps the input files to memory with mmap(2) (POSIX),
+ *      USE_MMAP=0 reads them with fread() through a private window buffer.
+ */
+#ifndef USE_MMAP
+#  if (defined(__unix__) || defined(__APPLE__)) && !defined(__TINYC__)
+#    define USE_MMAP 1
+#  else
+#    define USE_MMAP 0
+#  endif
+#endif
+/* Dat: USE_ZEROCOPY=1 copies long stream bodies between regular files in
+ *      the kernel, with copy_file_range(2) or sendfile(2) (Linux).
+ */
+#ifndef USE_ZEROCOPY
+#  if defined(__linux__) && USE_MMAP
+#    define USE_ZEROCOPY 1
+#  else
+#    define USE_ZEROCOPY 0
+#  endif
+#endif
+/* Dat: USE_IO_URING=1 enables `--uring': inputs are read with io_uring(7),
+ *      with the reads of the objects queued next submitted ahead (Linux
+ *      5.6+). Uses the system calls directly, liburing is not needed.
+ */
+#ifndef USE_IO_URING
+#  if defined(__linux__) && defined(__GNUC__) && !defined(__TINYC__) && defined(__has_include)
+#    if __has_include(<linux/io_uring.h>)
+#      define USE_IO_URING 1
+#    endif
+#  endif
+#endif
+#ifndef USE_IO_URING
+#  define USE_IO_URING 0
+#endif
+/* Dat: USE_FORK=1 enables `-j <jobs>': worker processes parse the inputs
+ *      in parallel, see seg_stitch() (POSIX).
+ */
+#ifndef USE_FORK
+#  define USE_FORK USE_MMAP
+#endif
+/* Dat: USE_LFS=1 makes slen_t (file offsets, object numbers, lengths)
+ *      64-bit on 32-bit systems too, with _FILE_OFFSET_BITS=64 (C99, POSIX).
+ *      On LP64 systems (e.g. Linux amd64) slen_t is always 64-bit.
+ */
+#ifndef USE_LFS
+#  if USE_MMAP && defined(__STDC_VERSION__) && __STDC_VERSION__>=199901L
+#    define USE_LFS 1
+#  else
+#    define USE_LFS 0
+#  endif
+#endif
+/* Dat: USE_SETJMP=1 makes errors return from pdfconcat_run() with the exit
+ *      code, USE_SETJMP=0 makes them exit() the process.
+ */
+#ifndef USE_SETJMP
+#  ifdef __TINYC__
+#    define USE_SETJMP 0
+#  else
+#    define USE_SETJMP 1
+#  endif
+#endif
+/* Dat: USE_TLS=1 makes the current context thread-local, so independent
+ *      contexts can be run by different threads at the same time.
+ */
+#ifndef USE_TLS
+#  if defined(__GNUC__) && !defined(__TINYC__)
+#    define USE_TLS 1
+#  else
+#    define USE_TLS 0
+#  endif
+#endif
+/* Dat: USE_FTRUNCATE=1 makes a failed `--append' cut the output back to
+ *      its old size with ftruncate(2) (POSIX), see w_append_undo().
+ */
+#ifndef USE_FTRUNCATE
+#  if (defined(__unix__) || defined(__APPLE__)) && !defined(__TINYC__)
+#    define USE_FTRUNCATE 1
+#  else
+#    define USE_FTRUNCATE 0
+#  endif
+#endif
+#if USE_LFS && !defined(_FILE_OFFSET_BITS)
+#  define _FILE_OFFSET_BITS 64  /* for fseeko(), ftello(), mmap() */
+#endif
+#if (USE_ZEROCOPY || USE_IO_URING) && !defined(_GNU_SOURCE)
+#  define _GNU_SOURCE 1  /* for copy_file_range(), syscall() and pread() */
+#endif
+#if (USE_MMAP || USE_FTRUNCATE) && !defined(_POSIX_C_SOURCE)
+#  define _POSIX_C_SOURCE 200112L  /* for fileno() and ftruncate() with -ansi */
+#endif
+
 #ifdef __TINYC__  /* pts-tcc, tcc (Tiny C Compiler) by Fabrice Bellard. https://bellard.org/tcc/ */
   #ifndef __SIZEOF_INT__
   #define __SIZEOF_INT__ 4
@@ -64,6 +155,7 @@
   /* string.h */
   int memcmp(const void *s1, const void *s2, size_t n);
   void *memcpy(void *dest, const void *src, size_t n);
+  void *memmove(void *dest, const void *src, size_t n);
   void *memset(void *s, int c, size_t n);
   int strcmp(const char *s1, const char *s2);
   size_t strlen(const char *s);
@@ -89,7 +181,18 @@
   int ferror(FILE *stream);
   int fclose(FILE *stream);
   long ftell(FILE *stream);
+  void rewind(FILE *stream);
+  FILE *tmpfile(void);
   int sscanf(const char *str, const char *format, ...);
+  extern FILE* stdin;
+  void qsort(void *base, size_t nmemb, size_t size, int (*compar)(const void *, const void *));
+
+  /* time.h */
+  #define CLOCKS_PER_SEC 1000000L
+  typedef long clock_t;
+  typedef long time_t;
+  clock_t clock(void);
+  time_t time(time_t *t);
 
   /* assert.h */
   #define assert(x) do {} while (0)
@@ -100,9 +203,66 @@
 #  include <errno.h> /* errno */
 #  include <assert.h>
 #  include <stdint.h>  /* defines INT_FAST32_MAX */
+#  include <time.h> /* clock() */
+#endif
+#if USE_SETJMP
+#  include <setjmp.h>
+#endif
+#if USE_TLS
+#  define PDFCONCAT_TLS __thread
+#else
+#  define PDFCONCAT_TLS
+#endif
+#include "pdfconcat.h"
+#if defined(_WIN32) && !defined(__TINYC__)
+#  include <io.h> /* _setmode() */
+#  include <fcntl.h> /* _O_BINARY */
+#endif
+#if USE_MMAP
+#  include <sys/types.h>
+#  include <sys/stat.h> /* fstat() */
+#  include <sys/mman.h> /* mmap() */
+#  include <fcntl.h> /* posix_fadvise() */
+#  include <sys/time.h> /* gettimeofday() */
+#  include <sys/resource.h> /* getrusage() */
+#endif
+#if USE_FTRUNCATE
+#  include <sys/types.h>
+#  include <unistd.h> /* ftruncate() */
+#endif
+#if USE_FORK
+#  include <unistd.h> /* fork() */
+#  include <sys/wait.h> /* waitpid() */
+#  include <signal.h> /* kill() */
+#endif
+#if USE_MMAP  /* Dat: POSIX, off_t may be longer than long */
+#  define r_fseek(f, ofs) fseeko(f, (off_t)(ofs), SEEK_SET)
+#else
+#  define r_fseek(f, ofs) fseek(f, (long)(ofs), SEEK_SET)
+#endif
+#if USE_IO_URING
+#  include <unistd.h> /* syscall(), pread() */
+#  include <sys/syscall.h> /* __NR_io_uring_setup */
+#  include <sys/mman.h> /* mmap() */
+#  include <linux/io_uring.h>
+#endif
+#if USE_ZEROCOPY
+#  include <unistd.h> /* copy_file_range() */
+#  include <sys/sendfile.h>
+#  if defined(__GLIBC__) && (__GLIBC__>2 || (__GLIBC__==2 && __GLIBC_MINOR__>=27))
+#    define HAVE_COPY_FILE_RANGE 1
+#  endif
 #endif
 
-#if INT_FAST32_MAX >= 2147483647 || __SIZEOF_INT__ >= 4
+#if __SIZEOF_LONG__ >= 8 || defined(_LP64) || defined(__LP64__)
+  typedef unsigned long slen_t;  /* Dat: for inputs and outputs >4 GiB */
+  typedef long slendiff_t;
+#  define SLEN_P "l"
+#elif USE_LFS
+  typedef unsigned long long slen_t;
+  typedef long long slendiff_t;
+#  define SLEN_P "ll"
+#elif INT_FAST32_MAX >= 2147483647 || __SIZEOF_INT__ >= 4
   typedef unsigned slen_t;
   typedef int slendiff_t;
 #  define SLEN_P ""
@@ -176,22 +336,106 @@ static int findword_stripslash(char const*word) {
 
 /* --- Reading */
 
+/** An entry of the input xref table, packed to 8 bytes: see XE_OFS(),
+ * XE_TYPE() and xe_set(). The target object numbers (curws.tnums) and the
+ * queue (curws.queue) are kept apart, only for the reached objects.
+ */
 struct XrefEntry {
-  slen_t ofs;
+  unsigned ofslo; /* bits 0..31 of the offset */
+  unsigned short ofshi; /* bits 32..44 of the offset, the type in bits 13..15 */
   unsigned short gennum;
-  char type; /* 'n' or 'f' */
+};
+
+/** Offset of e; for type 'c': number of the object stream */
+#define XE_OFS(e) ((slen_t)(e)->ofslo | (slen_t)((e)->ofshi&0x1fffU)<<16<<16)
+/** Type of e: 'n', 'f', 'c' (in an object stream not decoded yet), 'o' (in
+ * a decoded object stream: the offset is virtual, see r_seek()), or '\0'
+ * if missing
+ */
+#define XE_TYPE(e) ("\0nfco"[(e)->ofshi>>13])
+/** Largest offset fitting in a struct XrefEntry: 2**45-1 (or less) */
+#define XE_OFS_MAX ((((slen_t)1<<16<<16)<<13)-1)
+
+/** Entries per page of currs.xrefpages and of a struct SparseNums */
+#define SPARSE_PAGE 1024
+
+/** Numbers indexed by input object number, 0 by default. Only the pages
+ * having a nonzero number are allocated, see sn_set().
+ */
+struct SparseNums {
+  unsigned **pages;
+  slen_t pagec;
+};
+
+/** Bytes of a --dedup hash: the first 128 bits of SHA-256 */
+#define DD_HASHLEN 16
+
+/** SHA-256 (FIPS 180-4) of a --dedup hash being computed, see dd_update() */
+struct DedupSha {
+  unsigned long st[8]; /* Dat: only the low 32 bits are used */
+  unsigned char buf[64];
+  slen_t len; /* bytes added so far */
+};
+
+/** An object reachable in the current input, for --dedup, see dd_scan() */
+struct DedupNode {
+  slen_t xi; /* input object number */
+  /** Hash of the object, with the hashes of the referred objects included.
+   * Before dd_finish(), only its own tokens and stream bytes.
+   */
+  unsigned char h[DD_HASHLEN];
+  slen_t size; /* bytes in the input */
+  slen_t kidofs, kidc; /* referred objects are currs.ddkids[kidofs...] */
+  slen_t idx, low, pos; /* for Tarjan's algorithm in dd_finish() */
+  /** 0: can be merged, not emitted yet; 'e': emitted; 'u': unique: never
+   * merged (in a reference cycle, or rewritten like the /Catalog)
+   */
+  char state;
+  sbool onstack;
+};
+
+/** A decoded object stream (/Type/ObjStm, PDF 1.5) */
+struct ObjStm {
+  slen_t vofs; /* virtual offset of data[0] */
+  slen_t len;
+  unsigned char *data;
+};
+
+/** Size of currs.intcache */
+#define INTCACHE_SIZE 64
 
-  slen_t target_num; /* 0: not reached yet */
-  struct XrefEntry *next;
+struct IntCacheEntry {
+  slen_t num1; /* object number+1, 0: empty */
+  slendiff_t val;
 };
 
-static struct ReadState {
+struct ReadState {
   FILE *file;
   char const* filename;
   slen_t filesize;
-  struct XrefEntry *xrefs;
+  /** Input window: file bytes [bufofs,bufofs+(bufend-buf)) are at buf, the
+   * next byte to read is at bufp. If the file is mmap()ed, the window is the
+   * whole file, otherwise it is rbuf.
+   */
+  unsigned char const *buf, *bufp, *bufend;
+  slen_t bufofs;
+  void *map; /* NULL or the mmap()ed file */
+  /** Entry I is xrefpages[I/SPARSE_PAGE][I%SPARSE_PAGE], see xref_at(). A
+   * page is allocated when one of its entries is set, so a huge /Size with
+   * few objects is cheap.
+   */
+  struct XrefEntry **xrefpages;
   slen_t xrefc;
-  slen_t lastofs; /* set by gettok() for 'E', '.', '1' or 'b' etc. */
+  /** Decoded object streams, in increasing vofs order. Their bytes can be
+   * read at virtual offsets >currs.filesize, so objects in them are read
+   * with the same r_seek() and gettok() as other objects.
+   */
+  struct ObjStm *objstms;
+  slen_t objstmc, objstma;
+  slen_t vofsend; /* virtual offset for the next object stream */
+  slen_t tokofs; /* set by gettok(): file offset where it started reading */
+  slen_t seekc; /* number of r_seek() calls -- for debugging and --stats */
+  slen_t tokc; /* number of tokens lexed by gettok() */
   slen_t catalogofs;
   slen_t uppagesofs;
   slen_t pagecount;
@@ -199,32 +443,165 @@ static struct ReadState {
   slen_t trailer1ofs;
   sbool is_binary;
   char pdf_header[10];
-} currs;
+  slen_t srci; /* index of the input, from 0 */
+  sbool uring_p; /* read by ur_fill() instead of fread() */
+  /** If curws.dedup_p: reachable objects, in BFS order, and the node of
+   * each xref entry (index+1, 0 if unreachable)
+   */
+  struct DedupNode *ddnodes;
+  slen_t ddnodec, ddnodea;
+  struct SparseNums ddnode;
+  slen_t *ddkids;
+  slen_t ddkidc, ddkida;
+  /** /Length of the dict last read by wr_enqueue_struct() or
+   * dd_scan_struct(), if length_p: an int, or if lengthgen>=0, the object
+   * number of an indirect one
+   */
+  sbool length_p;
+  slendiff_t length, lengthgen;
+  /** Integer objects already read by r_int_obj(), by number mod size */
+  struct IntCacheEntry intcache[INTCACHE_SIZE];
+};
 
-static void erri(char const*msg1, char const*msg2) {
-  fflush(stdout);
-  fprintf(stderr, "%s: error at %s:%" SLEN_P"u: %s%s\n",
-    PROGNAME, currs.filename, (slen_t)ftell(currs.file), msg1, msg2?msg2:"");
-  exit(3);
-}
-static void errn(char const*msg1, char const*msg2) {
-  fflush(stdout);
-  fprintf(stderr, "%s: error: %s%s\n",
-    PROGNAME, msg1, msg2?msg2:"");
-  exit(3);
-}
+/** File offset of the next byte to be read */
+#define R_TELL() (currs.bufofs+(slen_t)(currs.bufp-currs.buf))
+/** Reads a byte from the input window, @return 0..255 or -1 on EOF */
+#define R_GETC() (currs.bufp!=currs.bufend ? *currs.bufp++ : r_fill())
+/** Puts back the byte just returned by R_GETC() */
+#define R_UNGETC(c) ((c)<0 ? (void)0 : (void)currs.bufp--)
 
 /** Also limits maximum string length */
 #define IBUFSIZE 32768
 
-/** Input buffer for several operations. */
-char ibuf[IBUFSIZE];
-/** Position after last valid char in ibuf */
-char *ibufb;
-
 typedef slendiff_t pdfint_t;
 
-pdfint_t ibuf_int;
+/** Maximum number of tokens pushed back at a time; `N G R' detection needs
+ * 2, plus 1 for r_seek_ref() pushing back N if it isn't a reference.
+ */
+#define PBMAX 3
+
+struct PushedTok {
+  char tok;
+  pdfint_t ival;
+  slen_t ofs; /* tokofs of the token */
+  slen_t len;
+};
+
+#define RBUFSIZE 65536
+/** Maximum length of an error message */
+#define ERRSIZE 2048
+/** Maximum length of a file name or a message part in an error message */
+#define ERRPART 512
+
+/* --- Context */
+
+struct WriteState;
+struct InflateState;
+struct DeflateState;
+struct InputCache;
+struct URing;
+
+/** All the state of a merge, see pdfconcat.h. The code refers to the
+ * members of the context being run (cur_ctx) by macros, e.g. currs, curws
+ * and ibuf.
+ */
+struct pdfconcat_ctx {
+  struct ReadState rs; /* currs */
+  struct WriteState *ws; /* curws */
+  /** Input buffer for several operations. */
+  char pc_ibuf[IBUFSIZE];
+  /** Position after last valid char in ibuf */
+  char *pc_ibufb;
+  pdfint_t pc_ibuf_int;
+  /** Tokens pushed back by ungettok(), pbtoks[pbc-1] will be read next */
+  struct PushedTok pc_pbtoks[PBMAX];
+  unsigned pc_pbc;
+  /** Text of the tokens in pbtoks */
+  char pc_pbbuf[PBMAX][IBUFSIZE];
+  /** Input window, if the input isn't mmap()ed */
+  unsigned char pc_rbuf[RBUFSIZE];
+  struct InflateState *pc_zs;
+  struct DeflateState *pc_zd;
+  struct URing *pc_ur; /* NULL or the io_uring of `--uring' */
+  struct InputCache *pc_caches; /* sorted by filename */
+  slen_t pc_cachec;
+  char const **mfjobv; /* NULL or the jobs of the --manifest */
+  char *mfbuf; /* NULL or the text of the --manifest */
+  /** NULL or the page ranges of the inputs in the jobs, and the input
+   * names without them, see split_pagesels()
+   */
+  char const **mfselv;
+  char *selbuf;
+  /** NULL or a malloc()ed buffer in use, freed by pc_cleanup() if an error
+   * interrupts its user
+   */
+  void *tmp;
+  pdfint_t jobs; /* `-j' */
+  sbool worker_p; /* in a worker process: errors _exit() */
+#if USE_SETJMP
+  jmp_buf jmp;
+#endif
+  char err[ERRSIZE]; /* the last error message */
+};
+
+/** The context being run by pdfconcat_run() or pdfconcat_run_manifest() */
+static PDFCONCAT_TLS struct pdfconcat_ctx *cur_ctx;
+
+#define currs (cur_ctx->rs)
+#define curws (*cur_ctx->ws)
+#define ibuf (cur_ctx->pc_ibuf)
+#define ibufb (cur_ctx->pc_ibufb)
+#define ibuf_int (cur_ctx->pc_ibuf_int)
+#define pbtoks (cur_ctx->pc_pbtoks)
+#define pbc (cur_ctx->pc_pbc)
+#define pbbuf (cur_ctx->pc_pbbuf)
+#define rbuf (cur_ctx->pc_rbuf)
+#define zs (*cur_ctx->pc_zs)
+#define zd (*cur_ctx->pc_zd)
+#define urs (*cur_ctx->pc_ur)
+#define caches (cur_ctx->pc_caches)
+#define cachec (cur_ctx->pc_cachec)
+
+/** Fails the current run with exit code code, cur_ctx->err describes the
+ * error. Worker processes print it and exit, the main process fails with
+ * that code, see seg_stitch().
+ */
+static void seg_kill_all(void);
+static void w_append_undo(void);
+
+static void pc_fail(int code) {
+  if ((cur_ctx->worker_p || !USE_SETJMP) && cur_ctx->err[0]!='\0') {
+    fflush(stdout);
+    fprintf(stderr, "%s\n", cur_ctx->err);
+  }
+#if USE_FORK
+  if (cur_ctx->worker_p) _exit(code);
+#endif
+#if USE_SETJMP
+  longjmp(cur_ctx->jmp, code);
+#else
+  seg_kill_all(); /* Dat: pc_cleanup() isn't called */
+  w_append_undo();
+  exit(code);
+#endif
+}
+
+static void erri(char const*msg1, char const*msg2) {
+  sprintf(cur_ctx->err, "%s: error at %.*s:%" SLEN_P"u: %.*s%.*s",
+    PROGNAME, ERRPART, currs.filename, R_TELL(), ERRPART, msg1, ERRPART, msg2?msg2:"");
+  pc_fail(3);
+}
+static void errn(char const*msg1, char const*msg2) {
+  sprintf(cur_ctx->err, "%s: error: %.*s%.*s",
+    PROGNAME, ERRPART, msg1, ERRPART, msg2?msg2:"");
+  pc_fail(3);
+}
+
+/** Fails with code and a message about filename, e.g "open" and strerror() */
+static void err_file(int code, char const *what, char const *filename, char const *msg) {
+  sprintf(cur_ctx->err, "%s: %s %.*s: %.*s", PROGNAME, what, ERRPART, filename, ERRPART, msg);
+  pc_fail(code);
+}
 
 static /*inline*/ sbool is_ps_white(int/*char*/ c) {
   return c=='\n' || c=='\r' || c=='\t' || c==' ' || c=='\f' || c=='\0';
@@ -251,113 +628,924 @@ static sbool is_wordx(char const *s) {
 }
 #endif
 
-/** @param b: assume null-terminated @return true on error */
-static /*inline*/ sbool toInteger(char *s, pdfint_t *ret) {
-  /* Dat: for both toInteger() and PDF `-5' and `+5' is OK, `--5' isn't */
-  int n=0; /* BUGFIX?? found by __CHECKER__ */
-  return sscanf(s, "%" SLEN_P"i%n", ret, &n)<1 || s[n]!='\0';
+#define IS_DIGIT(c) ULE((c)-'0','9'-'0')
+
+/** Parses a PDF number token in [p,pend), without sscanf().
+ * Dat: for both scan_number() and PDF `-5' and `+5' is OK, `--5' isn't
+ * Dat: `.5' and `6.' are valid PDF reals, `0x10' and `1e5' aren't numbers
+ * Dat: leading zeros don't mean octal (unlike with sscanf("%i"))
+ * @return '1' for an integer (*ret is set), '.' for a real or an integer
+ *   which doesn't fit to pdfint_t, 'e' for exponential notation (6e7),
+ *   0 for a non-number
+ */
+static char scan_number(char const *p, char const *pend, pdfint_t *ret) {
+  slen_t v=0, vmax=((slen_t)-1)>>1;
+  sbool neg=FALSE, ovf=FALSE, digit_p;
+  char const *q;
+  if (p!=pend && (*p=='-' || *p=='+')) { if (*p++=='-') { neg=TRUE; vmax++; } }
+  for (q=p; p!=pend && IS_DIGIT(*p); p++) {
+    if (v>(vmax-(*p-'0'))/10) ovf=TRUE;
+                         else v=10*v+(*p-'0');
+  }
+  digit_p=p!=q;
+  if (p==pend) {
+    if (!digit_p) return 0;
+    if (ovf) return '.';
+    *ret=neg && v!=0 ? -(pdfint_t)(v-1)-1 : (pdfint_t)v;
+    return '1';
+  }
+  if (*p=='.') {
+    for (p++; p!=pend && IS_DIGIT(*p); p++) digit_p=TRUE;
+  }
+  if (!digit_p) return 0;
+  if (p==pend) return '.';
+  if (*p!='e' && *p!='E') return 0;
+  if (++p!=pend && (*p=='+' || *p=='-')) p++;
+  for (q=p; p!=pend && IS_DIGIT(*p); p++) {}
+  return p==pend && p!=q ? 'e' : 0;
 }
 
-/** @param b: assume null-terminated @return true on error */
-static /*inline*/ sbool toReal(char *s, double *ret) {
-  int n;
-  char c;
-  /* Dat: glibc accepts "12e", "12E", "12e+" and "12E-" */
-  return sscanf(s, "%lf%n", ret, &n)<1
-      || (c=s[n-1])=='e' || c=='E' || c=='+' || c=='-' || s[n]!='\0';
+/** Formats v like sprintf("%d"), but doesn't append '\0'.
+ * @return pointer after the last char written
+ */
+static char *fmt_int(char *p, pdfint_t v) {
+  char tmp[3*sizeof(v)+1], *t=tmp+sizeof(tmp);
+  slen_t u=v<0 ? 0-(slen_t)v : (slen_t)v;
+  do { *--t=(char)('0'+u%10); } while ((u/=10)!=0);
+  if (v<0) *p++='-';
+  while (t!=tmp+sizeof(tmp)) *p++=*t++;
+  return p;
 }
 
-static void r_seek(slen_t begofs) {
-  if (0!=fseek(currs.file, begofs, SEEK_SET)) {
-    fprintf(stderr, "%s: unseekable %s: %s\n", PROGNAME, currs.filename, strerror(errno));
-    exit(6);
+/** Formats v<10**10 like sprintf("%010u") to p[0...10), without '\0'. */
+static void fmt_010(char *p, slen_t v) {
+  char *q=p+10;
+  while (q!=p) { *--q=(char)('0'+v%10); v/=10; }
+}
+
+/** Size of the input window when the file isn't mmap()ed */
+
+/** Moves the input window forward. Called by R_GETC() only. */
+/* --- io_uring reads, see `--uring' */
+
+#if USE_IO_URING
+/** Bytes of an input block read at once, a multiple of the page size */
+#define UR_BLOCK RBUFSIZE
+/** Most reads in flight: the queue depth */
+#define UR_DEPTH 32
+/** Cached blocks, a power of 2 larger than UR_DEPTH. Dat: direct mapped
+ * by block index, so a block read ahead stays until one mapped to the same
+ * slot is needed.
+ */
+#define UR_SLOTS 128
+/** Blocks read ahead after sequential ur_fill()s, e.g. in stream bodies */
+#define UR_READAHEAD 4
+
+struct URSlot {
+  slen_t blk1; /* block index+1 in the current input, 0: empty */
+  slendiff_t len; /* bytes read, -1: in flight */
+};
+
+/** An io_uring, and the blocks of the current input read by it */
+struct URing {
+  int fd; /* -1: not set up yet, -2: unavailable */
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray, *cqhead, *cqtail, *cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sqring, *cqring;
+  size_t sqringsize, cqringsize, sqessize;
+  unsigned inflight, unsubmitted;
+  slen_t lastblk1; /* of the last ur_fill(), for read-ahead */
+  struct URSlot slots[UR_SLOTS];
+  unsigned char *data; /* UR_SLOTS*UR_BLOCK bytes, for the slots */
+};
+
+/** Unmaps and closes the ring of urs, the slots are dropped. Dat: in a
+ * worker process, the ring (shared with the parent) is unusable.
+ */
+static void ur_close(void) {
+  unsigned k;
+  if (urs.fd>=0) {
+    if (urs.sqes!=NULL) munmap(urs.sqes, urs.sqessize);
+    if (urs.cqring!=NULL && urs.cqring!=urs.sqring) munmap(urs.cqring, urs.cqringsize);
+    if (urs.sqring!=NULL) munmap(urs.sqring, urs.sqringsize);
+    close(urs.fd);
   }
+  urs.fd=-1; urs.sqring=urs.cqring=NULL; urs.sqes=NULL;
+  urs.inflight=urs.unsubmitted=0;
+  for (k=0; k<UR_SLOTS; k++) urs.slots[k].blk1=0;
 }
 
-/** Returns a PostScript token ID, puts token into buf */
-static char gettok(void) {
-  /* Derived from MiniPS::Tokenizer::yylex() of sam2p-0.37 */
-  int c=0, d; /* dummy initialization */
-  sbool hi;
-  unsigned hv=0; /* =0: pacify G++ 2.91 */
-  slen_t nest;
-  char *ibufend=ibuf+IBUFSIZE;
-  ibufb=ibuf;
+/** Sets up the ring of urs if needed.
+ * @return FALSE if io_uring is unavailable (e.g. old kernel or seccomp)
+ */
+static sbool ur_start(void) {
+  struct io_uring_params p;
+  long fd;
+  void *m;
+  if (cur_ctx->pc_ur==NULL) {
+    if (NULL==(cur_ctx->pc_ur=(struct URing*)calloc(1, sizeof(struct URing)))
+     || NULL==(urs.data=(unsigned char*)malloc((size_t)UR_SLOTS*UR_BLOCK))) errn("out of memory for --uring",0);
+    urs.fd=-1;
+  }
+  if (urs.fd!=-1) return urs.fd>=0;
+  memset(&p, '\0', sizeof(p));
+  if (0>(fd=syscall(__NR_io_uring_setup, UR_DEPTH, &p))) { urs.fd=-2; return FALSE; }
+  urs.fd=(int)fd;
+  urs.sqringsize=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+  urs.cqringsize=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+  if ((p.features&IORING_FEAT_SINGLE_MMAP)!=0) {
+    if (urs.cqringsize>urs.sqringsize) urs.sqringsize=urs.cqringsize;
+    urs.cqringsize=urs.sqringsize;
+  }
+  urs.sqessize=p.sq_entries*sizeof(struct io_uring_sqe);
+  if (MAP_FAILED==(m=mmap(NULL, urs.sqringsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, urs.fd, IORING_OFF_SQ_RING))) goto fail;
+  urs.sqring=m;
+  if ((p.features&IORING_FEAT_SINGLE_MMAP)!=0) urs.cqring=m;
+  else if (MAP_FAILED==(m=mmap(NULL, urs.cqringsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, urs.fd, IORING_OFF_CQ_RING))) goto fail;
+  else urs.cqring=m;
+  if (MAP_FAILED==(m=mmap(NULL, urs.sqessize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, urs.fd, IORING_OFF_SQES))) goto fail;
+  urs.sqes=(struct io_uring_sqe*)m;
+  urs.sqhead=(unsigned*)((char*)urs.sqring+p.sq_off.head);
+  urs.sqtail=(unsigned*)((char*)urs.sqring+p.sq_off.tail);
+  urs.sqmask=(unsigned*)((char*)urs.sqring+p.sq_off.ring_mask);
+  urs.sqarray=(unsigned*)((char*)urs.sqring+p.sq_off.array);
+  urs.cqhead=(unsigned*)((char*)urs.cqring+p.cq_off.head);
+  urs.cqtail=(unsigned*)((char*)urs.cqring+p.cq_off.tail);
+  urs.cqmask=(unsigned*)((char*)urs.cqring+p.cq_off.ring_mask);
+  urs.cqes=(struct io_uring_cqe*)((char*)urs.cqring+p.cq_off.cqes);
+  return TRUE;
+ fail:
+  ur_close(); urs.fd=-2;
+  return FALSE;
+}
 
-#if 0
-  if (ungot==EOFF) return EOFF;
-  if (ungot!=NO_UNGOT) { c=ungot; ungot=NO_UNGOT; goto again; }
+/** Submits the queued reads, and waits until at least min_complete reads
+ * have completed, recording the completed ones in their slots. Imp: no
+ * system call if there is nothing to submit or wait for.
+ */
+static void ur_enter(unsigned min_complete) {
+  unsigned head, tail;
+  long n=0;
+  struct io_uring_cqe const *cqe;
+  if (min_complete>urs.inflight) min_complete=urs.inflight;
+  do {
+    if ((urs.unsubmitted!=0 || min_complete!=0)
+     && 0>(n=syscall(__NR_io_uring_enter, urs.fd, urs.unsubmitted, min_complete, min_complete!=0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0))) {
+      if (errno!=EINTR && errno!=EAGAIN && errno!=EBUSY) errn("io_uring_enter: ", strerror(errno));
+      n=0;
+    }
+    urs.unsubmitted-=(unsigned)n;
+    head=*urs.cqhead;
+    tail=__atomic_load_n(urs.cqtail, __ATOMIC_ACQUIRE);
+    for (; head!=tail; head++) {
+      cqe=urs.cqes+(head&*urs.cqmask);
+      /* Dat: errors and short reads are retried by ur_fill() with pread() */
+      urs.slots[cqe->user_data].len=cqe->res<0 ? 0 : cqe->res;
+      urs.inflight--;
+      if (min_complete!=0) min_complete--;
+    }
+    __atomic_store_n(urs.cqhead, head, __ATOMIC_RELEASE);
+  } while (min_complete!=0 || (n!=0 && urs.unsubmitted!=0));
+}
+
+/** Waits for all reads in flight, and drops the cached blocks: they belong
+ * to another input from now on.
+ */
+static void ur_reset(void) {
+  unsigned k;
+  if (cur_ctx->pc_ur==NULL) return;
+  if (urs.fd>=0) ur_enter(urs.inflight);
+  for (k=0; k<UR_SLOTS; k++) urs.slots[k].blk1=0;
+  urs.lastblk1=0;
+}
+
+/** Queues the read of block blk of the current input into its slot. */
+static void ur_submit(slen_t blk) {
+  unsigned k=(unsigned)(blk%UR_SLOTS), tail=*urs.sqtail, i=tail&*urs.sqmask;
+  struct io_uring_sqe *sqe=urs.sqes+i;
+  slen_t ofs=blk*UR_BLOCK;
+  memset(sqe, '\0', sizeof(*sqe));
+  sqe->opcode=IORING_OP_READ;
+  sqe->fd=fileno(currs.file);
+  sqe->addr=(unsigned long)(urs.data+(size_t)k*UR_BLOCK);
+  sqe->len=currs.filesize-ofs<UR_BLOCK ? (unsigned)(currs.filesize-ofs) : UR_BLOCK;
+  sqe->off=ofs;
+  sqe->user_data=k;
+  urs.sqarray[i]=i;
+  __atomic_store_n(urs.sqtail, tail+1, __ATOMIC_RELEASE);
+  urs.slots[k].blk1=blk+1; urs.slots[k].len=-1;
+  urs.inflight++; urs.unsubmitted++;
+}
+
+/** Starts reading block blk ahead, unless it is cached, in flight, or its
+ * slot is busy (in flight or the current input window), or too many reads
+ * are in flight. Call ur_enter(0) to submit.
+ */
+static void ur_readahead(slen_t blk) {
+  struct URSlot *sl=urs.slots+blk%UR_SLOTS;
+  if (blk*UR_BLOCK>=currs.filesize || sl->blk1==blk+1 || sl->len==-1
+   || urs.inflight==UR_DEPTH || urs.fd<0
+   || currs.buf==urs.data+(size_t)(blk%UR_SLOTS)*UR_BLOCK) return;
+  ur_submit(blk);
+}
+
+/** r_fill() for currs.uring_p: moves the input window to the cached block
+ * containing currs.bufofs, reading it if needed.
+ */
+static int ur_fill(void) {
+  slen_t blk=currs.bufofs/UR_BLOCK, ofs=blk*UR_BLOCK, want, i;
+  struct URSlot *sl=urs.slots+blk%UR_SLOTS;
+  unsigned char *data=urs.data+(size_t)(blk%UR_SLOTS)*UR_BLOCK;
+  ssize_t n;
+  if (urs.fd==-1) ur_start(); /* Dat: in a worker process */
+  while (sl->len==-1 && sl->blk1!=blk+1) ur_enter(1); /* Dat: its slot is busy with another block */
+  if (sl->blk1!=blk+1) {
+    if (urs.fd>=0) {
+      while (urs.inflight==UR_DEPTH) ur_enter(1);
+      ur_submit(blk);
+    } else {
+      sl->blk1=blk+1; sl->len=0;
+    }
+  }
+  if (urs.fd>=0) {
+    if (urs.lastblk1==blk) for (i=1; i<=UR_READAHEAD; i++) ur_readahead(blk+i);
+    ur_enter(0);
+    while (sl->len==-1) ur_enter(1);
+  }
+  urs.lastblk1=blk+1;
+  want=currs.filesize-ofs<UR_BLOCK ? currs.filesize-ofs : UR_BLOCK;
+  while ((slen_t)sl->len<want) { /* Dat: short read, error or no io_uring */
+    if (0>=(n=pread(fileno(currs.file), data+sl->len, want-sl->len, (off_t)(ofs+sl->len)))) {
+      sl->blk1=0;
+      if (n<0) err_file(3, "read", currs.filename, strerror(errno));
+      break;
+    }
+    sl->len+=n;
+  }
+  currs.buf=data; currs.bufend=data+sl->len;
+  currs.bufp=currs.buf+(currs.bufofs-ofs); currs.bufofs=ofs;
+  return currs.bufp>=currs.bufend ? -1 : *currs.bufp++;
+}
+
+/** Frees urs, waiting for the reads in flight. */
+static void ur_free(void) {
+  if (cur_ctx->pc_ur==NULL) return;
+  ur_reset(); ur_close();
+  free(urs.data); free(cur_ctx->pc_ur); cur_ctx->pc_ur=NULL;
+}
 #endif
- again_getcc:
-  c=getc(currs.file);
- /* again: */
-  switch (c) {
-   case -1: eof:
-    return 0; /*ungot=EOFF */;
-   case '\n': case '\r': case '\t': case ' ': case '\f': case '\0':
-    goto again_getcc;
-   case '%': /* one-line comment */
-#if 0 /* XMLish tag from ps_tiny.c */
-    if ((c=getc(currs.file))=='<') {
-      char ret='<';
-      if ((c=getc(currs.file))=='/') { ret='>'; c=getc(currs.file); } /* close tag */
-      if (!ULE(c-'A','Z'-'A')) erri("invalid tag",0); /* catch EOF */
-      (ibufb=ibuf)[0]=c; ibufb++;
-      while (ULE((c=getc(currs.file))-'A','Z'-'A') || ULE(c-'a','z'-'a')) {
-        if (ibufb==ibufend-1) erri("tag too long",0);
-        *ibufb++=c;
-      }
-      if (c<0) erri("unfinished tag",0);
-      *ibufb='\0';
-      ungetc(c,currs.file);
-      return ret;
+
+static int r_fill(void) {
+  slen_t got;
+  if (currs.map!=NULL) return -1; /* the whole file is in the window */
+  if (currs.bufofs+(slen_t)(currs.bufend-currs.buf)>=currs.filesize) return -1; /* EOF or end of object stream */
+  currs.bufofs+=currs.bufend-currs.buf;
+#if USE_IO_URING
+  if (currs.uring_p) return ur_fill();
+#endif
+  got=fread(rbuf, 1, RBUFSIZE, currs.file);
+  currs.buf=currs.bufp=rbuf; currs.bufend=rbuf+got;
+  return got==0 ? -1 : *currs.bufp++;
+}
+
+/** Moves the input window to the object stream containing virtual offset
+ * begofs, or to an empty window past EOF.
+ */
+static void r_seek_objstm(slen_t begofs) {
+  struct ObjStm *lo=currs.objstms, *hi=lo+currs.objstmc, *mid;
+  while (hi-lo>1) {
+    mid=lo+(hi-lo)/2;
+    if (mid->vofs<=begofs) lo=mid; else hi=mid;
+  }
+  if (lo!=hi && begofs-lo->vofs<=lo->len) {
+    currs.buf=lo->data; currs.bufend=lo->data+lo->len; currs.bufofs=lo->vofs;
+  } else { /* past EOF, like fseek() */
+    currs.buf=currs.bufend=rbuf; currs.bufofs=begofs;
+  }
+  currs.bufp=currs.buf+(begofs-currs.bufofs);
+}
+
+/** Positioning within the input window doesn't need a system call. */
+static void r_seek(slen_t begofs) {
+  pbc=0; /* drop pushed back tokens */
+  currs.seekc++;
+  if (begofs-currs.bufofs<=(slen_t)(currs.bufend-currs.buf)) {
+    currs.bufp=currs.buf+(begofs-currs.bufofs);
+  } else if (begofs>=currs.filesize) {
+    r_seek_objstm(begofs);
+  } else if (currs.map!=NULL) { /* back from an object stream */
+    currs.buf=(unsigned char const*)currs.map; currs.bufend=currs.buf+currs.filesize;
+    currs.bufofs=0; currs.bufp=currs.buf+begofs;
+#if USE_IO_URING
+  } else if (currs.uring_p) { /* Dat: ur_fill() reads at bufofs */
+    currs.bufofs=begofs; currs.buf=currs.bufp=currs.bufend=rbuf;
+#endif
+  } else if (0!=r_fseek(currs.file, begofs)) {
+    err_file(6, "unseekable", currs.filename, strerror(errno));
+  } else {
+    currs.bufofs=begofs; currs.buf=currs.bufp=currs.bufend=rbuf;
+  }
+}
+
+/** Reads at most len bytes from the input. @return number of bytes read */
+static slen_t r_read(char *dst, slen_t len) {
+  slen_t got=0, n;
+  while (got!=len) {
+    if (currs.bufp==currs.bufend) {
+      if (r_fill()<0) break;
+      currs.bufp--;
     }
+    if ((n=currs.bufend-currs.bufp)>len-got) n=len-got;
+    memcpy(dst+got, currs.bufp, n);
+    currs.bufp+=n; got+=n;
+  }
+  return got;
+}
+
+#if USE_ZEROCOPY
+/** Don't bother with the kernel copy for shorter streams: the fflush() and
+ * the fstat()s would cost more than the copy itself.
+ */
+#define ZEROCOPY_MIN 65536
+
+/** Copies len bytes from the input to wf within the kernel, with
+ * copy_file_range() or (e.g on EXDEV, or to a pipe or socket) sendfile().
+ * The input must be a regular file. Flushes wf first; if wf is a regular file,
+ * moves its file position past the bytes copied.
+ * @return number of bytes copied, the caller copies the rest
+ */
+static slen_t r_copy_zero(FILE *wf, slen_t len) {
+  struct stat st;
+  int ifd=fileno(currs.file), ofd=fileno(wf);
+  slen_t got=0;
+  ssize_t n;
+  sbool reg_p;
+#if HAVE_COPY_FILE_RANGE
+  loff_t cofs=R_TELL();
+  sbool cfr_p;
 #endif
-    while (c!='\n' && c!='\r' && c!=-1) c=getc(currs.file);
-    if (c==-1) goto eof;
-    goto again_getcc;
-   case '[':
-    *ibufb++=c;
-    return '[';
-   case ']':
-    *ibufb++=c;
-    return ']';
-   case '{': case '}':
-    erri("proc arrays disallowed",0);  /* allowed in PS, but not in PDF */
-    break;  /* unreached */
-   case '>':
-    if (getc(currs.file)!='>') goto err;
-    *ibufb++='>'; *ibufb++='>';
-    return '>';
-   case '<':
-    if ((c=getc(currs.file))==-1) { uf_hex: erri("unfinished hexstr",0); }
-    if (c=='<') {
-      *ibufb++='<'; *ibufb++='<';
-      return '<';
+  off_t sofs=R_TELL(), wofs=0;
+  if (0!=fflush(wf)
+   || 0!=fstat(ifd, &st) || !S_ISREG(st.st_mode)
+   || 0!=fstat(ofd, &st)) return 0;
+  reg_p=S_ISREG(st.st_mode);
+  /* Dat: not curws.ofs, e.g. stdout may be opened at a nonzero offset */
+  if (reg_p && 0>(wofs=lseek(ofd, 0, SEEK_CUR))) return 0;
+#if HAVE_COPY_FILE_RANGE
+  cfr_p=reg_p;
+#endif
+  while (got!=len) {
+#if HAVE_COPY_FILE_RANGE
+    if (cfr_p) {
+      if (0<(n=copy_file_range(ifd, &cofs, ofd, NULL, len-got, 0))) { got+=n; continue; }
+      cfr_p=FALSE; sofs=cofs; /* Dat: EXDEV, EINVAL, ENOSYS etc. */
     }
-    if (c=='~') erri("a85str disallowed",0); /* allowed in PS, but not in PDF */
-    hi=1;
-    while (c!='>') {
-           if (ULE(c-'0','9'-'0')) hv=c-'0';
-      else if (ULE(c-'a','f'-'a')) hv=c-'a'+10;
-      else if (ULE(c-'A','F'-'A')) hv=c-'A'+10;
-      else if (is_ps_white(c)) hv=16;
-      else erri("syntax error in hexstr",0);
-      if (hv==16) ;
-      else if (!hi) { ibufb[-1]|=hv; hi=1; }
-      else if (ibufb==ibufend) erri("hexstr literal too long",0);
-      else { *ibufb++=(char)(hv<<4); hi=0; }
-      if ((c=getc(currs.file))==-1) goto uf_hex;
+#endif
+    if (0>=(n=sendfile(ofd, ifd, &sofs, len-got))) break;
+    got+=n;
+  }
+  if (got!=0) {
+    /* Dat: stdio may have cached the file position */
+    if (reg_p && 0!=r_fseek(wf, wofs+got)) errn("cannot seek output after copy",0);
+    r_seek(R_TELL()+got);
+  }
+  return got;
+}
+#endif
+
+/* --- Flate decoding (RFC 1950, RFC 1951) */
+
+/** Number of code bits decoded by a single table lookup */
+#define HUFF_FAST_BITS 9
+
+/** Canonical Huffman code, derived from stb_image's zlib decoder */
+struct Huffman {
+  unsigned short fast[1<<HUFF_FAST_BITS]; /* 0 or code length<<9|symbol */
+  unsigned short firstcode[16], firstsymbol[16];
+  slen_t maxcode[17]; /* first code too long for each length, left-aligned to 16 bits */
+  unsigned char size[288];
+  unsigned short value[288];
+};
+
+struct InflateState {
+  unsigned char const *in;
+  slen_t inpos, inlen;
+  unsigned long bits; /* bit buffer, LSB first */
+  unsigned bitc;
+  unsigned char *out; /* malloc()ed, the caller frees it */
+  slen_t outlen, outa;
+  struct Huffman lit, dist;
+};
+
+static void z_corrupt(void) {
+  free(zs.out); zs.out=NULL;
+  erri("corrupt Flate stream",0);
+}
+
+/** Fills the bit buffer to at least 25 bits; zero bytes follow the input. */
+static void z_refill(void) {
+  while (zs.bitc<=24) {
+    if (zs.inpos<zs.inlen) zs.bits|=(unsigned long)zs.in[zs.inpos]<<zs.bitc;
+    else if (zs.inpos-zs.inlen>=8) z_corrupt(); /* Dat: bits past the end were used */
+    zs.inpos++; zs.bitc+=8;
+  }
+}
+
+static unsigned z_getbits(unsigned n) {
+  unsigned v;
+  z_refill();
+  v=(unsigned)(zs.bits&((1UL<<n)-1)); zs.bits>>=n; zs.bitc-=n;
+  return v;
+}
+
+static unsigned z_rev16(unsigned v) {
+  v=((v&0xAAAA)>>1)|((v&0x5555)<<1);
+  v=((v&0xCCCC)>>2)|((v&0x3333)<<2);
+  v=((v&0xF0F0)>>4)|((v&0x0F0F)<<4);
+  return ((v&0xFF00)>>8)|((v&0x00FF)<<8);
+}
+
+/** Builds h from the code lengths (0..15) of symbols [0,num). */
+static void z_build(struct Huffman *h, unsigned char const *sizes, unsigned num) {
+  unsigned counts[16], next[16], i, s, code=0, k=0, j;
+  memset(counts, '\0', sizeof(counts));
+  memset(h->fast, '\0', sizeof(h->fast));
+  memset(h->size, '\0', sizeof(h->size));
+  for (i=0; i<num; i++) counts[sizes[i]]++;
+  for (s=1; s<16; s++) {
+    next[s]=code; h->firstcode[s]=code; h->firstsymbol[s]=k;
+    code+=counts[s];
+    if (counts[s]!=0 && code-1>=1U<<s) z_corrupt(); /* over-subscribed */
+    h->maxcode[s]=(slen_t)code<<(16-s);
+    code<<=1; k+=counts[s];
+  }
+  h->maxcode[16]=0x10000UL;
+  for (i=0; i<num; i++) if ((s=sizes[i])!=0) {
+    k=next[s]-h->firstcode[s]+h->firstsymbol[s];
+    h->size[k]=(unsigned char)s; h->value[k]=(unsigned short)i;
+    if (s<=HUFF_FAST_BITS) {
+      for (j=z_rev16(next[s])>>(16-s); j<1U<<HUFF_FAST_BITS; j+=1U<<s) h->fast[j]=(unsigned short)(s<<9|i);
     }
-    /* This is correct even if an odd number of hex digits have arrived */
-    return '(';
-   case '(':
-    nest=1;
-    c=getc(currs.file);
-    while (c!=-1) {
-      if (c==')' && --nest==0) return '(';
-      if (c=='\r') {
-        if ((c=getc(currs.file))=='\n') {} /* convert "\r\n" -> "\n", as specified in subsection 3.2.3 of PDFRef.pdf */
+    next[s]++;
+  }
+}
+
+static unsigned z_decode(struct Huffman const *h) {
+  unsigned v, s;
+  slen_t k;
+  z_refill();
+  if ((v=h->fast[zs.bits&((1U<<HUFF_FAST_BITS)-1)])!=0) {
+    s=v>>9; zs.bits>>=s; zs.bitc-=s;
+    return v&511;
+  }
+  k=z_rev16((unsigned)(zs.bits&0xFFFF));
+  for (s=HUFF_FAST_BITS+1; k>=h->maxcode[s]; s++) {}
+  if (s>=16) z_corrupt();
+  v=(unsigned)(k>>(16-s))-h->firstcode[s]+h->firstsymbol[s];
+  if (v>=288 || h->size[v]!=s) z_corrupt();
+  zs.bits>>=s; zs.bitc-=s;
+  return h->value[v];
+}
+
+/** Makes room for n more output bytes. */
+static void z_reserve(slen_t n) {
+  if (n>zs.outa-zs.outlen) {
+    if (n>(slen_t)-1-zs.outlen) z_corrupt();
+    zs.outa=zs.outa>((slen_t)-1)/2 ? (slen_t)-1 : 2*zs.outa;
+    if (zs.outa<zs.outlen+n) zs.outa=zs.outlen+n;
+    if (NULL==(zs.out=(unsigned char*)realloc(zs.out, zs.outa))) errn("out of memory for Flate",0);
+  }
+}
+
+static unsigned short const z_lbase[29]={3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static unsigned char const z_lext[29]={0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static unsigned short const z_dbase[30]={1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static unsigned char const z_dext[30]={0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+/** Decodes the symbols of a Huffman-coded block with zs.lit and zs.dist. */
+static void z_codes(void) {
+  unsigned sym, d;
+  slen_t len, dist;
+  unsigned char *p, *q;
+  while (256!=(sym=z_decode(&zs.lit))) {
+    if (sym<256) {
+      if (zs.outlen==zs.outa) z_reserve(1);
+      zs.out[zs.outlen++]=(unsigned char)sym;
+      continue;
+    }
+    if ((sym-=257)>=29) z_corrupt();
+    len=z_lbase[sym]+z_getbits(z_lext[sym]);
+    if ((d=z_decode(&zs.dist))>=30) z_corrupt();
+    dist=z_dbase[d]+z_getbits(z_dext[d]);
+    if (dist>zs.outlen) z_corrupt();
+    z_reserve(len);
+    p=zs.out+zs.outlen; q=p-dist; zs.outlen+=len;
+    while (len--!=0) *p++=*q++; /* Dat: may overlap */
+  }
+}
+
+/** Order of code length code lengths in a dynamic block header */
+static unsigned char const z_clorder[19]={16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
+
+/** Decodes a zlib stream to the malloc()ed buffer zs.out of zs.outlen bytes.
+ * Dat: the Adler-32 checksum isn't verified
+ */
+static void z_inflate(unsigned char const *in, slen_t inlen) {
+  unsigned char lens[288+32];
+  unsigned final, type, hlit, hdist, n, sym, c, rep;
+  zs.in=in; zs.inpos=2; zs.inlen=inlen; zs.bits=0; zs.bitc=0;
+  zs.outlen=0; zs.outa=inlen<1024 ? 4096 : 4*inlen;
+  if (NULL==(zs.out=(unsigned char*)malloc(zs.outa))) errn("out of memory for Flate",0);
+  if (inlen<2 || (in[0]&15)!=8 || (in[0]*256U+in[1])%31!=0 || (in[1]&32)!=0) z_corrupt();
+  do {
+    final=z_getbits(1);
+    type=z_getbits(2);
+    if (type==0) { /* stored */
+      z_getbits(zs.bitc&7);
+      zs.inpos-=zs.bitc>>3; zs.bits=0; zs.bitc=0; /* Dat: give back whole bytes */
+      if (zs.inlen-zs.inpos<4 || zs.inpos>zs.inlen) z_corrupt();
+      n=in[zs.inpos]|in[zs.inpos+1]<<8;
+      if ((n^(in[zs.inpos+2]|in[zs.inpos+3]<<8))!=0xFFFF) z_corrupt();
+      zs.inpos+=4;
+      if (zs.inlen-zs.inpos<n) z_corrupt();
+      z_reserve(n);
+      memcpy(zs.out+zs.outlen, in+zs.inpos, n);
+      zs.inpos+=n; zs.outlen+=n;
+      continue;
+    } else if (type==1) { /* fixed Huffman codes */
+      memset(lens, 8, 144); memset(lens+144, 9, 112);
+      memset(lens+256, 7, 24); memset(lens+280, 8, 8);
+      z_build(&zs.lit, lens, 288);
+      memset(lens, 5, 32);
+      z_build(&zs.dist, lens, 32);
+    } else if (type==2) { /* dynamic Huffman codes */
+      hlit=z_getbits(5)+257; hdist=z_getbits(5)+1;
+      rep=z_getbits(4)+4;
+      memset(lens, '\0', 19);
+      for (n=0; n<rep; n++) lens[z_clorder[n]]=(unsigned char)z_getbits(3);
+      z_build(&zs.lit, lens, 19);
+      for (n=0; n<hlit+hdist; ) {
+        if ((sym=z_decode(&zs.lit))<16) { lens[n++]=(unsigned char)sym; continue; }
+        if (sym==16) {
+          if (n==0) z_corrupt();
+          c=lens[n-1]; rep=3+z_getbits(2);
+        } else if (sym==17) {
+          c=0; rep=3+z_getbits(3);
+        } else {
+          c=0; rep=11+z_getbits(7);
+        }
+        if (rep>hlit+hdist-n) z_corrupt();
+        memset(lens+n, c, rep); n+=rep;
+      }
+      if (lens[256]==0) z_corrupt();
+      z_build(&zs.lit, lens, hlit);
+      z_build(&zs.dist, lens+hlit, hdist);
+    } else z_corrupt();
+    z_codes();
+  } while (!final);
+  if (zs.inpos-(zs.bitc>>3)>zs.inlen) z_corrupt(); /* truncated */
+}
+
+/* --- Flate encoding */
+
+#define ZD_WSIZE 32768U
+#define ZD_HBITS 15
+/** Maximum number of hash chain links followed per input position */
+#define ZD_MAXCHAIN 32
+/** Number of symbols in a Huffman block */
+#define ZD_BLOCKSYMS 16384
+
+#define ZD_HASH(p) ((((slen_t)(p)[0]<<10)^((slen_t)(p)[1]<<5)^(p)[2])&((1U<<ZD_HBITS)-1))
+
+struct DeflateState {
+  unsigned char *out; /* the caller may use it until the next z_deflate() */
+  slen_t outlen, outa;
+  unsigned long bits; /* bit buffer, LSB first */
+  unsigned bitc;
+  slen_t head[1U<<ZD_HBITS], prev[ZD_WSIZE]; /* input position+1, 0: none */
+  unsigned short syms[2*ZD_BLOCKSYMS]; /* pairs of (literal, 0) or (length, distance) */
+  unsigned char lsym[259]; /* length -> length code-257 */
+  unsigned char dsym[512]; /* distance -> distance code, see zd_dsym() */
+};
+
+static void zd_putbits(unsigned v, unsigned n) {
+  zd.bits|=(unsigned long)v<<zd.bitc; zd.bitc+=n;
+  while (zd.bitc>=8) {
+    if (zd.outlen==zd.outa) {
+      zd.outa=zd.outa<4096 ? 4096 : 2*zd.outa;
+      if (NULL==(zd.out=(unsigned char*)realloc(zd.out, zd.outa))) errn("out of memory for Flate",0);
+    }
+    zd.out[zd.outlen++]=(unsigned char)zd.bits;
+    zd.bits>>=8; zd.bitc-=8;
+  }
+}
+
+#define zd_dsym(d) ((d)<=256 ? zd.dsym[(d)-1] : zd.dsym[256+(((d)-1)>>7)])
+
+/** Computes Huffman code lengths of at most maxbits for freqs[0,n), n<=286.
+ * Frequencies are scaled down until the lengths fit.
+ */
+static void zd_lengths(slen_t const *freqs, unsigned n, unsigned maxbits, unsigned char *lens) {
+  slen_t w[2*286];
+  unsigned short par[2*286], act[286], sym[286];
+  unsigned char depth[2*286];
+  unsigned m, i, nodes, actc, a, b, shift;
+  for (shift=0; ; shift++) {
+    for (m=i=0; i<n; i++) {
+      lens[i]=0;
+      if (freqs[i]!=0) { w[m]=((freqs[i]-1)>>shift)+1; sym[m]=(unsigned short)i; act[m]=(unsigned short)m; m++; }
+    }
+    if (m<2) { /* Dat: a single code must still have 1 bit */
+      if (m==1) lens[sym[0]]=1;
+      return;
+    }
+    for (nodes=actc=m; actc>1; nodes++) { /* join the two lightest nodes */
+      a=0; b=1;
+      if (w[act[b]]<w[act[a]]) { a=1; b=0; }
+      for (i=2; i<actc; i++) {
+        if (w[act[i]]<w[act[a]]) { b=a; a=i; }
+        else if (w[act[i]]<w[act[b]]) b=i;
+      }
+      w[nodes]=w[act[a]]+w[act[b]];
+      par[act[a]]=par[act[b]]=(unsigned short)nodes;
+      act[a]=(unsigned short)nodes;
+      act[b]=act[--actc];
+    }
+    depth[nodes-1]=0; /* root */
+    for (i=nodes-1; i--!=0; ) depth[i]=(unsigned char)(depth[par[i]]+1);
+    for (i=0; i<m && depth[i]<=maxbits; i++) {}
+    if (i==m) break;
+  }
+  for (i=0; i<m; i++) lens[sym[i]]=depth[i];
+}
+
+/** Computes canonical codes (bit-reversed, to be written LSB first). */
+static void zd_codes(unsigned char const *lens, unsigned n, unsigned short *codes) {
+  unsigned count[16], next[16], i, code=0;
+  memset(count, '\0', sizeof(count));
+  for (i=0; i<n; i++) count[lens[i]]++;
+  count[0]=0;
+  for (i=1; i<16; i++) { code=(code+count[i-1])<<1; next[i]=code; }
+  for (i=0; i<n; i++) if (lens[i]!=0) codes[i]=(unsigned short)(z_rev16(next[lens[i]]++)>>(16-lens[i]));
+}
+
+#define ZD_RLE(sym, extra) (rle[rlec++]=(unsigned char)(sym), rle[rlec++]=(unsigned char)(extra), cfreq[sym]++)
+
+/** Writes a dynamic Huffman block of the first nsyms symbols in zd.syms. */
+static void zd_block(slen_t nsyms, sbool final) {
+  slen_t lfreq[286], dfreq[30], cfreq[19];
+  unsigned char lens[286+30], clens[19];
+  unsigned short lcodes[286], dcodes[30], ccodes[19];
+  unsigned char rle[2*(286+30)];
+  unsigned short const *p, *pend;
+  unsigned hlit, hdist, hclen, i, j, k, c, rlec, v;
+  memset(lfreq, '\0', sizeof(lfreq)); memset(dfreq, '\0', sizeof(dfreq));
+  for (p=zd.syms, pend=p+2*nsyms; p!=pend; p+=2) {
+    if (p[1]==0) lfreq[p[0]]++;
+    else { lfreq[257+zd.lsym[p[0]]]++; dfreq[zd_dsym(p[1])]++; }
+  }
+  lfreq[256]=1;
+  lfreq[0]+=nsyms==0; /* Dat: avoid an 1-bit literal/length code */
+  for (j=i=0; i<30; i++) j+=dfreq[i]!=0;
+  if (j<2) { dfreq[0]|=1; dfreq[1]|=1; }
+  zd_lengths(lfreq, 286, 15, lens);
+  zd_lengths(dfreq, 30, 15, lens+286);
+  for (hlit=286; lens[hlit-1]==0; hlit--) {}
+  for (hdist=30; lens[286+hdist-1]==0; hdist--) {}
+  memmove(lens+hlit, lens+286, hdist);
+  zd_codes(lens, hlit, lcodes);
+  zd_codes(lens+hlit, hdist, dcodes);
+  /* Run-length encode the code lengths with symbols 16, 17 and 18 */
+  memset(cfreq, '\0', sizeof(cfreq));
+  for (rlec=i=0; i<hlit+hdist; i=j) {
+    c=lens[i];
+    for (j=i+1; j<hlit+hdist && lens[j]==c; j++) {}
+    k=j-i;
+    if (c!=0) { ZD_RLE(c, 0); k--; }
+    while (k>=3) {
+      if (c!=0) { v=k>6 ? 6 : k; ZD_RLE(16, v-3); }
+      else if (k>=11) { v=k>138 ? 138 : k; ZD_RLE(18, v-11); }
+      else { v=k; ZD_RLE(17, v-3); }
+      k-=v;
+    }
+    for (; k!=0; k--) ZD_RLE(c, 0);
+  }
+  zd_lengths(cfreq, 19, 7, clens);
+  zd_codes(clens, 19, ccodes);
+  for (hclen=19; hclen>4 && clens[z_clorder[hclen-1]]==0; hclen--) {}
+  zd_putbits(final ? 5 : 4, 3); /* BFINAL, BTYPE=2 */
+  zd_putbits(hlit-257, 5); zd_putbits(hdist-1, 5); zd_putbits(hclen-4, 4);
+  for (i=0; i<hclen; i++) zd_putbits(clens[z_clorder[i]], 3);
+  for (i=0; i<rlec; i+=2) {
+    c=rle[i];
+    zd_putbits(ccodes[c], clens[c]);
+    if (c>=16) zd_putbits(rle[i+1], c==16 ? 2 : c==17 ? 3 : 7);
+  }
+  for (p=zd.syms; p!=pend; p+=2) {
+    if (p[1]==0) {
+      zd_putbits(lcodes[p[0]], lens[p[0]]);
+    } else {
+      c=zd.lsym[p[0]];
+      zd_putbits(lcodes[257+c], lens[257+c]);
+      zd_putbits(p[0]-z_lbase[c], z_lext[c]);
+      c=zd_dsym(p[1]);
+      zd_putbits(dcodes[c], lens[hlit+c]);
+      zd_putbits(p[1]-z_dbase[c], z_dext[c]);
+    }
+  }
+  zd_putbits(lcodes[256], lens[256]);
+}
+
+/** Compresses in[0,len) to a zlib stream in zd.out[0,zd.outlen), with
+ * hash chain LZ77 matching and dynamic Huffman blocks.
+ */
+static void z_deflate(unsigned char const *in, slen_t len) {
+  slen_t pos=0, nsyms=0, cand, next, best, bestd=0, n, limit, h, a=1, b=0, i;
+  unsigned chain;
+  unsigned short *sp;
+  if (zd.lsym[258]==0) { /* first call: fill the code tables */
+    for (i=0; i<29; i++) for (n=z_lbase[i]; n<z_lbase[i]+(1U<<z_lext[i]) && n<=258; n++) zd.lsym[n]=(unsigned char)i;
+    for (i=0; i<30; i++) for (n=z_dbase[i]; n<z_dbase[i]+(1U<<z_dext[i]); n++) {
+      if (n<=256) zd.dsym[n-1]=(unsigned char)i; else zd.dsym[256+((n-1)>>7)]=(unsigned char)i;
+    }
+  }
+  memset(zd.head, '\0', sizeof(zd.head));
+  zd.outlen=0; zd.bits=0; zd.bitc=0;
+  zd_putbits(0x78, 8); zd_putbits(0x9C, 8);
+  sp=zd.syms;
+  while (pos<len) {
+    best=0;
+    if (len-pos>=3) {
+      h=ZD_HASH(in+pos);
+      limit=len-pos<258 ? len-pos : 258;
+      for (cand=zd.head[h], chain=ZD_MAXCHAIN; cand!=0 && chain--!=0; cand=next) {
+        if (pos-(cand-1)>ZD_WSIZE) break;
+        if (in[cand-1+best]==in[pos+best]) {
+          for (n=0; n<limit && in[cand-1+n]==in[pos+n]; n++) {}
+          if (n>best) {
+            best=n; bestd=pos-(cand-1);
+            if (n==limit) break;
+          }
+        }
+        if ((next=zd.prev[(cand-1)&(ZD_WSIZE-1)])>=cand) break; /* Dat: overwritten link */
+      }
+      zd.prev[pos&(ZD_WSIZE-1)]=zd.head[h]; zd.head[h]=pos+1;
+    }
+    if (best>=3) {
+      *sp++=(unsigned short)best; *sp++=(unsigned short)bestd;
+      for (n=pos+best, pos++; pos<n; pos++) {
+        if (len-pos>=3) {
+          h=ZD_HASH(in+pos);
+          zd.prev[pos&(ZD_WSIZE-1)]=zd.head[h]; zd.head[h]=pos+1;
+        }
+      }
+    } else {
+      *sp++=in[pos++]; *sp++=0;
+    }
+    if (++nsyms==ZD_BLOCKSYMS) { zd_block(nsyms, FALSE); nsyms=0; sp=zd.syms; }
+  }
+  zd_block(nsyms, TRUE);
+  if (zd.bitc!=0) zd_putbits(0, 8-zd.bitc);
+  for (pos=0; pos<len; ) { /* Adler-32 */
+    for (n=len-pos>5552 ? pos+5552 : len; pos<n; pos++) { a+=in[pos]; b+=a; }
+    a%=65521U; b%=65521U;
+  }
+  zd_putbits((unsigned)(b>>8), 8); zd_putbits((unsigned)(b&255), 8);
+  zd_putbits((unsigned)(a>>8), 8); zd_putbits((unsigned)(a&255), 8);
+}
+
+/** Undoes the PNG predictors (/Predictor >= 10) of 1-byte pixels in place.
+ * @return length of the decoded data
+ */
+static slen_t png_unpredict(unsigned char *data, slen_t len, slen_t columns) {
+  unsigned char *out=data, *prev=NULL;
+  unsigned char const *in=data;
+  slen_t rows, i;
+  unsigned char filter;
+  int a, b, c, p, pa, pb, pc;
+  if (columns==0) erri("bad /Columns for /Predictor",0);
+  for (rows=len/(columns+1); rows!=0; rows--) {
+    filter=*in++;
+    for (i=0; i<columns; i++) {
+      a=i==0 ? 0 : out[i-1];
+      b=prev==NULL ? 0 : prev[i];
+      switch (filter) {
+       case 0: p=0; break;
+       case 1: p=a; break;
+       case 2: p=b; break;
+       case 3: p=(a+b)>>1; break;
+       case 4: /* Paeth */
+        c=i==0 || prev==NULL ? 0 : prev[i-1];
+        pa=b-c; pb=a-c; pc=pa+pb;
+        if (pa<0) pa=-pa;
+        if (pb<0) pb=-pb;
+        if (pc<0) pc=-pc;
+        p=pa<=pb && pa<=pc ? a : pb<=pc ? b : c;
+        break;
+       default: erri("bad PNG predictor",0); p=0;
+      }
+      out[i]=(unsigned char)(in[i]+p); /* Dat: out+i<in+i, so in place is OK */
+    }
+    prev=out; in+=columns; out+=columns;
+  }
+  return out-data;
+}
+
+/** Returns a PostScript token ID, puts token into buf */
+static char gettok(void) {
+  /* Derived from MiniPS::Tokenizer::yylex() of sam2p-0.37 */
+  int c=0, d; /* dummy initialization */
+  sbool hi;
+  unsigned hv=0; /* =0: pacify G++ 2.91 */
+  slen_t nest;
+  char *ibufend=ibuf+IBUFSIZE;
+  if (pbc!=0) { /* pop a token pushed back by ungettok() */
+    struct PushedTok *t=pbtoks+--pbc;
+    memcpy(ibuf, pbbuf[pbc], t->len);
+    ibufb=ibuf+t->len;
+    if (t->len!=IBUFSIZE) *ibufb='\0';
+    ibuf_int=t->ival; currs.tokofs=t->ofs;
+    return t->tok;
+  }
+  currs.tokofs=R_TELL();
+  currs.tokc++;
+  ibufb=ibuf;
+
+#if 0
+  if (ungot==EOFF) return EOFF;
+  if (ungot!=NO_UNGOT) { c=ungot; ungot=NO_UNGOT; goto again; }
+#endif
+ again_getcc:
+  c=R_GETC();
+ /* again: */
+  switch (c) {
+   case -1: eof:
+    return 0; /*ungot=EOFF */;
+   case '\n': case '\r': case '\t': case ' ': case '\f': case '\0':
+    goto again_getcc;
+   case '%': /* one-line comment */
+#if 0 /* XMLish tag from ps_tiny.c */
+    if ((c=R_GETC())=='<') {
+      char ret='<';
+      if ((c=R_GETC())=='/') { ret='>'; c=R_GETC(); } /* close tag */
+      if (!ULE(c-'A','Z'-'A')) erri("invalid tag",0); /* catch EOF */
+      (ibufb=ibuf)[0]=c; ibufb++;
+      while (ULE((c=R_GETC())-'A','Z'-'A') || ULE(c-'a','z'-'a')) {
+        if (ibufb==ibufend-1) erri("tag too long",0);
+        *ibufb++=c;
+      }
+      if (c<0) erri("unfinished tag",0);
+      *ibufb='\0';
+      R_UNGETC(c);
+      return ret;
+    }
+#endif
+    while (c!='\n' && c!='\r' && c!=-1) c=R_GETC();
+    if (c==-1) goto eof;
+    goto again_getcc;
+   case '[':
+    *ibufb++=c;
+    return '[';
+   case ']':
+    *ibufb++=c;
+    return ']';
+   case '{': case '}':
+    erri("proc arrays disallowed",0);  /* allowed in PS, but not in PDF */
+    break;  /* unreached */
+   case '>':
+    if (R_GETC()!='>') goto err;
+    *ibufb++='>'; *ibufb++='>';
+    return '>';
+   case '<':
+    if ((c=R_GETC())==-1) { uf_hex: erri("unfinished hexstr",0); }
+    if (c=='<') {
+      *ibufb++='<'; *ibufb++='<';
+      return '<';
+    }
+    if (c=='~') erri("a85str disallowed",0); /* allowed in PS, but not in PDF */
+    hi=1;
+    while (c!='>') {
+           if (ULE(c-'0','9'-'0')) hv=c-'0';
+      else if (ULE(c-'a','f'-'a')) hv=c-'a'+10;
+      else if (ULE(c-'A','F'-'A')) hv=c-'A'+10;
+      else if (is_ps_white(c)) hv=16;
+      else erri("syntax error in hexstr",0);
+      if (hv==16) ;
+      else if (!hi) { ibufb[-1]|=hv; hi=1; }
+      else if (ibufb==ibufend) erri("hexstr literal too long",0);
+      else { *ibufb++=(char)(hv<<4); hi=0; }
+      if ((c=R_GETC())==-1) goto uf_hex;
+    }
+    /* This is correct even if an odd number of hex digits have arrived */
+    return '(';
+   case '(':
+    nest=1;
+    c=R_GETC();
+    while (c!=-1) {
+      if (c==')' && --nest==0) return '(';
+      if (c=='\r') {
+        if ((c=R_GETC())=='\n') {} /* convert "\r\n" -> "\n", as specified in subsection 3.2.3 of PDFRef.pdf */
         else { d='\n';
          dcont:
           if (ibufb==ibufend) erri("str literal too long",0);
@@ -365,7 +1553,7 @@ static char gettok(void) {
           continue;
         }
       } else if (c!='\\') { if (c=='(') nest++; }
-      else switch (c=getc(currs.file)) { /* read a backslash escape */
+      else switch (c=R_GETC()) { /* read a backslash escape */
        case -1: goto uf_str;
        case 'n': c='\n'; break;
        case 'r': c='\r'; break;
@@ -375,10 +1563,10 @@ static char gettok(void) {
        default:
         if (!ULE(c-'0','7'-'0')) break;
         hv=c-'0'; /* read at most 3 octal chars */
-        if ((c=getc(currs.file))==-1) goto uf_str;
+        if ((c=R_GETC())==-1) goto uf_str;
         if (c<'0' || c>'7') { d=hv; goto dcont; }
         else { hv=8*hv+(c-'0');
-          if ((c=getc(currs.file))==-1) goto uf_str;
+          if ((c=R_GETC())==-1) goto uf_str;
           if (c<'0' || c>'7') { d=hv; goto dcont; }
                          else c=(char)(8*hv+(c-'0'));
         }
@@ -386,47 +1574,49 @@ static char gettok(void) {
       if (ibufb==ibufend) erri("str literal too long",0);
       /* putchar(c); */
       *ibufb++=c;
-      c=getc(currs.file);
+      c=R_GETC();
     } /* WHILE */
     /* if (c==')') return '('; */
     uf_str: erri("unfinished str",0);
    case ')': goto err;
    case '/':
     *ibufb++='/';
-    while (ISWSPACE(c,=getc(currs.file))) {}
+    while (ISWSPACE(c,=R_GETC())) {}
     /* ^^^ `/ x' are two token in PostScript, but here we overcome the C
      *     preprocessor's feature of including whitespace.
      */
     /* fallthrough */ /* b will begin with '/' */
    default: /* /nametype, /integertype or /realtype */
     *ibufb++=c;
-    while ((c=getc(currs.file))!=-1 && is_ps_name(c)) {
+    while ((c=R_GETC())!=-1 && is_ps_name(c)) {
       *ibufb++=c;
       if (ibufb==ibufend) erri("token too long",0);
     }
     *ibufb='\0'; /* ensure null-termination */
-    currs.lastofs=ftell(currs.file)-1;
-    r_seek(currs.lastofs); /* Dat: ungetc(c,currs.file) would destroy ftell() return value */
+    R_UNGETC(c);
     if (ibuf[0]=='/') return '/';
-    /* Imp: optimise numbers?? */
-    if (ibufb!=ibufend) {
-      double d;
-      /* Dat: PDF doesn't support (but PS does) base-n number such as `16#100' == 256; nor exponential notation (6e7) */
-      if (!toInteger(ibuf, &ibuf_int)) {
-        sprintf(ibuf, "%" SLEN_P"d", ibuf_int); ibufb=ibuf+strlen(ibuf); /* compress it */
+    /* Dat: PDF doesn't support (but PS does) base-n number such as `16#100' == 256; nor exponential notation (6e7) */
+    if (IS_DIGIT(c=ibuf[0]) || c=='-' || c=='+' || c=='.') {
+      switch (scan_number(ibuf, ibufb, &ibuf_int)) {
+       case '1':
+        *(ibufb=fmt_int(ibuf, ibuf_int))='\0'; /* compress it */
         return '1';
-      }
-      /* Dat: call toInteger _before_ toReal */
-      if (!toReal(ibuf, &d)) {
-        /* Dat: `.5' and `6.' are valid PDF reals */
-        char *p;
-        p=ibuf; while (*p!='\0' && *p!='e' && *p!='E') p++;
-        if (*p!='\0') erri("exponential notation disallowed in PDF",0); /* Imp: convert to a name token instead */
-        p=ibufb=ibuf;
+       case 'e':
+        erri("exponential notation disallowed in PDF",0); /* Imp: convert to a name token instead */
+        break;  /* unreached */
+       case '.': {
+        char *p=ibuf;
+        sbool dot_p=FALSE;
         while (*p=='0') p++; /* strip heading zeros */
-        while (*p!='\0') *ibufb++=*p++;
-        while (ibufb!=ibuf && ibufb[-1]=='0') ibufb--; /* strip trailing zeros */
-        /* *ibufb='\0'; -- not required */
+        for (ibufb=ibuf; *p!='\0'; *ibufb++=*p++) if (*p=='.') dot_p=TRUE;
+        if (dot_p) {
+          while (ibufb!=ibuf && ibufb[-1]=='0') ibufb--; /* strip trailing zeros */
+          for (p=ibuf; p!=ibufb && !IS_DIGIT(*p); p++) {}
+          if (p==ibufb) { ibuf[0]='0'; ibufb=ibuf+1; } /* `0.0' -> `0', not `.' */
+        }
+        *ibufb='\0';
+        return 'E';
+       }
       }
     }
     switch (*ibuf) {
@@ -446,10 +1636,46 @@ static char gettok(void) {
   goto again_getcc;  /* unreached */
 }
 
+/** Pushes back the token just returned by gettok(). */
+static void ungettok(char tok) {
+  struct PushedTok *t=pbtoks+pbc;
+  assert(pbc<PBMAX);
+  t->tok=tok; t->ival=ibuf_int; t->ofs=currs.tokofs;
+  memcpy(pbbuf[pbc++], ibuf, t->len=ibufb-ibuf);
+}
+
+/** Pushes back integer token, which started reading at file offset ofs. */
+static void ungettok_int(pdfint_t val, slen_t ofs) {
+  *(ibufb=fmt_int(ibuf, val))='\0';
+  ibuf_int=val; currs.tokofs=ofs;
+  ungettok('1');
+}
+
+/** @return file offset of the next token, pushed back tokens included */
+static slen_t r_tell(void) {
+  return pbc!=0 ? pbtoks[pbc-1].ofs : R_TELL();
+}
+
+/** Call after gettok() has returned '1'. Detects the rest of an `N G R'
+ * reference by reading ahead. Doesn't seek.
+ * @return TRUE and sets *gennum if found; otherwise FALSE, and the tokens
+ *   read ahead are pushed back
+ */
+static sbool gettok_isref(pdfint_t *gennum) {
+  char tok;
+  slen_t ofs;
+  if ('1'!=(tok=gettok())) { ungettok(tok); return FALSE; }
+  *gennum=ibuf_int; ofs=currs.tokofs;
+  if ('R'==(tok=gettok())) return TRUE;
+  ungettok(tok);
+  ungettok_int(*gennum, ofs);
+  return FALSE;
+}
+
 static void r_check_pdf_header(void) {
   int c;
   r_seek(0);
-  if (9>fread(ibuf, 1, 9, currs.file)
+  if (9>r_read(ibuf, 9)
    || 0!=memcmp(ibuf, "%PDF-", 5)
    || !ULE(ibuf[5]-'0','9'-'0')
    || ibuf[6]!='.'
@@ -464,9 +1690,9 @@ static void r_check_pdf_header(void) {
   r_seek(0);
   /* vvv Seek binary bytes in the first few comment lines, see subsection 3.4.1 in PDFRef.pdf */
   while (1) {
-    while ((c=getc(currs.file))=='\n' || c=='\r') {}
+    while ((c=R_GETC())=='\n' || c=='\r') {}
     if (c!='%') break;
-    while ((c=getc(currs.file))!='\n' && c!='\r' && c!=-1) if ((c&0x80)!=0) { currs.is_binary=TRUE; break; }
+    while ((c=R_GETC())!='\n' && c!='\r' && c!=-1) if ((c&0x80)!=0) { currs.is_binary=TRUE; break; }
   }
 }
 
@@ -479,7 +1705,7 @@ static void r_seek_xref(void) {
   int n=0; /* BUGFIX?? found by __CHECKER__ */
   slen_t got;
   r_seek(currs.filesize > 256 ? currs.filesize-256 : 0);
-  if (0==(got=fread(ibuf, 1, 256, currs.file))) erri("cannot read startxref",0);
+  if (0==(got=r_read(ibuf, 256))) erri("cannot read startxref",0);
   p=ibuf+got;
   while (p!=ibuf && (p[-1]!='s' ||
     1!=sscanf(p,"tartxref%" SLEN_P"i%n",&xrefofs,&n))) p--;
@@ -492,7 +1718,54 @@ static void r_seek_xref(void) {
   r_seek(xrefofs);
 }
 
-/** Uses currs.xrefs, seeks past `X Y obj'. */
+/** @return number i of sn */
+static unsigned sn_get(struct SparseNums const *sn, slen_t i) {
+  unsigned const *pg=i/SPARSE_PAGE<sn->pagec ? sn->pages[i/SPARSE_PAGE] : NULL;
+  return pg==NULL ? 0 : pg[i%SPARSE_PAGE];
+}
+
+/** Sets number i of sn to v, allocating its page if needed. */
+static void sn_set(struct SparseNums *sn, slen_t i, slen_t v) {
+  slen_t p=i/SPARSE_PAGE, n;
+  if ((unsigned)v!=v) errn("too many objects",0);
+  if (p>=sn->pagec) {
+    for (n=sn->pagec<16 ? 16 : sn->pagec; n<=p; n*=2) {}
+    if (NULL==(sn->pages=(unsigned**)realloc(sn->pages, n*sizeof(sn->pages[0])))) errn("out of memory for object numbers",0);
+    while (sn->pagec<n) sn->pages[sn->pagec++]=NULL;
+  }
+  if (sn->pages[p]==NULL && NULL==(sn->pages[p]=(unsigned*)calloc(SPARSE_PAGE, sizeof(sn->pages[p][0])))) errn("out of memory for object numbers",0);
+  sn->pages[p][i%SPARSE_PAGE]=(unsigned)v;
+}
+
+/** Frees the pages of sn, all its numbers become 0. */
+static void sn_free(struct SparseNums *sn) {
+  while (sn->pagec!=0) free(sn->pages[--sn->pagec]);
+  free(sn->pages); sn->pages=NULL;
+}
+
+/** @return xref entry num<currs.xrefc, or NULL if its page has no entries */
+static struct XrefEntry *xref_at(slen_t num) {
+  struct XrefEntry *pg=currs.xrefpages[num/SPARSE_PAGE];
+  return pg==NULL ? NULL : pg+num%SPARSE_PAGE;
+}
+
+/** @return xref entry num<currs.xrefc for setting, see xe_set() */
+static struct XrefEntry *xref_w(slen_t num) {
+  struct XrefEntry **pgp=currs.xrefpages+num/SPARSE_PAGE;
+  if (*pgp==NULL && NULL==(*pgp=(struct XrefEntry*)calloc(SPARSE_PAGE, sizeof(**pgp)))) erri("out of memory for xref",0);
+  return *pgp+num%SPARSE_PAGE;
+}
+
+/** Sets the fields of e, type is like XE_TYPE(). ofs<=XE_OFS_MAX. */
+static void xe_set(struct XrefEntry *e, char type, slen_t ofs, slen_t gennum) {
+  assert(ofs<=XE_OFS_MAX);
+  e->ofslo=(unsigned)(ofs&0xffffffffUL);
+  e->ofshi=(unsigned short)((type=='n' ? 1U : type=='f' ? 2U : type=='c' ? 3U : 4U)<<13
+    | (unsigned)(ofs>>16>>16));
+  e->gennum=(unsigned short)gennum;
+}
+
+/** Uses currs.xrefpages, seeks past `X Y obj'. */
 static struct XrefEntry *objentry(pdfint_t num, pdfint_t gennum) {
   struct XrefEntry *e;
   char const* emsg;
@@ -511,15 +1784,19 @@ static struct XrefEntry *objentry(pdfint_t num, pdfint_t gennum) {
    *      when certain fonts are not subsetted (e.g. `<<cmr10.pfb' in the
    *      .map file)
    */
-  if ((e=currs.xrefs+num)->type!='n' && e->type!='f') { emsg="bad type for obj: "; goto err; }
+  if ((e=xref_at(num))==NULL || XE_TYPE(e)=='\0') { emsg="bad type for obj: "; goto err; }
   if (e->gennum!=gennum) { emsg="gennum mismatch: "; goto err; }
   return e;
 }
 
+static void r_load_objstm(struct XrefEntry *ce);
+
 static void r_seek_obj(pdfint_t num, pdfint_t gennum) {
   char const *emsg;
   struct XrefEntry *e=objentry(num, gennum);
-  r_seek(e->ofs);
+  if (XE_TYPE(e)=='c') r_load_objstm(e);
+  r_seek(XE_OFS(e));
+  if (XE_TYPE(e)=='o') return; /* Dat: no `N G obj' in an object stream */
   if ('1'!=gettok() || ibuf_int!=num) { emsg="inobj num mismatch: ";
     err: { char tmp[64];
       sprintf(tmp, "%" SLEN_P"d %" SLEN_P"d obj", num, gennum);
@@ -530,11 +1807,6 @@ static void r_seek_obj(pdfint_t num, pdfint_t gennum) {
   if ('E'!=gettok() || 0!=strcmp(ibuf,"obj")) { emsg="inobj `obj' missing: "; goto err; }
 }
 
-static sbool is_digits(char const *p, char const *pend) {
-  while (p!=pend && ULE(*p-'0','9'-'0')) p++;
-  return p==pend;
-}
-
 #if 0
 static void getotag(char const*tag) {
 #if 0 /* This code segment cannot ignore comments */
@@ -601,7 +1873,7 @@ static pdfint_t getuintval(void) {
   pdfint_t ret;
   getval();
   /* fprintf(stderr, "[%s]\n", ibuf); */
-  if (toInteger(ibuf, &ret) || ret<0) erri("tag val must be nonnegative integer",0);
+  if ('1'!=scan_number(ibuf, ibufb, &ret) || ret<0) erri("tag val must be nonnegative integer",0);
   return ret;
 }
 #endif
@@ -611,33 +1883,309 @@ static pdfint_t getuintval(void) {
 /** Maximum number of characters in a line. */
 #define MAXLINE 78
 
-static struct WriteState {
+/** Default size of curws.obuf, see `--bufsize' */
+#define OBUF_SIZE ((slen_t)1<<20)
+
+/** Default most kids of a /Pages node written, see `--fanout' */
+#define PAGETREE_FANOUT 32
+/** Size of curws.ptsizes: enough for any number of inputs, with fanout>=2 */
+#define PAGETREE_LEVELS (8*sizeof(slen_t))
+
+/** Growable byte buffer for output built in memory */
+struct WBuf {
+  char *p;
+  slen_t len, a;
+};
+
+/** Slot of the --dedup hash table of objects already in the output */
+struct DedupSlot {
+  unsigned char h[DD_HASHLEN];
+  slen_t num; /* 0: empty */
+};
+
+/** Phases timed by --stats=json */
+enum { PH_HEADER, PH_SEEK_XREF, PH_READ_XREF, PH_DUMP, PH_TRAILER, PH_STITCH, PH_XREF_DUMP, PH_C };
+
+/** Statistics of an input or of the output, for --stats=json */
+struct Stats {
+  double wall[PH_C], cpu[PH_C]; /* seconds */
+  slen_t filesize, xrefc, pagecount;
+  slen_t tokens, seeks;
+  slen_t bytes_verbatim; /* stream bodies copied */
+  slen_t bytes_tokenized; /* rest of the objects copied */
+  slen_t objs_reached, objs_skipped; /* skipped: unreachable or merged */
+};
+
+/** Number of inh_keys */
+#define INH_KEYC 4
+
+/** Page attributes inherited from the ancestor /Pages nodes (see
+ * PDFRef.pdf 3.6.2), copied onto the selected pages
+ */
+static char const* const inh_keys[INH_KEYC]={"/Resources", "/MediaBox", "/CropBox", "/Rotate"};
+
+/** A page selected by the page ranges of an input, see r_select_pages() */
+struct PageSel {
+  slen_t idx; /* page index in the input, from 0 */
+  pdfint_t num, gennum;
+  /** Input offset of the value of inh_keys[I] inherited from the ancestors,
+   * 0 if none or if the page has its own
+   */
+  slen_t inhofs[INH_KEYC];
+};
+
+/** Object stream being built in the output */
+#define OBJSTM_MAXOBJS 200
+#define OBJSTM_MAXSIZE 1048576
+
+struct WriteState {
   /** Number of characters already written into this line. (from 0) */
   slen_t colc;
   /** Last token was a self-closing one */
   sbool lastclosed, is_binary;
   FILE *wf;
+  /** Status messages go here; stderr if the output is stdout, NULL if quiet_p */
+  FILE *statusf;
+  sbool quiet_p;
   char const* filename;
-  char* trailer;
+  /** Number of bytes written to the output so far, including obuf */
+  slen_t ofs;
+  /** Output buffer: the last obufc bytes of the output, not written to wf
+   * yet. It is flushed when obufc reaches obufl, at output offsets which
+   * are multiples of obufa, see w_flush().
+   */
+  char *obuf;
+  slen_t obufc, obufl, obufa;
+  slen_t obufsize; /* `--bufsize', obufa of the next run */
+  /** NULL or output goes here instead of wf, e.g &trailer or &objbuf */
+  struct WBuf *membuf;
+  /** Built by w_make_trailer(): `trailer <<' and the keys */
+  struct WBuf trailer;
+  slen_t trailerkeys; /* offset of the keys in trailer */
   slen_t outobjc; /* # assigned objs */
-  slen_t trailerlen;
   slen_t *txrefs; /* txrefs[I] is the target file offset for `I 0 obj' */
+  /** NULL, or if objstm_p: 0 or 1+(index of the object stream having `I 0
+   * obj', then txrefs[I] is its index within)
+   */
+  slen_t *txrefstm;
   slen_t txrefc; /* number of items used in txrefs */
   slen_t txrefa; /* number of items allocated in txrefs */
   slen_t startxrefofs;
   slen_t lastsrcpages_num;
   slen_t pagetotal;
+  /** The root /Pages of each input, then the page count of each input */
   slen_t *srcpages_nums;
   slen_t srcpages_numc; /* number of subfiles */
-} curws;
+  slen_t fanout; /* `--fanout', see w_pagetree_plan() */
+  /** Levels of intermediate /Pages nodes between the top /Pages and the
+   * root /Pages of the inputs: ptsizes[L] nodes at level L (1..ptlevelc,
+   * ptsizes[0] is the number of inputs), numbered from ptbase on, the
+   * top level first
+   */
+  slen_t ptsizes[PAGETREE_LEVELS];
+  unsigned ptlevelc;
+  slen_t ptbase;
+  /** Put non-stream objects to object streams, and write an xref stream */
+  sbool objstm_p;
+  /** If objstm_p, objects are written to objbuf first, see w_obj_end() */
+  struct WBuf objbuf;
+  slen_t objnum; /* number of the object in objbuf */
+  /** The object stream being built: objects, and their numbers and offsets */
+  struct WBuf stmbuf;
+  slen_t stmobjs[2*OBJSTM_MAXOBJS];
+  slen_t stmc; /* number of objects in stmbuf */
+  slen_t objstmc; /* number of object streams in zf */
+  slen_t objstmbase; /* number of the first object stream, see w_dump_objstms() */
+  /** Compressed object streams, to be appended to the output */
+  FILE *zf;
+  /** NULL or a pipe to the compressor process, see w_zworker_start() */
+  FILE *zpipe;
+#if USE_FORK
+  pid_t zpid; /* 0: not started yet, -1: failed */
+#endif
+  /** Print statistics as JSON instead of the status lines, see w_output_stats() */
+  sbool stats_p;
+  struct Stats *stats; /* per input */
+  struct Stats ostats; /* of the output */
+  double stats_wall0, stats_cpu0; /* start of the current phase */
+  double stats_start; /* start of the run */
+  /** Merge identical objects, see dd_scan() */
+  sbool dedup_p;
+  struct DedupSlot *ddslots; /* open addressing */
+  slen_t ddslota, ddslotc;
+  slen_t ddsavedc, ddsaved; /* merged objects and their input bytes */
+  /** Dump the objects of each input in input offset order, see
+   * r_dump_reachable()
+   */
+  sbool seq_p;
+  /** Read the inputs with io_uring, see ur_prefetch() */
+  sbool uring_p;
+  /** Copy the bytes of the dicts and arrays between the references as is,
+   * see wr_enqueue_struct()
+   */
+  sbool verbatim_p;
+  /** Write a linearized output: the merge goes to a temporary file in wf
+   * first, linwf is the output, see w_linearize()
+   */
+  sbool lin_p;
+  FILE *linwf;
+  /** Nonzero in w_linearize(): the free object number that references to
+   * missing objects get, see wr_enqueue_ref()
+   */
+  slen_t linnull;
+  struct SparseNums linown; /* see LIN_SHARED */
+  /** Objects reached from the trailer, then the objects of each page
+   * (linv[linpgs[K]...linpgs[K+1])), see w_linearize()
+   */
+  slen_t *linv, linc, lina;
+  slen_t *linpgs;
+  struct WBuf hintbuf; /* hint tables, see w_lin_hints() */
+  /** Target object numbers of the current input (0: not reached yet), see
+   * wr_enqueue_ref()
+   */
+  struct SparseNums tnums;
+  /** NULL or the page ranges of each input (NULL: all pages), see
+   * split_pagesels()
+   */
+  char const* const* pagesels;
+  /** Pages selected from the current input, in output order, and the
+   * selv index+1 of each input object number (0: not selected)
+   */
+  struct PageSel *selv;
+  slen_t selc, sela;
+  struct SparseNums selmark;
+  /** Input object numbers to be copied: queue[qhead...qc), see enq_put() */
+  slen_t *queue;
+  slen_t qhead, qc, qa;
+  slen_t qpf; /* with uring_p: queue[...qpf) has been read ahead */
+  /** Append an incremental update to the output, see w_append_start() */
+  sbool append_p;
+  slen_t toppages_num; /* 1, or with append_p: the /Pages of the catalog */
+  /** With append_p: `<<', the keys and `/Kids[' with the kids of the old top /Pages */
+  struct WBuf toppages;
+  slen_t prevxrefofs; /* with append_p: startxref of the old file */
+  slen_t oldsize; /* with append_p: size of the old file, see w_append_undo() */
+  /** NULL or the segment file of a worker process: copy_token(), w_ref(),
+   * w_obj_begin(), w_obj_end() and w_stream() append records to it instead of writing the
+   * output, see seg_stitch().
+   */
+  FILE *seg;
+  struct Segment *sgs; /* of the inputs being run by workers */
+  slen_t *segmap, segmapa; /* see seg_stitch() */
+};
+
+/** Object numbers in a segment start from this, global numbers are
+ * assigned by seg_stitch(). Dat: 0 in curws.tnums means not reached yet.
+ */
+#define SEG_OBJ_BASE 1
+
+/** Appends a record to curws.seg. Dat: segments are read by the same
+ * binary, so native integer layout is OK.
+ */
+static void seg_put(char type, slen_t a, slen_t b) {
+  putc(type, curws.seg);
+  fwrite(&a, sizeof(a), 1, curws.seg);
+  fwrite(&b, sizeof(b), 1, curws.seg);
+}
+
+/** Makes room for n more bytes in b. */
+static void wbuf_reserve(struct WBuf *b, slen_t n) {
+  if (n>b->a-b->len) {
+    b->a=b->a<256 ? 256 : 2*b->a;
+    if (b->a<b->len+n) b->a=b->len+n;
+    if (NULL==(b->p=(char*)realloc(b->p, b->a))) errn("out of memory for output buffer",0);
+  }
+}
+
+static int wbuf_putc(struct WBuf *b, int c) {
+  if (b->len==b->a) wbuf_reserve(b, 1);
+  return b->p[b->len++]=(char)c;
+}
+
+static void wbuf_write(struct WBuf *b, char const *p, slen_t len) {
+  wbuf_reserve(b, len);
+  memcpy(b->p+b->len, p, len); b->len+=len;
+}
+
+/** Starts writing the output to curws.wf at offset curws.ofs, allocating
+ * curws.obuf of curws.obufsize bytes.
+ */
+static void w_obuf_start(void) {
+  if (curws.obufa!=curws.obufsize) {
+    free(curws.obuf); curws.obufa=0;
+    if (NULL==(curws.obuf=(char*)malloc(curws.obufsize))) errn("out of memory for output buffer",0);
+    curws.obufa=curws.obufsize;
+  }
+  curws.obufc=0; curws.obufl=curws.obufa-curws.ofs%curws.obufa;
+}
+
+/** Writes curws.obuf to curws.wf. Errors are checked by ferror() at the end. */
+static void w_flush(void) {
+  fwrite(curws.obuf, 1, curws.obufc, curws.wf);
+  curws.obufc=0; curws.obufl=curws.obufa-curws.ofs%curws.obufa;
+}
+
+/** Writes a byte to the output, or to curws.membuf. */
+#define W_PUTC(c) (curws.membuf!=NULL ? wbuf_putc(curws.membuf, c) \
+  : (curws.obufc==curws.obufl ? w_flush() : (void)0, curws.ofs++, curws.obuf[curws.obufc++]=(char)(c)))
+
+/** Writes to the output through curws.obuf, or to curws.membuf. Aligned
+ * blocks of whole buffers bypass curws.obuf.
+ */
+static void w_write(char const *p, slen_t len) {
+  slen_t n;
+  if (curws.membuf!=NULL) { wbuf_write(curws.membuf, p, len); return; }
+  while (len!=0) {
+    if (curws.obufc==0 && len>=curws.obufl) { /* Dat: w_flush() keeps obufl-obufc aligned */
+      n=curws.obufl==curws.obufa ? len-len%curws.obufa : curws.obufl;
+      fwrite(p, 1, n, curws.wf);
+      curws.ofs+=n; curws.obufl=curws.obufa;
+    } else {
+      if ((n=curws.obufl-curws.obufc)>len) n=len;
+      memcpy(curws.obuf+curws.obufc, p, n);
+      curws.ofs+=n; curws.obufc+=n;
+      if (curws.obufc==curws.obufl) w_flush();
+    }
+    p+=n; len-=n;
+  }
+}
+
+static void w_puts(char const *s) {
+  w_write(s, strlen(s));
+}
 
 #if 0
 static void init_out(void) { curws.wf=stdout; curws.colc=0; curws.lastclosed=TRUE; }
 #endif
 
+/** Copies len bytes verbatim from the input to the output. With mmap(),
+ * the bytes are written straight from the mapping.
+ * @return number of bytes copied, less than len on EOF
+ */
+static slen_t r_copy_out(slen_t len) {
+  slen_t got=0, n;
+#if USE_ZEROCOPY
+  if (len>=ZEROCOPY_MIN) {
+    w_flush();
+    curws.ofs+=got=r_copy_zero(curws.wf, len);
+    curws.obufl=curws.obufa-curws.ofs%curws.obufa;
+  }
+#endif
+  while (got!=len) {
+    if (currs.bufp==currs.bufend) {
+      if (r_fill()<0) break;
+      currs.bufp--;
+    }
+    if ((n=currs.bufend-currs.bufp)>len-got) n=len-got;
+    w_write((char const*)currs.bufp, n);
+    currs.bufp+=n; got+=n;
+  }
+  return got;
+}
+
 static void newline(void) {
   if (curws.colc!=0) {
-    putc('\n',curws.wf);
+    W_PUTC('\n');
     curws.colc=0; curws.lastclosed=TRUE;
   } else assert(curws.lastclosed);
 }
@@ -678,10 +2226,10 @@ static void pstrqput(register char const* p, char const* pend) {
   /* Number of parens opened so far */
   slen_t nest=0;
   char c;
-  putc('(',curws.wf); curws.colc++;
+  W_PUTC('('); curws.colc++;
   p=ibuf; pend=ibufb;  while (p!=pend) {
-    if ((c=*p++)=='\n') { putc('\n',curws.wf); curws.colc=0; continue; }
-    else if (c=='\r' || c=='\\') { put2: putc('\\',curws.wf); putc(c,curws.wf); curws.colc+=2; continue; }
+    if ((c=*p++)=='\n') { W_PUTC('\n'); curws.colc=0; continue; }
+    else if (c=='\r' || c=='\\') { put2: W_PUTC('\\'); W_PUTC(c); curws.colc+=2; continue; }
     else if (c=='(') {
       while (q>p && *--q!=')') {}
       if (q<=p) goto put2;
@@ -693,7 +2241,7 @@ static void pstrqput(register char const* p, char const* pend) {
         nest--;
       } else goto put2;
     }
-    putc(c,curws.wf); curws.colc++; continue;
+    W_PUTC(c); curws.colc++; continue;
 #if 0
     else if (ULE(c-32, 126-32)) { putc(c); curws.colc++; continue; }
     curws.colc+=2;
@@ -716,7 +2264,7 @@ static void pstrqput(register char const* p, char const* pend) {
 #endif
   }
   assert(nest==0);
-  putc(')',curws.wf); curws.colc++;
+  W_PUTC(')'); curws.colc++;
 }
 
 /** @return the byte length of a string as a quoted PostScript hex string
@@ -735,21 +2283,26 @@ static void pstrhput(register char const* p, char const* pend) {
   static char const hextable[]="0123456789abcdef";
   char c;
   curws.colc+=2+2*(pend-p);
-  putc('<',curws.wf);
+  W_PUTC('<');
   if (p!=pend--) {
     while (p!=pend) {
-      c=hextable[*(unsigned char const*)p>>4]; putc(c,curws.wf);
-      c=hextable[*(unsigned char const*)p&15]; putc(c,curws.wf);
+      c=hextable[*(unsigned char const*)p>>4]; W_PUTC(c);
+      c=hextable[*(unsigned char const*)p&15]; W_PUTC(c);
       p++;
     }
-    c=hextable[*(unsigned char const*)p>>4]; putc(c,curws.wf);
-    c=hextable[*(unsigned char const*)p&15]; if (c!='0') putc(c,curws.wf); else curws.colc--;
+    c=hextable[*(unsigned char const*)p>>4]; W_PUTC(c);
+    c=hextable[*(unsigned char const*)p&15]; if (c!='0') W_PUTC(c); else curws.colc--;
   }
-  putc('>',curws.wf);
+  W_PUTC('>');
 }
 
 static void copy_token(char tok) {
   slen_t len, qlen, hlen;
+  if (curws.seg!=NULL && tok!=0) {
+    seg_put('T', tok, len=ibufb-ibuf);
+    fwrite(ibuf, 1, len, curws.seg);
+    return;
+  }
   switch (tok) {
    case 0:
     erri("eof in copy", 0);
@@ -764,7 +2317,7 @@ static void copy_token(char tok) {
 #if 0
     if (len>MAXLINE) fprintf(stderr, "%s: warning: output line too long\n", PROGNAME);
 #endif
-    fwrite(ibuf, 1, len, curws.wf); curws.colc+=len;
+    w_write(ibuf, len); curws.colc+=len;
     break;
    case '/':
     len=ibufb-ibuf;
@@ -813,34 +2366,151 @@ static void copy_token(char tok) {
     if (0) {}
 #endif
     else if (curws.lastclosed) {}
-    else if (curws.colc+len<MAXLINE) { putc(' ',curws.wf); curws.colc++; }
+    else if (curws.colc+len<MAXLINE) { W_PUTC(' '); curws.colc++; }
     else newline();
     curws.lastclosed=FALSE;
     goto write;
   }
 }
 
-/** Skips a whole recursive structure starting with `tok'. Works with `R' */
-static void skipstruct(char tok, sbool copy_p) {
-  slen_t nest=0, lastofs;
-  pdfint_t b;
-  while (1) {
-    if (copy_p) copy_token(tok);
-    switch (tok) {
-     case 0:
-      erri("eof in skipstruct",0);
-      break;  /* unreached */
-     case '1': /* Skip a possible `R' */
-      lastofs=currs.lastofs; /* Dat: copy_token() already called */
-      if ('1'==(tok=gettok()) && (b=ibuf_int, TRUE) && 'R'==(tok=gettok())) {
-        if (copy_p) {
-          sprintf(ibuf, "%" SLEN_P"d", b); ibufb=ibuf+strlen(ibuf); copy_token('1');
-          ibuf[0]='R'; ibuf[1]='\0'; copy_token('R');
-        }
-      } else r_seek(lastofs);
-      break;
-     case '[': case '<': /* Imp: treat dicts and arrays differently, create nest stack */
-      nest++;
+/** Writes the reference `num 0 R'. */
+static void w_ref(slen_t num) {
+  if (curws.seg!=NULL) { seg_put('R', num, 0); return; }
+  ibufb=fmt_int(ibuf, num);
+  memcpy(ibufb, " 0 R", 4); ibufb+=4;
+  copy_token('1');
+}
+
+/** Writes input bytes p[0..len) as is (a span between references, see
+ * curws.verbatim_p). Unless cont_p (the rest of the previous span), adds a
+ * separator or drops leading whitespace if needed.
+ */
+static void w_span(char const *p, slen_t len, sbool cont_p) {
+  char const *q;
+  slen_t n;
+  if (curws.seg!=NULL) {
+    for (; len!=0; p+=n, len-=n, cont_p=TRUE) {
+      n=len>IBUFSIZE ? IBUFSIZE : len;
+      seg_put('V', cont_p, n);
+      fwrite(p, 1, n, curws.seg);
+    }
+    return;
+  }
+  if (curws.colc==0 && !cont_p) { /* Dat: e.g. after `N 0 obj' */
+    for (; len!=0 && is_ps_white(*p); p++, len--) {}
+  }
+  if (len==0) return;
+  if (!cont_p && !curws.lastclosed && !is_ps_white(*p) && NULL==strchr("/%{}<>[]()", *p)) { W_PUTC(' '); curws.colc++; }
+  w_write(p, len);
+  for (q=p+len; q!=p && q[-1]!='\n' && q[-1]!='\r'; q--) {}
+  curws.colc=q==p ? curws.colc+len : (slen_t)(p+len-q);
+  q=p+len-1;
+  curws.lastclosed=is_ps_white(*q) || (*q!='/' && NULL!=strchr("{}<>[]()", *q));
+}
+
+/** Copies input bytes [a,b) with w_span(). Keeps the read position and the
+ * pushed back tokens.
+ */
+static void r_copy_span(slen_t a, slen_t b) {
+  slen_t here, n, len=b-a, wlen=currs.bufend-currs.buf;
+  unsigned opbc;
+  if (a-currs.bufofs<=wlen && b-currs.bufofs<=wlen) { /* Dat: always with mmap() and in object streams */
+    w_span((char const*)currs.buf+(a-currs.bufofs), b-a, FALSE);
+    return;
+  }
+  here=R_TELL(); opbc=pbc;
+  r_seek(a);
+  while (a!=b) {
+    if (currs.bufp==currs.bufend) {
+      if (r_fill()<0) erri("eof in span",0);
+      currs.bufp--;
+    }
+    if ((n=currs.bufend-currs.bufp)>b-a) n=b-a;
+    w_span((char const*)currs.bufp, n, len!=b-a);
+    currs.bufp+=n; a+=n;
+  }
+  r_seek(here); pbc=opbc;
+}
+
+static void w_xref_aset(slen_t num, slen_t ofs);
+static void w_objstm_add(void);
+
+/** Writes `num 0 obj', and records its offset for the xref table. */
+static void w_obj_header(slen_t num) {
+  if (!curws.lastclosed) W_PUTC('\n');
+  w_xref_aset(num, curws.ofs);
+  ibufb=fmt_int(ibuf, num);
+  memcpy(ibufb, " 0 obj\n", 7);
+  w_write(ibuf, ibufb+7-ibuf);
+  curws.lastclosed=TRUE; curws.colc=0;
+}
+
+/** Starts object num. If curws.objstm_p, the object goes to curws.objbuf
+ * until w_stream() or w_obj_end() decides where it belongs.
+ */
+static void w_obj_begin(slen_t num) {
+  if (curws.seg!=NULL) { seg_put('O', num, 0); return; }
+  if (curws.objstm_p) {
+    curws.objnum=num; curws.objbuf.len=0; curws.membuf=&curws.objbuf;
+    curws.lastclosed=TRUE; curws.colc=0;
+  } else w_obj_header(num);
+}
+
+/** Writes `endobj', or adds the buffered object to the object stream. */
+static void w_obj_end(void) {
+  if (curws.seg!=NULL) { seg_put('C', 0, 0); return; }
+  if (curws.membuf==&curws.objbuf) {
+    w_objstm_add();
+  } else {
+    memcpy(ibuf, "endobj", 7); ibufb=ibuf+6; copy_token('E');
+    if (curws.objstm_p) newline();
+  }
+}
+
+/** Writes `stream' and copies a stream body of len bytes from the input
+ * position.
+ */
+static void w_stream(slen_t len) {
+  if (curws.seg!=NULL) { /* the body is copied by seg_stitch() */
+    if (len>currs.filesize-R_TELL()) erri("stream too short",0);
+    seg_put('S', R_TELL(), len);
+    r_seek(R_TELL()+len);
+    return;
+  }
+  if (curws.membuf==&curws.objbuf) { /* Dat: streams can't be in an object stream */
+    slen_t colc=curws.colc;
+    sbool lastclosed=curws.lastclosed;
+    curws.membuf=NULL; curws.lastclosed=TRUE;
+    w_obj_header(curws.objnum);
+    w_write(curws.objbuf.p, curws.objbuf.len);
+    curws.colc=colc; curws.lastclosed=lastclosed;
+  }
+  if (!curws.lastclosed) W_PUTC('\n');
+  w_puts("stream\n"); /* no "\r", to avoid confusion */
+  if (len!=r_copy_out(len)) erri("stream too short",0);
+  curws.lastclosed=TRUE; curws.colc=0;
+}
+
+/** Skips a whole recursive structure starting with `tok'. Works with `R' */
+static void skipstruct(char tok, sbool copy_p) {
+  slen_t nest=0;
+  pdfint_t b;
+  while (1) {
+    if (copy_p) copy_token(tok);
+    switch (tok) {
+     case 0:
+      erri("eof in skipstruct",0);
+      break;  /* unreached */
+     case '1': /* Skip a possible `R' */
+      if (gettok_isref(&b)) { /* Dat: copy_token() already called */
+        if (copy_p) {
+          ibufb=fmt_int(ibuf, b); copy_token('1');
+          ibuf[0]='R'; ibuf[1]='\0'; copy_token('R');
+        }
+      }
+      break;
+     case '[': case '<': /* Imp: treat dicts and arrays differently, create nest stack */
+      nest++;
       break;
      case ']': case '>':
       if (nest--==0) erri("too many array/dict closes",0);
@@ -852,63 +2522,294 @@ static void skipstruct(char tok, sbool copy_p) {
   }
 }
 
-static pdfint_t gettok_int(char const* for_) {
-  char tok;
-  slen_t lastofs;
-  pdfint_t a, b;
-  if ('1'!=(tok=gettok())) erri("int expected for ", for_);
-  a=ibuf_int; lastofs=currs.lastofs;
-  if ('1'==(tok=gettok()) && (b=ibuf_int, TRUE) && 'R'==(tok=gettok())) {
-    r_seek_obj(a,b); /* Imp: test this */
-    if ('1'!=(tok=gettok())) erri("int expected (R) for ", for_);
+/** Parses the integer object e (`N G obj I endobj') straight from the
+ * mmap()ed input, without moving the input position.
+ * @return FALSE if it can't, then it has to be read by gettok()
+ */
+static sbool r_peek_int_obj(struct XrefEntry const *e, pdfint_t num, pdfint_t *ret) {
+  char const *p, *q, *pend;
+  pdfint_t v[3];
+  unsigned i;
+  if (currs.map==NULL || XE_TYPE(e)!='n') return FALSE;
+  p=(char const*)currs.map+XE_OFS(e); pend=(char const*)currs.map+currs.filesize;
+  for (i=0; i<4; i++) { /* Dat: N, G, `obj' and I, each followed by whitespace */
+    q=p;
+    if (i==2) {
+      if (pend-p<3 || 0!=memcmp(p, "obj", 3)) return FALSE;
+      q+=3;
+    } else {
+      if (i==3 && q!=pend && (*q=='-' || *q=='+')) q++;
+      while (q!=pend && IS_DIGIT(*q)) q++;
+      if ('1'!=scan_number(p, q, v+(i==3 ? 2 : i))) return FALSE;
+    }
+    if (q==pend || !is_ps_white(*q)) return FALSE;
+    for (p=q; p!=pend && is_ps_white(*p); p++) {}
+  }
+  if (v[0]!=num || v[1]!=e->gennum || pend-p<6 || 0!=memcmp(p, "endobj", 6)) return FALSE;
+  *ret=v[2];
+  return TRUE;
+}
+
+/** @return the value of the integer object num, from currs.intcache if it
+ * has already been read
+ */
+static pdfint_t r_int_obj(pdfint_t num, pdfint_t gennum, char const* for_) {
+  struct XrefEntry *e=objentry(num, gennum); /* Dat: checks num */
+  struct IntCacheEntry *ic=currs.intcache+num%INTCACHE_SIZE;
+  slen_t afterofs;
+  pdfint_t a;
+  if (ic->num1==num+(slen_t)1) return ic->val;
+  if (!r_peek_int_obj(e, num, &a)) {
+    afterofs=r_tell();
+    r_seek_obj(num, gennum);
+    if ('1'!=gettok()) erri("int expected (R) for ", for_);
     a=ibuf_int;
-    r_seek(lastofs);
-    ASSERT_SE('1'==, gettok());
-    ASSERT_SE('R'==, gettok());
-  } else {
-    r_seek(lastofs);
+    r_seek(afterofs);
   }
+  ic->num1=num+1; ic->val=a;
+  return a;
+}
+
+static pdfint_t gettok_int(char const* for_) {
+  pdfint_t a, b;
+  if ('1'!=gettok()) erri("int expected for ", for_);
+  a=ibuf_int;
+  if (gettok_isref(&b)) a=r_int_obj(a, b, for_);
   return a;
 }
 
 static void r_seek_ref(void) {
-  slen_t lastofs=ftell(currs.file);
+  slen_t ofs;
   pdfint_t a, b;
-  if ('1'==gettok() && (a=ibuf_int, TRUE)
-   && '1'==gettok() && (b=ibuf_int, TRUE) && 'R'==gettok()
-     ) {
-    r_seek_obj(a,b);
+  char tok=gettok();
+  if (tok!='1') {
+    ungettok(tok);
   } else {
-    r_seek(lastofs); /* seek back */
+    a=ibuf_int; ofs=currs.tokofs;
+    if (gettok_isref(&b)) r_seek_obj(a,b);
+                     else ungettok_int(a, ofs);
   }
 }
 
-/** @return file offset of previous xref table in file; or 0 */
-static slen_t r_copy_trailer(void) {
+/** Dict entries needed for reading trailers, xref streams and object
+ * streams. -1 for missing int entries.
+ */
+struct XDict {
+  pdfint_t prev, xrefstm, size, length, n, first, predictor, columns;
+  pdfint_t w[3];
+  slen_t indexofs; /* 0 or file offset of the /Index array */
+  sbool flate_p;
+};
+
+/** Reads a dict to d, and skips over it. */
+static void r_read_xdict(struct XDict *d) {
   char tok;
-  pdfint_t prev=0;
-  if (gettok()!='E' || 0!=strcmp(ibuf,"trailer")) erri("trailer expected",0);
-  if (gettok()!='<') erri("trailer dict expected",0);
+  sbool arr_p;
+  unsigned i;
+  d->prev=d->xrefstm=d->size=d->length=d->n=d->first=d->columns=-1;
+  d->w[0]=d->w[1]=d->w[2]=-1;
+  d->predictor=1; d->indexofs=0; d->flate_p=FALSE;
+  if (gettok()!='<') erri("dict expected",0);
   while (1) {
     if ('>'==(tok=gettok())) break;
-    if ('/'!=tok) erri("trailer dict key expected",0);
+    if ('/'!=tok) erri("dict key expected",0);
     /* Dat: first trailer usually has: /Size /Info /Root /Prev /ID */
     /* Dat: prev trailers usually have: /Size /ID */
-    /* Dat: thus our merged trailer will have many /ID fields */
     #if DEBUG
-      fprintf(stderr,"trailer_key=(%s)\n",ibuf);
+      fprintf(stderr,"xdict_key=(%s)\n",ibuf);
     #endif
-    if (0==strcmp(ibuf,"/Prev")) {
-      prev=gettok_int("trailer /Prev");
-      if (prev<OBJ_MIN_OFS || prev+(slen_t)0>=currs.filesize) erri("invalid prev ofs",0);
-    } else if (0==strcmp(ibuf,"/Size")) {
+         if (0==strcmp(ibuf,"/Prev")) d->prev=gettok_int("/Prev");
+    else if (0==strcmp(ibuf,"/XRefStm")) d->xrefstm=gettok_int("/XRefStm");
+    else if (0==strcmp(ibuf,"/Size")) d->size=gettok_int("/Size");
+    else if (0==strcmp(ibuf,"/Length")) d->length=gettok_int("/Length");
+    else if (0==strcmp(ibuf,"/N")) d->n=gettok_int("/N");
+    else if (0==strcmp(ibuf,"/First")) d->first=gettok_int("/First");
+    else if (0==strcmp(ibuf,"/Index")) { d->indexofs=r_tell(); skipstruct(gettok(), FALSE); }
+    else if (0==strcmp(ibuf,"/W")) {
+      if (gettok()!='[') erri("/W array expected",0);
+      for (i=0; i<3; i++) d->w[i]=gettok_int("/W");
+      if (gettok()!=']') erri("/W must have 3 items",0);
+    } else if (0==strcmp(ibuf,"/Filter")) {
+      if ((arr_p=('['==(tok=gettok())))) tok=gettok();
+      if (tok=='/') {
+        if (0!=strcmp(ibuf,"/FlateDecode")) erri("unsupported /Filter: ",ibuf);
+        d->flate_p=TRUE;
+        if (arr_p) tok=gettok();
+      }
+      if (arr_p ? tok!=']' : !d->flate_p) erri("unsupported /Filter",0);
+    } else if (0==strcmp(ibuf,"/DecodeParms")) {
+      if ((arr_p=('['==(tok=gettok())))) tok=gettok();
+      if (tok=='<') {
+        while ('>'!=(tok=gettok())) {
+          if ('/'!=tok) erri("dict key expected",0);
+               if (0==strcmp(ibuf,"/Predictor")) d->predictor=gettok_int("/Predictor");
+          else if (0==strcmp(ibuf,"/Columns")) d->columns=gettok_int("/Columns");
+          else skipstruct(gettok(), FALSE);
+        }
+      } else if (tok!='n') erri("bad /DecodeParms",0);
+      if (arr_p && gettok()!=']') erri("unsupported /DecodeParms",0);
+    } else {
       skipstruct(gettok(), FALSE);
+    }
+  }
+}
+
+/** Skips the end-of-line after `stream' */
+static void r_skip_stream_eol(void) {
+  int i;
+  /* Dat: PDFRef.pdf subsection 3.2.7 says that "\r\n" mustn't follow `stream' -- but in the file PDFRef.pdf, it does */
+  if ((i=R_GETC())=='\r') {
+    i=R_GETC();
+    if (i!='\n') R_UNGETC(i);
+  } else if (!is_ps_white(i)) R_UNGETC(i);
+}
+
+/** Reads the stream data described by d from the input position (after the
+ * `stream' line), and decodes it.
+ * @return the malloc()ed decoded data, its length is stored to *lenret
+ */
+static unsigned char *r_decode_stream(struct XDict const *d, slen_t *lenret) {
+  unsigned char *tmp=NULL, *data;
+  unsigned char const *p;
+  slen_t len=d->length;
+  if (d->length<0 || len>currs.filesize-R_TELL()) erri("stream too short",0);
+  if (currs.map!=NULL) { /* decode straight from the mapping */
+    p=currs.bufp; currs.bufp+=len;
+  } else {
+    if (NULL==(cur_ctx->tmp=tmp=(unsigned char*)malloc(len+1))) errn("out of memory for stream",0);
+    if (len!=r_read((char*)tmp, len)) erri("stream too short",0);
+    p=tmp;
+  }
+  if (d->flate_p) {
+    z_inflate(p, len);
+    free(tmp); cur_ctx->tmp=data=zs.out; len=zs.outlen; zs.out=NULL;
+  } else if (tmp!=NULL) {
+    data=tmp;
+  } else {
+    if (NULL==(cur_ctx->tmp=data=(unsigned char*)malloc(len+1))) errn("out of memory for stream",0);
+    memcpy(data, p, len);
+  }
+  if (d->predictor>=10) {
+    len=png_unpredict(data, len, d->columns<0 ? 1 : d->columns);
+  } else if (d->predictor!=1) erri("unsupported /Predictor",0);
+  *lenret=len;
+  return data; /* Dat: still in cur_ctx->tmp, until the caller owns it */
+}
+
+/** Makes room for xref entries [0,xrefc). New entries have XE_TYPE()=='\0',
+ * their pages are allocated by xref_w().
+ */
+static void r_xref_grow(slen_t xrefc) {
+  slen_t i=(currs.xrefc+SPARSE_PAGE-1)/SPARSE_PAGE, n=(xrefc+SPARSE_PAGE-1)/SPARSE_PAGE;
+  if (xrefc>currs.xrefc) {
+    if (n>i) {
+      if (NULL==(currs.xrefpages=(struct XrefEntry**)realloc(currs.xrefpages, sizeof(currs.xrefpages[0])*n))) erri("out of memory for xref",0);
+      while (i<n) currs.xrefpages[i++]=NULL;
+    }
+    currs.xrefc=xrefc;
+  }
+}
+
+/** Reads an xref stream (PDF 1.5) at the input position, sets the entries
+ * not set by newer xref sections.
+ * @return its /Prev, or -1
+ */
+static pdfint_t r_read_xref_stream(void) {
+  struct XDict d;
+  struct XrefEntry *e;
+  unsigned char *data, *p, *pend;
+  slen_t len, rowlen, f[3];
+  pdfint_t start, count;
+  unsigned i, j;
+  if ('1'!=gettok() || '1'!=gettok() || 'E'!=gettok() || 0!=strcmp(ibuf,"obj")) erri("expected xref",0);
+  if (currs.trailer1ofs==-1U) currs.trailer1ofs=r_tell(); /* Dat: the dict is also the trailer */
+  r_read_xdict(&d);
+  for (rowlen=i=0; i<3; i++) {
+    if (d.w[i]<0 || d.w[i]>8) erri("bad /W in xref stream",0);
+    rowlen+=d.w[i];
+  }
+  if (d.size<0 || rowlen==0) erri("bad xref stream dict",0);
+  if ('E'!=gettok() || 0!=strcmp(ibuf,"stream")) erri("stream expected",0);
+  r_skip_stream_eol();
+  data=r_decode_stream(&d, &len);
+  p=data; pend=data+len;
+  if (d.indexofs!=0) {
+    r_seek(d.indexofs);
+    if ('['!=gettok()) erri("/Index array expected",0);
+  }
+  while (1) {
+    if (d.indexofs==0) {
+      if (p!=data) break;
+      start=0; count=d.size;
     } else {
-      copy_token(tok);
-      skipstruct(gettok(), FALSE); /* copy() */
+      if ('1'!=(i=gettok())) {
+        if (i!=']') erri("bad /Index in xref stream",0);
+        break;
+      }
+      start=ibuf_int;
+      if ('1'!=gettok() || start<0 || (count=ibuf_int)<0) erri("bad /Index in xref stream",0);
+    }
+    if (count+(slen_t)0>(slen_t)(pend-p)/rowlen || start>d.size-count) erri("xref stream too short",0);
+    r_xref_grow(start+count);
+    for (; count--!=0; start++) {
+      for (i=0; i<3; i++) {
+        for (f[i]=0, j=d.w[i]; j!=0; j--, p++) {
+          f[i]=f[i]>>(8*sizeof(f[i])-8)!=0 ? (slen_t)-1 : f[i]<<8|*p; /* Dat: -1 on overflow */
+        }
+      }
+      if (d.w[0]==0) f[0]=1;
+      if (f[0]>2) continue; /* Dat: other types are null references */
+      e=xref_w(start);
+      if (XE_TYPE(e)!='\0' && XE_TYPE(e)!='f') continue; /* Dat: a newer section has it */
+      if (f[0]==0) xe_set(e, 'f', 0, f[2]);
+      else if (f[0]==1) {
+        if (f[1]<OBJ_MIN_OFS || f[1]>=currs.filesize || f[2]>65535U) erri("invalid xref entry",0);
+        xe_set(e, 'n', f[1], f[2]);
+      } else xe_set(e, 'c', f[1]<XE_OFS_MAX ? f[1] : XE_OFS_MAX, 0); /* Dat: too large is out of bounds in objentry() */
     }
   }
-  return prev;
+  free(data); cur_ctx->tmp=NULL;
+  return d.prev;
+}
+
+/** Decodes the object stream containing the object of ce (once), and points
+ * the 'c' xref entries of its objects to their virtual offsets.
+ */
+static void r_load_objstm(struct XrefEntry *ce) {
+  struct XDict d;
+  struct XrefEntry *e;
+  struct ObjStm *os;
+  unsigned char *data;
+  slen_t stmnum=XE_OFS(ce), len, vofs;
+  pdfint_t i, num, ofs;
+  e=objentry((pdfint_t)stmnum, 0);
+  if (XE_TYPE(e)!='n') erri("object stream expected",0);
+  r_seek(XE_OFS(e));
+  if ('1'!=gettok() || '1'!=gettok() || 'E'!=gettok() || 0!=strcmp(ibuf,"obj")) erri("obj start expected",0);
+  r_read_xdict(&d);
+  if (d.n<0 || d.first<0) erri("bad object stream dict",0);
+  if ('E'!=gettok() || 0!=strcmp(ibuf,"stream")) erri("stream expected",0);
+  r_skip_stream_eol();
+  data=r_decode_stream(&d, &len);
+  if (d.first+(slen_t)0>len) erri("bad /First in object stream",0);
+  if (currs.objstmc==currs.objstma) {
+    currs.objstma=currs.objstma<16 ? 16 : 2*currs.objstma;
+    if (NULL==(currs.objstms=(struct ObjStm*)realloc(currs.objstms, currs.objstma*sizeof(currs.objstms[0])))) errn("out of memory for object streams",0);
+  }
+  vofs=currs.vofsend;
+  if (len>=XE_OFS_MAX-vofs) erri("object streams too long",0);
+  currs.vofsend=vofs+len+1; /* Dat: +1 separates the windows */
+  os=currs.objstms+currs.objstmc++;
+  os->vofs=vofs; os->len=len; os->data=data; cur_ctx->tmp=NULL;
+  r_seek(vofs);
+  for (i=0; i<d.n; i++) {
+    if ('1'!=gettok() || (num=ibuf_int)<0 || '1'!=gettok() || (ofs=ibuf_int)<0
+     || ofs+(slen_t)0>len-d.first) erri("bad object stream header",0);
+    if (num+(slen_t)0<currs.xrefc && (e=xref_at(num))!=NULL && XE_TYPE(e)=='c' && XE_OFS(e)==stmnum) {
+      xe_set(e, 'o', vofs+d.first+ofs, e->gennum);
+    }
+  }
+  if (XE_TYPE(ce)=='c') erri("object missing from object stream",0);
 }
 
 /**
@@ -921,7 +2822,7 @@ static slen_t r_copy_trailer(void) {
 static sbool r_seek_dictval(char const* key) {
   char tok;
   pdfint_t prev=0;
-  slen_t oldofs=ftell(currs.file);
+  slen_t oldofs=r_tell();
   if (gettok()!='<') erri("dict expected",0);
   while (1) {
     if ('>'==(tok=gettok())) { r_seek(oldofs); return FALSE; }
@@ -937,9 +2838,29 @@ static void r_seek_dictval_must(char const* key) {
   if (!r_seek_dictval(key)) erri("missing dict key", key);
 }
 
+/** @return the /Length of the stream after the dict read last, see
+ * currs.length_p. lastofs is the offset of the dict, for re-reading it if
+ * the /Length wasn't found in it.
+ */
+static pdfint_t r_stream_length(slen_t lastofs) {
+  slen_t afterofs;
+  pdfint_t streamlen;
+  if (currs.length_p) {
+    streamlen=currs.lengthgen<0 ? currs.length : r_int_obj(currs.length, currs.lengthgen, "dump");
+  } else {
+    afterofs=r_tell();
+    r_seek(lastofs);
+    r_seek_dictval_must("/Length"); /* BUGFIX at Sun Mar  7 18:37:23 CET 2004 */
+    streamlen=gettok_int("dump");
+    r_seek(afterofs);
+  }
+  if (streamlen<0) erri("negative stream length",0);
+  return streamlen;
+}
+
 /** @param typenam e.g "/Pages" */
 static void r_checktype(char const* typenam) {
-  slen_t oldofs=ftell(currs.file);
+  slen_t oldofs=r_tell();
   if (!r_seek_dictval("/Type")) erri("missing /Type for dict", 0);
   r_seek_ref();
   if ('/'!=gettok() || 0!=strcmp(ibuf, typenam)) {
@@ -950,454 +2871,2685 @@ static void r_checktype(char const* typenam) {
   r_seek(oldofs);
 }
 
-static slen_t r_copy_trailer(void);
+/** Length of an entry in a classic xref table, e.g "0000000009 00000 n \n" */
+#define XREF_ENTRY_SIZE 20
 
+/** Decodes a 20-byte xref entry at p to *e, without sscanf(). Keeps *e if
+ * a newer xref section has already set it (to non-free).
+ * @return TRUE on a malformed entry
+ */
+static sbool xref_entry_decode(unsigned char const *p, struct XrefEntry *e) {
+  slen_t ofs=0, gen=0, d;
+  unsigned i;
+  sbool bad=!is_ps_white(p[10]) || !is_ps_white(p[16])
+         || (p[17]!='n' && p[17]!='f');
+  for (i=0; i<9; i++) { bad|=(d=p[i]-(unsigned char)'0')>9; ofs=10*ofs+d; }
+  bad|=(d=p[9]-(unsigned char)'0')>9;
+  if (ofs>(((slen_t)-1)-d)/10) ofs=(slen_t)-1; /* overflow: invalid for 'n' */
+                          else ofs=10*ofs+d;
+  for (i=11; i<16; i++) { bad|=(d=p[i]-(unsigned char)'0')>9; gen=10*gen+d; }
+  if (bad || gen>65535U
+   || (p[17]=='n' && ofs!=0 && (ofs<OBJ_MIN_OFS || ofs>=currs.filesize))
+     ) return TRUE;
+  if (XE_TYPE(e)!='\0' && XE_TYPE(e)!='f') return FALSE;
+  xe_set(e, ofs==0 ? 'f' : (char)p[17], ofs, gen);
+  return FALSE;
+}
+
+/** Reads xcount 20-byte xref entries of an xref subsection, from object
+ * number num. Entries are decoded in place in the input window, a whole
+ * subsection at once if the input is mmap()ed.
+ */
+static void r_read_xref_entries(slen_t num, slen_t xcount) {
+  unsigned char const *p, *pend;
+  unsigned char xbuf[XREF_ENTRY_SIZE];
+  slen_t n;
+  while (xcount!=0) {
+    if ((n=(currs.bufend-currs.bufp)/XREF_ENTRY_SIZE)==0) {
+      /* Dat: an entry crosses the end of the fread() window */
+      if (XREF_ENTRY_SIZE!=r_read((char*)xbuf, XREF_ENTRY_SIZE)
+       || xref_entry_decode(xbuf, xref_w(num))) erri("invalid xref entry",0);
+      num++; xcount--;
+      continue;
+    }
+    if (n>xcount) n=xcount;
+    xcount-=n;
+    for (p=currs.bufp, pend=p+n*XREF_ENTRY_SIZE; p!=pend; p+=XREF_ENTRY_SIZE) {
+      if (xref_entry_decode(p, xref_w(num++))) { currs.bufp=p; erri("invalid xref entry",0); }
+    }
+    currs.bufp=pend;
+  }
+}
+
+/** Reads all xref sections, newest first: a classic xref table or an xref
+ * stream, then its /Prev etc. An entry is set by the newest section having
+ * it, free entries may be overridden by older sections.
+ */
 static void r_read_xref(void) {
-  struct XrefEntry *e;
-  char tok, xbuf[21];
-  unsigned long dummy;
-  pdfint_t xzero, xcount;
-  slen_t prevofs;
+  char tok;
+  pdfint_t xzero, xcount, prev;
+  struct XDict d;
   int n;
   currs.xreftc=1;
   currs.trailer1ofs=-1U;
   while (1) {
-    if ((tok=gettok())!='E' || 0!=strcmp(ibuf,"xref")) { erri("expected xref",0); return; }
-    if ((tok=gettok())!='1' || (xzero =ibuf_int)<0) { erri("expected xref base offset",0); return; }
-    if ((tok=gettok())!='1' || (xcount=ibuf_int)<0) { erri("expected xref count",0); return; }
-    #if DEBUG
-      fprintf(stderr,"xref=(%lu+%lu)\n", xzero, xcount);
-    #endif
-    while ((n=getc(currs.file))>=0 && is_ps_white(n)) {}
-    if (n>=0) ungetc(n,currs.file);
-    if (xzero+xcount+(slen_t)0>currs.xrefc) {
-      if (NULL==(currs.xrefs=(struct XrefEntry*)realloc(currs.xrefs, sizeof(currs.xrefs[0])*(xzero+xcount)))) erri("out of memory for xref",0);
-      memset(currs.xrefs+currs.xrefc, '\0', (xzero+xcount-currs.xrefc)*sizeof(currs.xrefs[0]));
-      /* ^^^ Dat: initialize .type with '\0' */
-      currs.xrefc=xzero+xcount;
-    }
-    e=currs.xrefs+xzero;
-    xbuf[20]='\0';
-    while (xcount--!=0) {
-      if (20!=fread(xbuf, 1, 20, currs.file)
-       || !is_digits(xbuf, xbuf+10)
-       || !is_ps_white(xbuf[10])
-       || !is_digits(xbuf+11, xbuf+16)
-       || !is_ps_white(xbuf[16])
-       || ((e->type=xbuf[17])!='n' && xbuf[17]!='f')
-       || 2!=sscanf(xbuf, "%" SLEN_P"u%hu", &(e->ofs), &(e->gennum))
-       || (dummy=e->gennum)>65535UL /* Dat: tmp= to pacify gcc-3.4 warning: comparison is always false due to limited range of data type */
-       || (xbuf[17]=='n' && e->ofs != 0 && (e->ofs<OBJ_MIN_OFS || e->ofs>=currs.filesize))
-         ) erri("invalid xref entry",0);
-      if (e->ofs == 0) e->type = 'f';
-      e++;
-    }
-    if (currs.trailer1ofs==-1U) currs.trailer1ofs=ftell(currs.file);
-    if (0==(prevofs=r_copy_trailer())) break;
-    r_seek(prevofs);
+    if ((tok=gettok())=='1') { /* `N G obj' of an xref stream */
+      ungettok(tok);
+      prev=r_read_xref_stream();
+      goto have_prev;
+    }
+    if (tok!='E' || 0!=strcmp(ibuf,"xref")) { erri("expected xref",0); return; }
+    tok=gettok();
+    do { /* read all subsections */
+      if (tok!='1' || (xzero =ibuf_int)<0) { erri("expected xref base offset",0); return; }
+      if ((tok=gettok())!='1' || (xcount=ibuf_int)<0) { erri("expected xref count",0); return; }
+      #if DEBUG
+        fprintf(stderr,"xref=(%lu+%lu)\n", xzero, xcount);
+      #endif
+      if (xcount+(slen_t)0>currs.filesize/XREF_ENTRY_SIZE) erri("xref count too large",0);
+      while ((n=R_GETC())>=0 && is_ps_white(n)) {}
+      R_UNGETC(n);
+      r_xref_grow(xzero+(slen_t)xcount);
+      r_read_xref_entries(xzero, xcount);
+    } while ('1'==(tok=gettok()));
+    if (tok!='E' || 0!=strcmp(ibuf,"trailer")) erri("trailer expected",0);
+    if (currs.trailer1ofs==-1U) currs.trailer1ofs=r_tell();
+    r_read_xdict(&d);
+    if (d.xrefstm!=-1) { /* Dat: hybrid file: the xref stream comes before /Prev, its /Prev is ignored */
+      if (d.xrefstm<OBJ_MIN_OFS || d.xrefstm+(slen_t)0>=currs.filesize) erri("invalid /XRefStm ofs",0);
+      r_seek(d.xrefstm);
+      r_read_xref_stream();
+    }
+    prev=d.prev;
+   have_prev:
+    if (prev==-1) break;
+    if (prev<OBJ_MIN_OFS || prev+(slen_t)0>=currs.filesize) erri("invalid prev ofs",0);
+    r_seek(prev);
     currs.xreftc++;
   }
   /* Now find currs.catalogofs */
   r_seek(currs.trailer1ofs);
-  ASSERT_SE('E'==,gettok()); /* skip `trailer' */
   r_seek_dictval_must("/Root"); r_seek_ref();
-  currs.catalogofs=ftell(currs.file);
+  currs.catalogofs=r_tell();
 
   #if DEBUG
-    fprintf(stdout, "Input PDF (%s): filesize=%" SLEN_P"u, xrefc=%" SLEN_P"u, xreftc=%u, catalogofs=%" SLEN_P"d\n",
+    fprintf(stdout, "Input PDF (%s): filesize=%" SLEN_P"u, xrefc=%" SLEN_P"u, xreftc=%" SLEN_P"u, catalogofs=%" SLEN_P"u\n",
       currs.filename, currs.filesize, currs.xrefc, currs.xreftc, currs.catalogofs);
   #endif
   r_seek(currs.catalogofs);
   r_checktype("/Catalog");
   r_seek_dictval_must("/Pages"); r_seek_ref();
   #if DEBUG
-    fprintf(stderr, "/Pages at=%ld\n", ftell(currs.file));
+    fprintf(stderr, "/Pages at=%ld\n", r_tell());
   #endif
-  currs.uppagesofs=ftell(currs.file);
+  currs.uppagesofs=r_tell();
   r_checktype("/Pages");
   r_seek_dictval_must("/Count");
   if (0>(xcount=gettok_int("pagecount"))) erri("page count <0",ibuf);
   curws.pagetotal+=currs.pagecount=xcount;
 }
 
-static struct XrefEntry *enq_first=NULL, **enq_lastp=&enq_first;
+/* --- Page ranges */
 
-#define ENQ_PUT(xe) (*enq_lastp=(xe), (xe)->next=NULL, enq_lastp=&((xe)->next))
-#define ENQ_RESET() (enq_first=NULL, enq_lastp=&enq_first)
+/** Maximum depth of the page tree walked by r_select_walk() */
+#define PAGETREE_MAXDEPTH 256
 
-/** Skips a whole recursive structure starting with `tok'. Works with `R' */
-static void wr_enqueue_struct(sbool copy_p) {
-  struct XrefEntry *e;
+/** A node of the input page tree, read by r_read_pagenode() */
+struct PageNode {
+  /** Offset of the value of inh_keys[I] in the node or in its nearest
+   * ancestor having it, 0 if none
+   */
+  slen_t inhofs[INH_KEYC];
+  unsigned own; /* bit I: the node has inh_keys[I] itself */
+  slen_t kidsofs; /* offset of the value of /Kids, 0 if none */
+  pdfint_t count; /* /Count, -1 if none */
+  sbool pages_p; /* /Type/Pages, or no /Type and has /Kids */
+};
+
+/** Reads the page tree node dict at the current position, in a single
+ * pass. parent is NULL for the root.
+ */
+static void r_read_pagenode(struct PageNode *pn, struct PageNode const *parent) {
   char tok;
-  slen_t nest=0, lastofs;
-  pdfint_t a, b;
-  /* enqueue_stream_length=-1; */
-  while (1) {
-    if (0==(tok=gettok())) erri("eof in e_s", 0);
-    #if DEBUG
-      ibufb[0]='\n'; ibufb[1]='\0'; fputs(ibuf,stderr);
-    #endif
-    if (copy_p && tok!='1') copy_token(tok);
-    switch (tok) {
-     case '1': /* Skip a possible `R' */
-      a=ibuf_int;
-      lastofs=currs.lastofs; /* Dat: copy_token() already called */
-      if ('1'==(tok=gettok()) && (b=ibuf_int, TRUE) && 'R'==(tok=gettok())) {
-        e=objentry(a,b);
-        #if DEBUG
-          fprintf(stderr,"XUT %ld (%ld %ld obj)\n", e->target_num, a, b);
-        #endif
-        if (e->target_num==0) {
-          e->target_num=curws.outobjc++;
-          #if DEBUG
-            fprintf(stderr, "PUT\n");
-          #endif
-          ENQ_PUT(e);
-        }
-        if (copy_p) {
-          sprintf(ibuf, "%" SLEN_P"d 0 R", e->target_num); ibufb=ibuf+strlen(ibuf);
-          copy_token('1');
-        }
-      } else {
-        if (copy_p) {
-          sprintf(ibuf, "%" SLEN_P"d", a); ibufb=ibuf+strlen(ibuf);
-          copy_token('1');
-        }
-        r_seek(lastofs);
-      }
-      break;
-     case '[': case '<': /* Imp: treat dicts and arrays differently, create nest stack */
-      nest++;
-      break;
-     case ']': case '>':
-      if (nest--==0) erri("too many array/dict closes in e_s",0);
-      break;
-     default: ;
+  unsigned i;
+  int type=0; /* 1: /Pages, 2: other */
+  if (gettok()!='<') erri("page tree dict expected",0);
+  for (i=0; i<INH_KEYC; i++) pn->inhofs[i]=parent!=NULL ? parent->inhofs[i] : 0;
+  pn->own=0; pn->kidsofs=0; pn->count=-1;
+  while ('>'!=(tok=gettok())) {
+    if ('/'!=tok) erri("page tree dict key expected",0);
+    if (0==strcmp(ibuf,"/Type")) {
+      if ('/'==(tok=gettok())) type=0==strcmp(ibuf,"/Pages") ? 1 : 2;
+                          else skipstruct(tok, FALSE);
+      continue;
     }
-    if (nest==0) break;
+    if (0==strcmp(ibuf,"/Count")) { pn->count=gettok_int("/Count"); continue; }
+    if (0==strcmp(ibuf,"/Kids")) pn->kidsofs=r_tell();
+    for (i=0; i<INH_KEYC && 0!=strcmp(ibuf,inh_keys[i]); i++) {}
+    if (i<INH_KEYC) { pn->inhofs[i]=r_tell(); pn->own|=1U<<i; }
+    skipstruct(gettok(), FALSE);
   }
+  pn->pages_p=type==1 || (type==0 && pn->kidsofs!=0);
 }
 
-static void w_dump_start(void) {
-  if (0!=fseek(curws.wf, 0, SEEK_SET)) errn("cannot begin dump",curws.filename);
-  fprintf(curws.wf, "%s%s", currs.pdf_header, currs.is_binary ? "%\xE1\xE9\xF3\xFA\n" : "");
-  curws.is_binary=currs.is_binary; /* Imp: pre-look other inputs */
-  curws.outobjc=2;
-  curws.txrefa=0;
-  curws.txrefc=0;
-  curws.txrefs=NULL;
-  curws.lastclosed=TRUE;
+/** Compares indexes of curws.selv by page index, for qsort() */
+static int cmp_sel_idx(void const *a, void const *b) {
+  slen_t x=curws.selv[*(slen_t const*)a].idx, y=curws.selv[*(slen_t const*)b].idx;
+  return x<y ? -1 : x>y;
 }
 
-static void w_xref_aset(slen_t num, slen_t ofs) {
-  if (num>=curws.txrefa) {
-    #ifdef __CHECKER__Z
-      slen_t oa=curws.txrefa;
-    #endif
-    if (curws.txrefa<16) curws.txrefa=16;
-    while (curws.txrefa<=num) curws.txrefa<<=1;
-    if (NULL==(curws.txrefs=(slen_t*)realloc(curws.txrefs, curws.txrefa*sizeof(curws.txrefs[0])))) errn("out of memory for xref_aset",0);
-    #ifdef __CHECKER__Z
-      memset(curws.txrefs+oa, '\0'
-    #endif
-  }
-  if (num>=curws.txrefc) {
-    memset(curws.txrefs+curws.txrefc, '\0', sizeof(curws.txrefs[0])*(num-curws.txrefc));
-    curws.txrefc=num+1;
+/** Walks the kids of the /Pages node pn (its first page has index base),
+ * recording the selected leaves in curws.selv[order[*kp]...]. Subtrees
+ * without selected pages are skipped by their /Count, without reading
+ * their kids.
+ */
+static void r_select_walk(struct PageNode const *pn, slen_t const *order, slen_t *kp, slen_t base, unsigned depth) {
+  struct PageNode kn;
+  struct PageSel *ps;
+  pdfint_t a, b;
+  slen_t ofs;
+  char tok;
+  unsigned i;
+  if (depth>PAGETREE_MAXDEPTH) erri("page tree too deep",0);
+  if (pn->kidsofs==0) erri("missing /Kids in /Pages",0);
+  r_seek(pn->kidsofs);
+  if (gettok()!='[') erri("/Kids array expected",0);
+  while (*kp!=curws.selc && ']'!=(tok=gettok())) {
+    if ('1'!=tok || (a=ibuf_int, !gettok_isref(&b))) erri("/Kids ref expected",0);
+    ofs=r_tell();
+    r_seek_obj(a, b);
+    r_read_pagenode(&kn, pn);
+    if (kn.pages_p) {
+      if (kn.count<0) erri("missing /Count in /Pages",0);
+      if (curws.selv[order[*kp]].idx<base+kn.count) r_select_walk(&kn, order, kp, base, depth+1);
+      base+=kn.count;
+    } else {
+      for (; *kp!=curws.selc && (ps=curws.selv+order[*kp])->idx==base; ++*kp) {
+        ps->num=a; ps->gennum=b;
+        for (i=0; i<INH_KEYC; i++) ps->inhofs[i]=(kn.own>>i&1)!=0 ? 0 : kn.inhofs[i];
+        sn_set(&curws.selmark, a, order[*kp]+1);
+      }
+      base++;
+    }
+    r_seek(ofs);
   }
-  curws.txrefs[num]=ofs;
 }
 
-static void w_dump_xref(void) {
-  slen_t const *p=curws.txrefs, *pend=p+curws.txrefc;
-  if (!curws.lastclosed) putc('\n',curws.wf);
-  curws.startxrefofs=ftell(curws.wf);
-  fprintf(curws.wf, "xref\n0 %" SLEN_P"u\n", curws.txrefc); /* Dat: must be "\n" */
-  while (p!=pend) {
-    if (*p!=0) {
-      if (*p/1000000U>=10000U) errn("offset overflow",0); /* Dat: works with 32 bit arithmetic */
-      fprintf(curws.wf, "%010" SLEN_P"u 00000 n \n", *p++);
-    } else { fprintf(curws.wf, "0000000000 65535 f \n"); p++; }
+/** @return the page number at *pp in page range sel: 1-based, or `z' for
+ * the last page
+ */
+static slen_t r_parse_pageno(char const **pp, char const *sel) {
+  char const *p=*pp;
+  slen_t n=0;
+  if (*p=='z') { *pp=p+1; return currs.pagecount; }
+  if (!IS_DIGIT(*p)) erri("bad page range: ", sel);
+  for (; IS_DIGIT(*p); p++) {
+    if (n>currs.pagecount) erri("page out of range: ", sel);
+    n=10*n+(*p-'0');
   }
-  curws.lastclosed=TRUE; curws.colc=0;
+  if (n==0 || n>currs.pagecount) erri("page out of range: ", sel);
+  *pp=p;
+  return n;
 }
 
-static void wr_enqueue_catalog(void) {
-  char tok;
-  if (gettok()!='<') erri("catalog dict expected",0);
-  copy_token('<');
+/** Selects the pages of currs by the page ranges sel, e.g "1-3,7,z": comma
+ * separated pages and ranges (descending ones too), in output order. Finds
+ * them in the page tree, with their inherited attributes, to
+ * curws.selv and curws.selmark; r_enqueue_obj() will copy only these
+ * pages, as the kids of the root /Pages.
+ */
+static void r_select_pages(char const *sel) {
+  struct PageNode root;
+  char const *p=sel;
+  slen_t a, b, i, k=0, *order;
   while (1) {
-    copy_token(tok=gettok());
-    if ('>'==tok) break;
-    if ('/'!=tok) erri("catalog dict key expected",0);
-    if (0==strcmp(ibuf,"/Pages")) { /* must be an indirect reference */
-      struct XrefEntry *e;
-      slen_t lastofs=ftell(currs.file);
-      pdfint_t a, b;
-      if ('1'==gettok() && (a=ibuf_int, TRUE)
-       && '1'==gettok() && (b=ibuf_int, TRUE) && 'R'==gettok()
-         ) {} else { r_seek(lastofs); erri("/Pages of /Catalog must be indirect", 0); return; }
-      r_seek(lastofs);
-      e=objentry(a,b);
-      wr_enqueue_struct(FALSE);
-      curws.lastsrcpages_num=e->target_num;
-      sprintf(ibuf, "1 0 R"); ibufb=ibuf+strlen(ibuf);
-      copy_token('1');
-    } else {
-      wr_enqueue_struct(TRUE);
+    a=b=r_parse_pageno(&p, sel);
+    if (*p=='-') { p++; b=r_parse_pageno(&p, sel); }
+    while (1) {
+      if (curws.selc==curws.sela) {
+        curws.sela=curws.sela<64 ? 64 : 2*curws.sela;
+        if (NULL==(curws.selv=(struct PageSel*)realloc(curws.selv, curws.sela*sizeof(curws.selv[0])))) errn("out of memory for pages",0);
+      }
+      curws.selv[curws.selc++].idx=a-1;
+      if (a==b) break;
+      if (a<b) a++; else a--;
     }
+    if (*p=='\0') break;
+    if (*p++!=',') erri("bad page range: ", sel);
+  }
+  if (NULL==(cur_ctx->tmp=order=(slen_t*)malloc(curws.selc*sizeof(order[0])))) errn("out of memory for pages",0);
+  for (i=0; i<curws.selc; i++) order[i]=i;
+  qsort(order, curws.selc, sizeof(order[0]), cmp_sel_idx);
+  for (i=1; i<curws.selc; i++) {
+    if (curws.selv[order[i-1]].idx==curws.selv[order[i]].idx) erri("page selected twice: ", sel);
   }
+  r_seek(currs.uppagesofs);
+  r_read_pagenode(&root, NULL);
+  r_select_walk(&root, order, &k, 0, 0);
+  if (k!=curws.selc) erri("page tree has fewer pages than /Count",0);
+  free(order); cur_ctx->tmp=NULL;
+  curws.pagetotal+=curws.selc-currs.pagecount;
 }
 
-static void wr_enqueue_uppages(void) {
-  char tok;
-  if (gettok()!='<') erri("uppages dict expected",0);
-  copy_token('<');
-  sprintf(ibuf,"/Parent"); ibufb=ibuf+strlen(ibuf); copy_token('/');
-  sprintf(ibuf,"1 0 R");   ibufb=ibuf+strlen(ibuf); copy_token('1');
-  while (1) {
-    copy_token(tok=gettok());
-    if ('>'==tok) break;
-    if ('/'!=tok) erri("uppages dict key expected",0);
-    if (0==strcmp(ibuf,"/Parent")) { /* must be an indirect reference */
-      /* Dat: top /Pages doesn't have /Parent, but ensure */
-      skipstruct(gettok(), FALSE);
-    } else {
-      wr_enqueue_struct(TRUE);
-    }
+/** Reads the `N G obj' of input object num (if any), and seeks to its
+ * value. @return the offset of the value
+ */
+static slen_t r_seek_objval(slen_t num) {
+  struct XrefEntry *e=xref_at(num);
+  if (XE_TYPE(e)=='c') r_load_objstm(e);
+  r_seek(XE_OFS(e));
+  if (XE_TYPE(e)!='o' && ('1'!=gettok() || '1'!=gettok()
+   || 'E'!=gettok() || 0!=strcmp(ibuf,"obj"))
+     ) erri("obj start expected",0);
+  return r_tell();
+}
+
+/** @return whether the object at the current position is a page tree node
+ * (/Type /Page or /Pages). Doesn't move.
+ */
+static sbool r_pagenode_p(void) {
+  slen_t ofs=r_tell();
+  sbool ret=FALSE;
+  if ('<'==gettok()) {
+    r_seek(ofs);
+    if (r_seek_dictval("/Type") && '/'==gettok()) ret=0==strcmp(ibuf,"/Page") || 0==strcmp(ibuf,"/Pages");
   }
+  r_seek(ofs);
+  return ret;
 }
 
-/** Reads all objs reachable from currs, and dumps them to curws in order */
-static void r_dump_reachable(void) {
-  struct XrefEntry *e;
-  pdfint_t streamlen;
-  slen_t lastofs;
-  char tok;
-  ENQ_RESET();
-  r_seek(currs.trailer1ofs);
-  skipstruct(gettok(), FALSE); /* `trailer' */
-  wr_enqueue_struct(FALSE);
-  while (enq_first!=NULL) {
-    e=enq_first;
-    #if DEBUG
-      fprintf(stderr,"dumping_src=(%u)\n", e-currs.xrefs);
-    #endif
-    if (!curws.lastclosed) putc('\n',curws.wf);
-    w_xref_aset(e->target_num, ftell(curws.wf));
-    #if 0
-      fprintf(stderr, "%" SLEN_P"u 0 obj # from %lu\n", e->target_num, e->ofs);
-    #endif
-    fprintf(curws.wf, "%" SLEN_P"u 0 obj\n", e->target_num);
-    curws.lastclosed=TRUE; curws.colc=0;
-    r_seek(e->ofs);
-    if ('1'!=gettok() || '1'!=gettok()
-     || 'E'!=gettok() || 0!=strcmp(ibuf,"obj")
-       ) erri("obj start expected",0);
-    lastofs=ftell(currs.file);
-    #if DEBUG
-      fprintf(stderr, "CMP %ld %ld\n", lastofs, currs.catalogofs);
-    #endif
-         if (lastofs==currs.catalogofs) wr_enqueue_catalog();
-    else if (lastofs==currs.uppagesofs) wr_enqueue_uppages();
-                                   else wr_enqueue_struct(TRUE);
+/* --- Deduplication */
+
+static unsigned long const dd_sha_k[64]={
+  0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+  0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+  0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL, 0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+  0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL, 0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+  0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL, 0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+  0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL, 0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+  0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL, 0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+  0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL, 0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+#define DD_M32 0xffffffffUL
+/** Rotates the 32-bit x right by n */
+#define DD_ROR(x,n) (((x)>>(n) | (x)<<(32-(n))) & DD_M32)
+
+static void dd_sha_init(struct DedupSha *s) {
+  static unsigned long const iv[8]={0x6a09e667UL, 0xbb67ae85UL, 0x3c6ef372UL,
+    0xa54ff53aUL, 0x510e527fUL, 0x9b05688cUL, 0x1f83d9abUL, 0x5be0cd19UL};
+  memcpy(s->st, iv, sizeof(iv));
+  s->len=0;
+}
+
+/** One round of SHA-256, with the variables renamed instead of moved */
+#define DD_ROUND(a,b,c,d,e,f,g,h,i) \
+  t1=h+(DD_ROR(e,6)^DD_ROR(e,11)^DD_ROR(e,25))+(g^(e&(f^g)))+dd_sha_k[i]+w[i]; \
+  d=(d+t1)&DD_M32; \
+  h=(t1+(DD_ROR(a,2)^DD_ROR(a,13)^DD_ROR(a,22))+((a&b)|(c&(a|b))))&DD_M32;
+
+/** Hashes the 64-byte block p into s->st. */
+static void dd_sha_block(struct DedupSha *s, unsigned char const *p) {
+  unsigned long w[64], a, b, c, d, e, f, g, h, t1, t2;
+  unsigned i;
+  for (i=0; i<16; i++, p+=4) w[i]=(unsigned long)p[0]<<24 | (unsigned long)p[1]<<16 | (unsigned long)p[2]<<8 | p[3];
+  for (; i<64; i++) {
+    t1=w[i-2]; t2=w[i-15];
+    w[i]=((DD_ROR(t1,17)^DD_ROR(t1,19)^t1>>10)+w[i-7]+(DD_ROR(t2,7)^DD_ROR(t2,18)^t2>>3)+w[i-16])&DD_M32;
+  }
+  a=s->st[0]; b=s->st[1]; c=s->st[2]; d=s->st[3]; e=s->st[4]; f=s->st[5]; g=s->st[6]; h=s->st[7];
+  for (i=0; i<64; i+=8) {
+    DD_ROUND(a,b,c,d,e,f,g,h,i)   DD_ROUND(h,a,b,c,d,e,f,g,i+1)
+    DD_ROUND(g,h,a,b,c,d,e,f,i+2) DD_ROUND(f,g,h,a,b,c,d,e,i+3)
+    DD_ROUND(e,f,g,h,a,b,c,d,i+4) DD_ROUND(d,e,f,g,h,a,b,c,i+5)
+    DD_ROUND(c,d,e,f,g,h,a,b,i+6) DD_ROUND(b,c,d,e,f,g,h,a,i+7)
+  }
+  s->st[0]=(s->st[0]+a)&DD_M32; s->st[1]=(s->st[1]+b)&DD_M32;
+  s->st[2]=(s->st[2]+c)&DD_M32; s->st[3]=(s->st[3]+d)&DD_M32;
+  s->st[4]=(s->st[4]+e)&DD_M32; s->st[5]=(s->st[5]+f)&DD_M32;
+  s->st[6]=(s->st[6]+g)&DD_M32; s->st[7]=(s->st[7]+h)&DD_M32;
+}
+
+/** Adds len bytes to hash s. Dat: a cryptographic hash, because merged
+ * objects aren't compared byte by byte; a crafted collision of the 128 bits
+ * kept would take about 2**64 hashes.
+ */
+static void dd_update(struct DedupSha *s, char const *p, slen_t len) {
+  unsigned char const *q=(unsigned char const*)p;
+  unsigned n=(unsigned)(s->len&63);
+  s->len+=len;
+  if (n!=0) {
+    if (len<64-n) { memcpy(s->buf+n, q, len); return; }
+    memcpy(s->buf+n, q, 64-n); q+=64-n; len-=64-n;
+    dd_sha_block(s, s->buf);
+  }
+  for (; len>=64; q+=64, len-=64) dd_sha_block(s, q);
+  memcpy(s->buf, q, len);
+}
+
+/** Finishes hash s to h. */
+static void dd_sha_final(struct DedupSha *s, unsigned char *h) {
+  unsigned n=(unsigned)(s->len&63), i;
+  slen_t len=s->len;
+  s->buf[n++]=0x80;
+  if (n>56) { memset(s->buf+n, '\0', 64-n); dd_sha_block(s, s->buf); n=0; }
+  memset(s->buf+n, '\0', 56-n);
+  s->buf[63]=(unsigned char)(len<<3); /* Dat: bit length, big endian */
+  for (i=62; i>=56; i--, len>>=4, len>>=4) s->buf[i]=(unsigned char)(len>>5);
+  dd_sha_block(s, s->buf);
+  for (i=0; i<DD_HASHLEN; i++) h[i]=(unsigned char)(s->st[i>>2]>>(24-8*(i&3)));
+}
+
+static void dd_update_int(struct DedupSha *h, slen_t v) {
+  char tmp[sizeof(slen_t)];
+  unsigned i;
+  for (i=0; i<sizeof(tmp); i++, v>>=4, v>>=4) tmp[i]=(char)v;
+  dd_update(h, tmp, sizeof(tmp));
+}
+
+/** @return the node of input object xi, appending it to the BFS queue if new */
+static slen_t dd_node(slen_t xi) {
+  struct DedupNode *nd;
+  slen_t v=sn_get(&currs.ddnode, xi);
+  if (v==0) {
+    if (currs.ddnodec==currs.ddnodea) {
+      currs.ddnodea=currs.ddnodea<64 ? 64 : 2*currs.ddnodea;
+      if (NULL==(currs.ddnodes=(struct DedupNode*)realloc(currs.ddnodes, currs.ddnodea*sizeof(currs.ddnodes[0])))) errn("out of memory for dedup",0);
+    }
+    nd=currs.ddnodes+currs.ddnodec;
+    memset(nd, '\0', sizeof(*nd));
+    nd->xi=xi;
+    sn_set(&currs.ddnode, xi, v=++currs.ddnodec);
+  }
+  return v-1;
+}
+
+/** Appends the node of input object xi to currs.ddkids. */
+static void dd_add_kid(slen_t xi) {
+  if (currs.ddkidc==currs.ddkida) {
+    currs.ddkida=currs.ddkida<256 ? 256 : 2*currs.ddkida;
+    if (NULL==(currs.ddkids=(slen_t*)realloc(currs.ddkids, currs.ddkida*sizeof(currs.ddkids[0])))) errn("out of memory for dedup",0);
+  }
+  currs.ddkids[currs.ddkidc++]=dd_node(xi);
+}
+
+/** Reads a whole recursive structure like wr_enqueue_struct(), hashing its
+ * tokens to h (if not NULL) and appending the referred nodes to currs.ddkids.
+ * Sets currs.length_p etc.
+ */
+static void dd_scan_struct(struct DedupSha *h) {
+  char tok;
+  slen_t nest=0;
+  pdfint_t a, b;
+  sbool key_p=FALSE, val_p; /* see wr_enqueue_struct() */
+  currs.length_p=FALSE;
+  while (1) {
+    if (0==(tok=gettok())) erri("eof in e_s", 0);
+    val_p=key_p && !currs.length_p;
+    key_p=tok=='/' && nest==1 && 0==strcmp(ibuf,"/Length");
+    if (tok=='1') {
+      a=ibuf_int;
+      if (val_p) { currs.length=a; currs.lengthgen=-1; currs.length_p=TRUE; }
+      if (gettok_isref(&b)) { /* Dat: the referred hash is added by dd_finish() */
+        if (val_p) currs.lengthgen=b;
+        objentry(a,b);
+        dd_add_kid(a);
+        tok='R'; ibufb=ibuf;
+      } else ibufb=fmt_int(ibuf, a);
+    }
+    if (h!=NULL) { dd_update(h, &tok, 1); dd_update_int(h, ibufb-ibuf); dd_update(h, ibuf, ibufb-ibuf); }
+    switch (tok) {
+     case '[': case '<': nest++; break;
+     case ']': case '>': if (nest--==0) erri("too many array/dict closes in e_s",0); break;
+     default: ;
+    }
+    if (nest==0) break;
+  }
+}
+
+/** Hashes the tokens and the stream bytes of node v, and finds its kids.
+ * With page ranges, the kids are the ones r_enqueue_obj() will enqueue.
+ */
+static void dd_scan_obj(slen_t v) {
+  struct XrefEntry *e=xref_at(currs.ddnodes[v].xi);
+  struct PageSel const *ps;
+  struct DedupSha h;
+  slen_t lastofs, n, k, kidofs=currs.ddkidc;
+  pdfint_t streamlen;
+  char tok;
+  unsigned i;
+  lastofs=r_seek_objval(currs.ddnodes[v].xi);
+  if (curws.selc!=0) {
+    if (lastofs==currs.uppagesofs) {
+      for (k=0; k<curws.selc; k++) dd_add_kid(curws.selv[k].num);
+      currs.ddnodes[v].state='u'; goto done;
+    } else if (0!=(k=sn_get(&curws.selmark, currs.ddnodes[v].xi))) {
+      ps=curws.selv+k-1;
+      for (i=0; i<INH_KEYC; i++) if (ps->inhofs[i]!=0) { r_seek(ps->inhofs[i]); dd_scan_struct(NULL); }
+      currs.ddnodes[v].state='u';
+      r_seek(lastofs);
+    } else if (r_pagenode_p()) {
+      currs.ddnodes[v].state='u'; goto done;
+    }
+  }
+  dd_sha_init(&h);
+  dd_scan_struct(&h);
+  if (XE_TYPE(e)!='o') {
     if ('E'!=(tok=gettok())) erri("name expected after obj",0);
     if (0==strcmp(ibuf,"stream")) {
-      int i;
-      slen_t afterofs=ftell(currs.file);
-      r_seek(lastofs);
-      r_seek_dictval_must("/Length"); /* BUGFIX at Sun Mar  7 18:37:23 CET 2004 */
-      streamlen=gettok_int("dump");
-      if (streamlen<0) erri("negative stream length",0);
-      r_seek(afterofs);
-      if (!curws.lastclosed) putc('\n',curws.wf);
-      fprintf(curws.wf, "stream\n"); /* no "\r", to avoid confusion */
-      while (1) { /* Imp: why this while(1)? */
-        /* Dat: PDFRef.pdf subsection 3.2.7 says that "\r\n" mustn't follow `stream' -- but in the file PDFRef.pdf, it does */
-        if ((i=getc(currs.file))=='\r') {
-          i=getc(currs.file);
-          if (i!='\n' && i!=-1) r_seek(ftell(currs.file)-1);
-          break;
-        } else if (is_ps_white(i)) { break; }
-        else { r_seek(ftell(currs.file)-1); break; }
-      }
-      while (streamlen!=0) {
-        if (0==(afterofs=fread(ibuf, 1, streamlen>IBUFSIZE ? IBUFSIZE : streamlen, currs.file))) erri("stream too short",0);
-        fwrite(ibuf, 1, afterofs, curws.wf);
-        streamlen-=afterofs;
+      streamlen=r_stream_length(lastofs);
+      r_skip_stream_eol();
+      dd_update(&h, "S", 1); dd_update_int(&h, streamlen);
+      for (; streamlen!=0; streamlen-=n) {
+        n=streamlen+(slen_t)0<IBUFSIZE ? streamlen : IBUFSIZE;
+        if (n!=r_read(ibuf, n)) erri("stream too short",0);
+        dd_update(&h, ibuf, n);
       }
-      curws.lastclosed=TRUE; curws.colc=0;
       if ('E'!=gettok() || 0!=strcmp(ibuf,"endstream")) erri("endstream expected",0);
-      copy_token('E');
       tok=gettok();
     }
-    if ('E'!=tok || 0!=strcmp(ibuf,"endobj")) erri("endobj expected",0);
-    copy_token('E');
-    enq_first=e->next; /* this must be done as late as possible (afte ENQ_PUT()s) */
+    if ('E'!=tok || 0!=strcmp(ibuf,"endobj")) erri("endobj expected",0);
+  }
+  dd_sha_final(&h, currs.ddnodes[v].h);
+  currs.ddnodes[v].size=r_tell()-XE_OFS(e);
+  if (lastofs==currs.catalogofs || lastofs==currs.uppagesofs) currs.ddnodes[v].state='u';
+ done:
+  currs.ddnodes[v].kidofs=kidofs; currs.ddnodes[v].kidc=currs.ddkidc-kidofs;
+}
+
+/** Finishes the hash of the nodes in an SCC popped by dd_finish(). */
+static void dd_finish_node(struct DedupNode *nd, sbool cyclic_p) {
+  slen_t *k=currs.ddkids+nd->kidofs, *kend=k+nd->kidc;
+  struct DedupSha h;
+  dd_sha_init(&h);
+  if (cyclic_p) nd->state='u';
+  if (nd->state=='u') { /* Dat: its referrers mustn't be merged with other inputs */
+    dd_update(&h, "U", 1); dd_update_int(&h, currs.srci); dd_update_int(&h, nd->xi);
+  } else {
+    dd_update(&h, (char const*)nd->h, DD_HASHLEN);
+    for (; k!=kend; k++) dd_update(&h, (char const*)currs.ddnodes[*k].h, DD_HASHLEN);
+  }
+  dd_sha_final(&h, nd->h);
+}
+
+/** Adds the hashes of the referred objects to each hash, in reverse
+ * topological order, by Tarjan's SCC algorithm (iteratively, the graph can
+ * be deep). Objects in reference cycles become unique.
+ */
+static void dd_finish(void) {
+  struct DedupNode *nd=currs.ddnodes, *nv;
+  slen_t *sccs, *calls, sccc=0, callc=0, i, v, w, counter=0;
+  sbool cyclic_p;
+  if (NULL==(sccs=(slen_t*)malloc(2*currs.ddnodec*sizeof(sccs[0])+1))) errn("out of memory for dedup",0);
+  calls=sccs+currs.ddnodec;
+  for (i=0; i<currs.ddnodec; i++) {
+    if (nd[i].idx!=0) continue;
+    nd[i].idx=nd[i].low=++counter; nd[i].onstack=TRUE;
+    sccs[sccc++]=calls[callc++]=i;
+    while (callc!=0) {
+      nv=nd+(v=calls[callc-1]);
+      if (nv->pos!=nv->kidc) {
+        w=currs.ddkids[nv->kidofs+nv->pos++];
+        if (nd[w].idx==0) {
+          nd[w].idx=nd[w].low=++counter; nd[w].onstack=TRUE;
+          sccs[sccc++]=calls[callc++]=w;
+        } else if (nd[w].onstack && nd[w].idx<nv->low) nv->low=nd[w].idx;
+      } else {
+        if (--callc!=0 && nv->low<nd[calls[callc-1]].low) nd[calls[callc-1]].low=nv->low;
+        if (nv->low==nv->idx) { /* v is the root of an SCC */
+          cyclic_p=sccs[sccc-1]!=v;
+          for (w=nv->kidofs; w<nv->kidofs+nv->kidc; w++) cyclic_p|=currs.ddkids[w]==v;
+          do {
+            nd[w=sccs[--sccc]].onstack=FALSE;
+            dd_finish_node(nd+w, cyclic_p);
+          } while (w!=v);
+        }
+      }
+    }
+  }
+  free(sccs);
+}
+
+/** Finds the objects reachable from the trailer of currs, and computes their
+ * hashes for --dedup. The hash includes the tokens (so whitespace doesn't
+ * matter), the stream bytes and the hashes of the referred objects.
+ */
+static void dd_scan(void) {
+  slen_t v;
+  currs.ddnodec=currs.ddkidc=0;
+  r_seek(currs.trailer1ofs);
+  dd_scan_struct(NULL);
+  currs.ddkidc=0;
+  for (v=0; v<currs.ddnodec; v++) dd_scan_obj(v);
+  dd_finish();
+}
+
+/** Accounts the objects of currs not emitted, and frees the nodes. */
+static void dd_done(void) {
+  struct DedupNode *nd=currs.ddnodes, *ndend=nd+currs.ddnodec;
+  for (; nd!=ndend; nd++) {
+    if (nd->state==0) { curws.ddsavedc++; curws.ddsaved+=nd->size; }
+  }
+  free(currs.ddnodes); currs.ddnodes=NULL; currs.ddnodea=0;
+  free(currs.ddkids); currs.ddkids=NULL; currs.ddkida=0;
+  sn_free(&currs.ddnode);
+}
+
+/** @return the slot of hash h in the table: with the same hash or empty */
+static struct DedupSlot *dd_slot(unsigned char const *h) {
+  struct DedupSlot *sl, *old=curws.ddslots, *oldend=old+curws.ddslota;
+  slen_t i;
+  if (2*curws.ddslotc>=curws.ddslota) { /* grow and rehash */
+    curws.ddslota=curws.ddslota<1024 ? 1024 : 2*curws.ddslota;
+    if (NULL==(curws.ddslots=(struct DedupSlot*)calloc(curws.ddslota, sizeof(curws.ddslots[0])))) errn("out of memory for dedup",0);
+    for (sl=old; sl!=oldend; sl++) if (sl->num!=0) *dd_slot(sl->h)=*sl;
+    free(old);
+  }
+  for (i=(slen_t)h[0]|(slen_t)h[1]<<8|(slen_t)h[2]<<16|(slen_t)h[3]<<24; ; i++) {
+    sl=curws.ddslots+(i&(curws.ddslota-1));
+    if (sl->num==0 || 0==memcmp(sl->h, h, DD_HASHLEN)) return sl;
+  }
+}
+
+
+/** Appends input object num to the queue, reusing the consumed part of
+ * curws.queue before growing it.
+ */
+static void enq_put(slen_t num) {
+  if (curws.qc==curws.qa) {
+    if (curws.qhead!=0 && curws.qhead>=curws.qa/2) {
+      memmove(curws.queue, curws.queue+curws.qhead, (curws.qc-curws.qhead)*sizeof(curws.queue[0]));
+      curws.qc-=curws.qhead; curws.qpf-=curws.qpf<curws.qhead ? curws.qpf : curws.qhead; curws.qhead=0;
+    } else {
+      curws.qa=curws.qa<1024 ? 1024 : 2*curws.qa;
+      if (NULL==(curws.queue=(slen_t*)realloc(curws.queue, curws.qa*sizeof(curws.queue[0])))) errn("out of memory for queue",0);
+    }
+  }
+  curws.queue[curws.qc++]=num;
+}
+
+/** Assigns a target obj num to `a b R', and enqueues it if new.
+ * @return the target obj num
+ */
+static slen_t wr_enqueue_ref(pdfint_t a, pdfint_t b) {
+  struct DedupNode *nd=NULL;
+  struct DedupSlot *sl=NULL;
+  struct XrefEntry *e;
+  slen_t t, v;
+  if (curws.linnull!=0 && (a<=0 || (slen_t)0+a>=currs.xrefc || NULL==(e=xref_at(a))
+   || XE_TYPE(e)=='\0' || XE_TYPE(e)=='f')) return curws.linnull; /* Dat: left out by page ranges */
+  objentry(a,b);
+  t=sn_get(&curws.tnums, a);
+  #if DEBUG
+    fprintf(stderr,"XUT %ld (%ld %ld obj)\n", t, a, b);
+  #endif
+  if (t==0) {
+    if (0!=(v=sn_get(&currs.ddnode, a))) {
+      nd=currs.ddnodes+v-1;
+      if (nd->state!='u') {
+        if ((sl=dd_slot(nd->h))->num!=0) { sn_set(&curws.tnums, a, sl->num); return sl->num; }
+        nd->state='e';
+      }
+    }
+    sn_set(&curws.tnums, a, t=curws.outobjc++);
+    if (sl!=NULL) { memcpy(sl->h, nd->h, DD_HASHLEN); sl->num=t; curws.ddslotc++; }
+    if (curws.seg!=NULL && curws.dedup_p) { /* Dat: seg_stitch() merges with other inputs */
+      unsigned char hu[DD_HASHLEN+1]; /* Dat: the hash and whether unique */
+      if (nd!=NULL) memcpy(hu, nd->h, DD_HASHLEN); else memset(hu, '\0', DD_HASHLEN);
+      hu[DD_HASHLEN]=nd==NULL || nd->state=='u';
+      seg_put('H', t, nd!=NULL ? nd->size : 0);
+      fwrite(hu, 1, sizeof(hu), curws.seg);
+    }
+    #if DEBUG
+      fprintf(stderr, "PUT\n");
+    #endif
+    enq_put(a);
+  }
+  return t;
+}
+
+/** Skips a whole recursive structure starting with `tok'. Works with `R'.
+ * Sets currs.length_p etc, so the stream after a dict needn't be re-read
+ * for its /Length, see r_stream_length(). With curws.verbatim_p, only the
+ * references are copied as tokens, the bytes between them as is.
+ */
+static void wr_enqueue_struct(sbool copy_p) {
+  char tok;
+  slen_t nest=0, t, spanofs=0, aofs;
+  pdfint_t a, b;
+  sbool key_p=FALSE, val_p; /* after the /Length key of the top dict */
+  sbool span_p=copy_p && curws.verbatim_p;
+  currs.length_p=FALSE;
+  if (span_p) { spanofs=r_tell(); copy_p=FALSE; }
+  while (1) {
+    if (0==(tok=gettok())) erri("eof in e_s", 0);
+    val_p=key_p && !currs.length_p;
+    key_p=tok=='/' && nest==1 && 0==strcmp(ibuf,"/Length");
+    #if DEBUG
+      ibufb[0]='\n'; ibufb[1]='\0'; fputs(ibuf,stderr);
+    #endif
+    if (copy_p && tok!='1') copy_token(tok);
+    switch (tok) {
+     case '1': /* Skip a possible `R' */
+      a=ibuf_int; aofs=currs.tokofs; /* Dat: the end of the previous token */
+      if (gettok_isref(&b)) {
+        t=wr_enqueue_ref(a,b);
+        if (span_p) { r_copy_span(spanofs, aofs); spanofs=r_tell(); w_ref(t); }
+        if (copy_p) w_ref(t);
+        if (val_p) { currs.length=a; currs.lengthgen=b; currs.length_p=TRUE; }
+      } else {
+        if (val_p) { currs.length=a; currs.lengthgen=-1; currs.length_p=TRUE; }
+        if (copy_p) {
+          ibufb=fmt_int(ibuf, a);
+          copy_token('1');
+        }
+      }
+      break;
+     case '[': case '<': /* Imp: treat dicts and arrays differently, create nest stack */
+      nest++;
+      break;
+     case ']': case '>':
+      if (nest--==0) erri("too many array/dict closes in e_s",0);
+      break;
+     default: ;
+    }
+    if (nest==0) break;
+  }
+  if (span_p) r_copy_span(spanofs, r_tell());
+}
+
+static void w_dump_start(void) {
+  char header[sizeof(currs.pdf_header)]; /* Dat: currs may be cached, don't change it */
+  memcpy(header, currs.pdf_header, sizeof(header));
+  curws.is_binary=currs.is_binary; /* Imp: pre-look other inputs */
+  if (curws.objstm_p) { /* Dat: object and xref streams need PDF 1.5 and binary */
+    if (0>memcmp(header, "%PDF-1.5", 8)) memcpy(header, "%PDF-1.5", 8);
+    curws.is_binary=TRUE;
+  }
+  w_puts(header);
+  if (curws.is_binary) w_puts("%\xE1\xE9\xF3\xFA\n");
+  curws.txrefc=0; /* Dat: txrefs is kept for the next job */
+  curws.lastclosed=TRUE;
+}
+
+static void w_xref_aset(slen_t num, slen_t ofs) {
+  if (num>=curws.txrefa) {
+    #ifdef __CHECKER__Z
+      slen_t oa=curws.txrefa;
+    #endif
+    if (curws.txrefa<16) curws.txrefa=16;
+    while (curws.txrefa<=num) curws.txrefa<<=1;
+    if (NULL==(curws.txrefs=(slen_t*)realloc(curws.txrefs, curws.txrefa*sizeof(curws.txrefs[0])))) errn("out of memory for xref_aset",0);
+    if (curws.objstm_p && NULL==(curws.txrefstm=(slen_t*)realloc(curws.txrefstm, curws.txrefa*sizeof(curws.txrefstm[0])))) errn("out of memory for xref_aset",0);
+    #ifdef __CHECKER__Z
+      memset(curws.txrefs+oa, '\0'
+    #endif
+  }
+  if (num>=curws.txrefc) {
+    memset(curws.txrefs+curws.txrefc, '\0', sizeof(curws.txrefs[0])*(num-curws.txrefc));
+    if (curws.objstm_p) memset(curws.txrefstm+curws.txrefc, '\0', sizeof(curws.txrefstm[0])*(num+1-curws.txrefc));
+    curws.txrefc=num+1;
+  }
+  curws.txrefs[num]=ofs;
+}
+
+/* --- Object streams */
+
+/** Records that object num is the idx-th one in object stream k (from 0). */
+static void w_xref_cset(slen_t num, slen_t k, slen_t idx) {
+  w_xref_aset(num, idx);
+  curws.txrefstm[num]=k+1;
+}
+
+#if USE_FORK
+/** Starts the compressor process, which deflates the object streams sent
+ * by w_objstm_flush() to curws.zpipe while the main process goes on with
+ * the output. Leaves curws.zpipe==NULL if it can't.
+ */
+static void w_zworker_start(void) {
+  int fds[2];
+  pid_t pid;
+  slen_t h[3];
+  char *data=NULL;
+  fflush(NULL); /* Dat: the compressor mustn't inherit unflushed output */
+  if (0!=pipe(fds)) return;
+  if ((pid=fork())<0) { close(fds[0]); close(fds[1]); return; }
+  if (pid==0) { /* compressor process */
+    FILE *rf=fdopen(fds[0], "rb");
+    cur_ctx->worker_p=TRUE;
+    close(fds[1]);
+    if (rf==NULL) _exit(5);
+    /* Dat: records are {n, first, len} and the uncompressed data */
+    while (3==fread(h, sizeof(h[0]), 3, rf)) {
+      if (NULL==(data=(char*)realloc(data, h[2]+1))) _exit(5);
+      if (h[2]!=fread(data, 1, h[2], rf)) _exit(5);
+      z_deflate((unsigned char const*)data, h[2]);
+      h[2]=zd.outlen;
+      fwrite(h, sizeof(h[0]), 3, curws.zf);
+      fwrite(zd.out, 1, zd.outlen, curws.zf);
+    }
+    _exit(0!=fflush(curws.zf) || ferror(curws.zf) || ferror(rf) ? 5 : 0);
+  }
+  close(fds[0]);
+  if (NULL==(curws.zpipe=fdopen(fds[1], "wb"))) errn("fdopen: ", strerror(errno));
+  curws.zpid=pid;
+}
+#endif
+
+/** Turns curws.stmbuf into a compressed object stream in curws.zf. Its
+ * object number is assigned later, by w_dump_objstms().
+ */
+static void w_objstm_flush(void) {
+  slen_t i, k, h[3];
+  char *p;
+  if (curws.stmc==0) return;
+  k=curws.objstmc++;
+  curws.objbuf.len=0; /* Dat: free now, used for the pairs of integers */
+  for (i=0; i<curws.stmc; i++) {
+    w_xref_cset(curws.stmobjs[2*i], k, i);
+    ibufb=fmt_int(ibuf, curws.stmobjs[2*i]); *ibufb++=' ';
+    ibufb=fmt_int(ibufb, curws.stmobjs[2*i+1]); *ibufb++=i%10==9 ? '\n' : ' ';
+    wbuf_write(&curws.objbuf, ibuf, ibufb-ibuf);
+  }
+  h[0]=curws.stmc; h[1]=curws.objbuf.len; h[2]=h[1]+curws.stmbuf.len;
+  wbuf_reserve(&curws.stmbuf, h[1]);
+  p=curws.stmbuf.p;
+  memmove(p+h[1], p, curws.stmbuf.len);
+  memcpy(p, curws.objbuf.p, h[1]);
+  curws.stmc=0; curws.stmbuf.len=0;
+  if (curws.zf==NULL && NULL==(curws.zf=tmpfile())) errn("tmpfile: ", strerror(errno));
+#if USE_FORK
+  if (curws.zpipe==NULL && curws.zpid==0) { curws.zpid=-1; w_zworker_start(); }
+  if (curws.zpipe!=NULL) {
+    fwrite(h, sizeof(h[0]), 3, curws.zpipe);
+    fwrite(p, 1, h[2], curws.zpipe);
+    return;
+  }
+#endif
+  z_deflate((unsigned char const*)p, h[2]);
+  h[2]=zd.outlen;
+  fwrite(h, sizeof(h[0]), 3, curws.zf);
+  fwrite(zd.out, 1, zd.outlen, curws.zf);
+}
+
+/** Moves the object in curws.objbuf to the object stream being built. */
+static void w_objstm_add(void) {
+  curws.membuf=NULL;
+  curws.stmobjs[2*curws.stmc]=curws.objnum;
+  curws.stmobjs[2*curws.stmc+1]=curws.stmbuf.len;
+  curws.stmc++;
+  wbuf_write(&curws.stmbuf, curws.objbuf.p, curws.objbuf.len);
+  wbuf_putc(&curws.stmbuf, '\n');
+  if (curws.stmc==OBJSTM_MAXOBJS || curws.stmbuf.len>=OBJSTM_MAXSIZE) w_objstm_flush();
+  curws.lastclosed=TRUE; curws.colc=0;
+}
+
+/** Writes the object streams collected in curws.zf to the output, numbered
+ * after all other objects. Dat: numbering them here keeps the output of
+ * `-j' byte-identical.
+ */
+static void w_dump_objstms(void) {
+  slen_t k, h[3], n;
+  w_objstm_flush();
+#if USE_FORK
+  if (curws.zpipe!=NULL) {
+    int status=fclose(curws.zpipe);
+    curws.zpipe=NULL;
+    if (status!=0) errn("error writing to compressor: ", strerror(errno));
+    while (waitpid(curws.zpid, &status, 0)<0) {
+      if (errno!=EINTR) errn("waitpid: ", strerror(errno));
+    }
+    curws.zpid=-1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status)!=0) errn("compressor process failed",0);
+  }
+#endif
+  curws.objstmbase=curws.outobjc; curws.outobjc+=curws.objstmc;
+  if (curws.zf==NULL) return;
+  rewind(curws.zf);
+  for (k=0; k<curws.objstmc; k++) {
+    if (3!=fread(h, sizeof(h[0]), 3, curws.zf)) errn("truncated object streams",0);
+    w_obj_header(curws.objstmbase+k);
+    sprintf(ibuf, "<</Type/ObjStm/N %" SLEN_P"u/First %" SLEN_P"u/Filter/FlateDecode/Length %" SLEN_P"u>>stream\n", h[0], h[1], h[2]);
+    w_puts(ibuf);
+    for (; h[2]!=0; h[2]-=n) {
+      n=h[2]<IBUFSIZE ? h[2] : IBUFSIZE;
+      if (n!=fread(ibuf, 1, n, curws.zf)) errn("truncated object streams",0);
+      w_write(ibuf, n);
+    }
+    w_puts("\nendstream\nendobj\n");
+  }
+  fclose(curws.zf); curws.zf=NULL;
+  curws.lastclosed=TRUE; curws.colc=0;
+}
+
+#define W_XREF_USED(i) (curws.txrefs[i]!=0 || (curws.txrefstm!=NULL && curws.txrefstm[i]!=0))
+
+/** Finds the next subsection of the output xref from *ip on: sets *ip to
+ * its first object number. Without --append, there is a single subsection
+ * from 0, with the unused numbers free; with --append, only the objects
+ * written are in subsections.
+ * @return the end of the subsection, or 0 if there are no more
+ */
+static slen_t w_xref_run(slen_t *ip) {
+  slen_t i=*ip;
+  if (!curws.append_p) return i==0 ? curws.txrefc : 0;
+  while (i<curws.txrefc && !W_XREF_USED(i)) i++;
+  if (i==curws.txrefc) return 0;
+  *ip=i;
+  while (i<curws.txrefc && W_XREF_USED(i)) i++;
+  return i;
+}
+
+/** Writes the xref stream, with the keys of curws.trailer, instead of the
+ * xref table and the trailer. Dat: /W[1 n 2], PNG Up predictor.
+ */
+static void w_dump_xref_stream(void) {
+  slen_t num, i, j, k, v, wofs, rowlen, maxv, end, rowc;
+  unsigned char *data, *q;
+  if (!curws.lastclosed) W_PUTC('\n');
+  curws.startxrefofs=curws.ofs;
+  num=curws.outobjc++;
+  w_xref_aset(num, curws.ofs);
+  maxv=curws.startxrefofs>curws.outobjc ? curws.startxrefofs : curws.outobjc;
+  for (wofs=1; wofs<sizeof(slen_t) && (maxv>>(8*wofs))!=0; wofs++) {}
+  rowlen=1+wofs+2;
+  if (NULL==(cur_ctx->tmp=data=(unsigned char*)malloc(curws.txrefc*(rowlen+1)))) errn("out of memory for xref stream",0);
+  for (q=data, i=0; 0!=(end=w_xref_run(&i)); ) {
+    for (; i<end; i++) {
+      *q++=2; /* PNG Up */
+      if (curws.txrefstm[i]!=0) { *q++=2; v=curws.objstmbase+curws.txrefstm[i]-1; j=curws.txrefs[i]; }
+      else if (curws.txrefs[i]!=0) { *q++=1; v=curws.txrefs[i]; j=0; }
+      else { *q++=0; v=0; j=65535; }
+      for (k=wofs; k--!=0; v>>=8) q[k]=(unsigned char)v;
+      q+=wofs; *q++=(unsigned char)(j>>8); *q++=(unsigned char)j;
+    }
+  }
+  rowc=(q-data)/(rowlen+1);
+  for (q--; q>=data+rowlen+1; q--) { /* Dat: backwards, to use the raw row above */
+    if ((q-data)%(rowlen+1)!=0) *q-=q[-(slendiff_t)(rowlen+1)];
+  }
+  z_deflate(data, rowc*(rowlen+1));
+  free(data); cur_ctx->tmp=NULL;
+  w_obj_header(num);
+  sprintf(ibuf, "<</Type/XRef/Size %" SLEN_P"u/W[1 %" SLEN_P"u 2]", curws.txrefc, wofs);
+  w_puts(ibuf);
+  if (curws.append_p) {
+    w_puts("/Index[");
+    for (i=0, k=0; 0!=(end=w_xref_run(&i)); i=end, k=1) {
+      sprintf(ibuf, " %" SLEN_P"u %" SLEN_P"u"+(k==0), i, end-i);
+      w_puts(ibuf);
+    }
+    w_puts("]");
+  }
+  w_write(curws.trailer.p+curws.trailerkeys, curws.trailer.len-curws.trailerkeys);
+  sprintf(ibuf, "/Filter/FlateDecode/DecodeParms<</Columns %" SLEN_P"u/Predictor 12>>/Length %" SLEN_P"u>>stream\n", rowlen, zd.outlen);
+  w_puts(ibuf);
+  w_write((char const*)zd.out, zd.outlen);
+  sprintf(ibuf, "\nendstream\nendobj\nstartxref\n%" SLEN_P"u\n%%%%EOF\n", curws.startxrefofs);
+  w_puts(ibuf);
+  w_flush();
+  curws.lastclosed=TRUE; curws.colc=0;
+}
+
+/** Writes the xref table entries of objects [a,b). */
+static void w_xref_entries(slen_t a, slen_t b) {
+  slen_t const *p, *pend;
+  memcpy(ibuf, "0000000000 00000 n \n", 20);
+  for (p=curws.txrefs+a, pend=curws.txrefs+b; p!=pend; ) {
+    if (*p!=0) {
+      if (*p/1000000U>=10000U) errn("offset overflow in xref table, use --objstm",0); /* Dat: works with 32 bit arithmetic */
+      fmt_010(ibuf, *p++);
+      w_write(ibuf, 20);
+    } else { w_write("0000000000 65535 f \n", 20); p++; }
+  }
+}
+
+static void w_dump_xref(void) {
+  slen_t i, end;
+  if (!curws.lastclosed) W_PUTC('\n');
+  curws.startxrefofs=curws.ofs;
+  w_puts("xref\n");
+  for (i=0; 0!=(end=w_xref_run(&i)); i=end) {
+    sprintf(ibuf, "%" SLEN_P"u %" SLEN_P"u\n", i, end-i); /* Dat: must be "\n" */
+    w_puts(ibuf);
+    w_xref_entries(i, end);
+  }
+  curws.lastclosed=TRUE; curws.colc=0;
+}
+
+/** Plans a balanced tree of intermediate /Pages nodes with at most
+ * curws.fanout kids each, with the root /Pages of the inputs as leaves,
+ * and reserves their object numbers from curws.outobjc on. Without it,
+ * the top /Pages of thousands of inputs would have a huge /Kids array,
+ * scanned linearly by viewers.
+ */
+static void w_pagetree_plan(void) {
+  slen_t c=curws.srcpages_numc;
+  unsigned l;
+  curws.ptlevelc=0; curws.ptsizes[0]=c;
+  while (c>curws.fanout) curws.ptsizes[++curws.ptlevelc]=c=(c+curws.fanout-1)/curws.fanout;
+  curws.ptbase=curws.outobjc;
+  for (l=1; l<=curws.ptlevelc; l++) curws.outobjc+=curws.ptsizes[l];
+}
+
+/** @return the object number of node j at level l>=1 of the page tree */
+static slen_t w_pagetree_num(unsigned l, slen_t j) {
+  slen_t num=curws.ptbase+j;
+  while (l<curws.ptlevelc) num+=curws.ptsizes[++l];
+  return num;
+}
+
+/** @return the object number of the parent of node j at level l of the
+ * page tree (level 0: the root /Pages of input j). The c nodes of a level
+ * are split among the g nodes above in contiguous runs of c/g or c/g+1.
+ */
+static slen_t w_pagetree_parent(unsigned l, slen_t j) {
+  slen_t c=curws.ptsizes[l], g;
+  if (l==curws.ptlevelc) return curws.toppages_num;
+  g=curws.ptsizes[l+1];
+  return w_pagetree_num(l+1, ((j+1)*g-1)/c);
+}
+
+static void wr_enqueue_catalog(sbool copy_p) {
+  char tok;
+  if (gettok()!='<') erri("catalog dict expected",0);
+  if (copy_p) copy_token('<');
+  while (1) {
+    tok=gettok();
+    if (copy_p) copy_token(tok);
+    if ('>'==tok) break;
+    if ('/'!=tok) erri("catalog dict key expected",0);
+    if (0==strcmp(ibuf,"/Pages")) { /* must be an indirect reference */
+      pdfint_t a, b;
+      if ('1'==gettok() && (a=ibuf_int, TRUE) && gettok_isref(&b)
+         ) {} else { erri("/Pages of /Catalog must be indirect", 0); return; }
+      curws.lastsrcpages_num=wr_enqueue_ref(a,b);
+      if (!copy_p) continue;
+      sprintf(ibuf, "%" SLEN_P"u 0 R", curws.toppages_num); ibufb=ibuf+strlen(ibuf);
+      copy_token('1');
+    } else {
+      wr_enqueue_struct(copy_p);
+    }
+  }
+}
+
+static void wr_enqueue_uppages(sbool copy_p) {
+  char tok;
+  slen_t i, t;
+  if (curws.selc!=0) { /* Dat: a new node, with the selected pages as its kids */
+    skipstruct(gettok(), FALSE);
+    if (copy_p) {
+      sprintf(ibuf, "<</Type/Pages/Parent %" SLEN_P"u 0 R/Count %" SLEN_P"u/Kids[", w_pagetree_parent(0, currs.srci), curws.selc);
+      ibufb=ibuf+strlen(ibuf); copy_token('[');
+    }
+    for (i=0; i<curws.selc; i++) {
+      t=wr_enqueue_ref(curws.selv[i].num, curws.selv[i].gennum);
+      if (copy_p) w_ref(t);
+    }
+    if (copy_p) { memcpy(ibuf, "]>>", 4); ibufb=ibuf+3; copy_token(']'); }
+    return;
+  }
+  if (gettok()!='<') erri("uppages dict expected",0);
+  if (copy_p) {
+    copy_token('<');
+    sprintf(ibuf,"/Parent"); ibufb=ibuf+strlen(ibuf); copy_token('/');
+    sprintf(ibuf,"%" SLEN_P"u 0 R", w_pagetree_parent(0, currs.srci)); ibufb=ibuf+strlen(ibuf); copy_token('1');
+  }
+  while (1) {
+    tok=gettok();
+    if (copy_p) copy_token(tok);
+    if ('>'==tok) break;
+    if ('/'!=tok) erri("uppages dict key expected",0);
+    if (0==strcmp(ibuf,"/Parent")) { /* must be an indirect reference */
+      /* Dat: top /Pages doesn't have /Parent, but ensure */
+      skipstruct(gettok(), FALSE);
+    } else {
+      wr_enqueue_struct(copy_p);
+    }
+  }
+}
+
+/** Copies the selected page dict ps, with /Parent pointing to the root
+ * /Pages and the attributes inherited from the skipped ancestors added.
+ */
+static void wr_enqueue_page(sbool copy_p, struct PageSel const *ps) {
+  char tok;
+  unsigned i;
+  slen_t afterofs;
+  if (gettok()!='<') erri("page dict expected",0);
+  if (copy_p) {
+    copy_token('<');
+    memcpy(ibuf, "/Parent", 8); ibufb=ibuf+7; copy_token('/');
+    w_ref(curws.lastsrcpages_num);
+  }
+  while ('>'!=(tok=gettok())) {
+    if ('/'!=tok) erri("page dict key expected",0);
+    if (0==strcmp(ibuf,"/Parent")) { skipstruct(gettok(), FALSE); continue; }
+    if (copy_p) copy_token(tok);
+    wr_enqueue_struct(copy_p);
+  }
+  afterofs=r_tell();
+  for (i=0; i<INH_KEYC; i++) if (ps->inhofs[i]!=0) {
+    if (copy_p) { strcpy(ibuf, inh_keys[i]); ibufb=ibuf+strlen(ibuf); copy_token('/'); }
+    r_seek(ps->inhofs[i]);
+    wr_enqueue_struct(copy_p);
+  }
+  r_seek(afterofs);
+  if (copy_p) { memcpy(ibuf, ">>", 3); ibufb=ibuf+2; copy_token('>'); }
+}
+
+/** Reads the `N G obj' of input object num (if any) and its value,
+ * enqueueing the objects it refers to, and copying it to curws if copy_p.
+ * @return the offset of the value
+ */
+static slen_t r_enqueue_obj(slen_t num, sbool copy_p) {
+  slen_t lastofs=r_seek_objval(num), k;
+  #if DEBUG
+    fprintf(stderr, "CMP %ld %ld\n", lastofs, currs.catalogofs);
+  #endif
+       if (lastofs==currs.catalogofs) { wr_enqueue_catalog(copy_p); currs.length_p=FALSE; }
+  else if (lastofs==currs.uppagesofs) { wr_enqueue_uppages(copy_p); currs.length_p=FALSE; }
+  else if (curws.selc!=0 && 0!=(k=sn_get(&curws.selmark, num))) { wr_enqueue_page(copy_p, curws.selv+k-1); currs.length_p=FALSE; }
+                                 else wr_enqueue_struct(copy_p);
+  return lastofs;
+}
+
+/** @return whether input object num is a page tree node left out by the
+ * page ranges: it isn't copied, the references to it become null.
+ */
+static sbool r_unselected_p(slen_t num) {
+  slen_t lastofs;
+  if (curws.selc==0 || 0!=sn_get(&curws.selmark, num)) return FALSE;
+  lastofs=r_seek_objval(num);
+  return lastofs!=currs.uppagesofs && r_pagenode_p();
+}
+
+/** Dumps the input object num (read by r_enqueue_obj()) to curws.
+ * @return the number of stream bytes copied verbatim
+ */
+static slen_t r_dump_obj(slen_t num) {
+  struct XrefEntry *e=xref_at(num);
+  pdfint_t streamlen=0;
+  slen_t lastofs;
+  char tok;
+  #if DEBUG
+    fprintf(stderr,"dumping_src=(%" SLEN_P"u)\n", num);
+  #endif
+  #if 0
+    fprintf(stderr, "%" SLEN_P"u 0 obj # from %lu\n", sn_get(&curws.tnums, num), XE_OFS(e));
+  #endif
+  w_obj_begin(sn_get(&curws.tnums, num));
+  lastofs=r_enqueue_obj(num, TRUE);
+  if (XE_TYPE(e)=='o') { /* Dat: the object ends here, it can't be a stream */
+    tok='E'; memcpy(ibuf, "endobj", 7); ibufb=ibuf+6;
+  } else if ('E'!=(tok=gettok())) erri("name expected after obj",0);
+  if (0==strcmp(ibuf,"stream")) {
+    streamlen=r_stream_length(lastofs);
+    r_skip_stream_eol();
+    w_stream(streamlen);
+    if ('E'!=gettok() || 0!=strcmp(ibuf,"endstream")) erri("endstream expected",0);
+    copy_token('E');
+    tok=gettok();
+  }
+  if ('E'!=tok || 0!=strcmp(ibuf,"endobj")) erri("endobj expected",0);
+  w_obj_end();
+  return streamlen;
+}
+
+/** With curws.seq_p: bytes to read ahead, and their alignment */
+#define SEQ_WINDOW ((slen_t)4<<20)
+#define SEQ_ALIGN 65536
+
+/** Compares input object numbers by offset, for qsort() */
+static int cmp_xref_ofs(void const *a, void const *b) {
+  struct XrefEntry const *ea=xref_at(*(slen_t const*)a), *eb=xref_at(*(slen_t const*)b);
+  slen_t x=XE_OFS(ea), y=XE_OFS(eb);
+  return x<y ? -1 : x>y;
+}
+
+/** Hints the OS to read input bytes [ofs,ofs+len) soon, see curws.seq_p. */
+static void r_willneed(slen_t ofs, slen_t len) {
+#if USE_MMAP
+  slen_t a;
+  if (ofs>=currs.filesize) return; /* Dat: decoded object streams are in memory */
+  if (len>currs.filesize-ofs) len=currs.filesize-ofs;
+  if (currs.map!=NULL) {
+    a=ofs&~(slen_t)(SEQ_ALIGN-1); /* Dat: a multiple of the page size */
+    posix_madvise((char*)currs.map+a, len+(ofs-a), POSIX_MADV_WILLNEED);
+  }
+#  ifdef POSIX_FADV_WILLNEED
+  else posix_fadvise(fileno(currs.file), (off_t)ofs, (off_t)len, POSIX_FADV_WILLNEED);
+#  endif
+#else
+  (void)ofs; (void)len;
+#endif
+}
+
+#if USE_IO_URING
+/** With currs.uring_p: starts reading the blocks of the objects in
+ * curws.queue[qi...qi+UR_DEPTH) ahead (as one batch), so they are cached
+ * when r_dump_obj() gets there. See curws.qpf.
+ */
+static void ur_prefetch(slen_t qi) {
+  struct XrefEntry *e;
+  if (curws.qpf<qi) curws.qpf=qi;
+  for (; curws.qpf<curws.qc && curws.qpf<qi+UR_DEPTH && urs.inflight<UR_DEPTH; curws.qpf++) {
+    if (NULL==(e=xref_at(curws.queue[curws.qpf]))) continue;
+    if (XE_TYPE(e)=='c' && NULL==(e=xref_at(XE_OFS(e)))) continue; /* Dat: read its object stream */
+    if (XE_TYPE(e)=='n') ur_readahead(XE_OFS(e)/UR_BLOCK);
+  }
+  ur_enter(0);
+}
+#endif
+
+/** Reads all objs reachable from currs, and dumps them to curws: in the
+ * order they are reached (BFS), or with curws.seq_p, in input offset order
+ * after reading all their dicts once (the object numbers are the same).
+ */
+static void r_dump_reachable(void) {
+  struct XrefEntry *e;
+  slen_t reached=0, verbatim=0, spanned=0, merged0=curws.ddsavedc, i, j, num, ofs, adv=0;
+  curws.selc=0; sn_free(&curws.selmark);
+  if (curws.pagesels!=NULL && curws.pagesels[currs.srci]!=NULL) r_select_pages(curws.pagesels[currs.srci]);
+  if (curws.dedup_p) dd_scan();
+  curws.qhead=curws.qc=curws.qpf=0;
+  r_seek(currs.trailer1ofs);
+  wr_enqueue_struct(FALSE);
+  if (curws.seq_p) { /* Dat: qhead stays 0, so the queue keeps all objects */
+    for (i=j=0; i<curws.qc; i++) { /* Dat: enq_put()s append */
+#if USE_IO_URING
+      if (currs.uring_p) ur_prefetch(i);
+#endif
+      if (r_unselected_p(num=curws.queue[i])) continue;
+      r_enqueue_obj(num, FALSE);
+      curws.queue[j++]=num;
+    }
+    curws.qc=j;
+    qsort(curws.queue, curws.qc, sizeof(curws.queue[0]), cmp_xref_ofs);
+    curws.qpf=0;
+    for (i=0; i<curws.qc; i++) {
+#if USE_IO_URING
+      if (currs.uring_p) ur_prefetch(i);
+#endif
+      e=xref_at(num=curws.queue[i]); ofs=XE_OFS(e); /* Dat: r_enqueue_obj() has loaded its object stream */
+      if (ofs+SEQ_WINDOW/2>=adv) { adv=ofs+SEQ_WINDOW; r_willneed(ofs, SEQ_WINDOW); }
+      verbatim+=r_dump_obj(num);
+      reached++; spanned+=r_tell()-ofs;
+    }
+    curws.qc=curws.qpf=0;
+  }
+  while (curws.qhead!=curws.qc) {
+#if USE_IO_URING
+    if (currs.uring_p) ur_prefetch(curws.qhead);
+#endif
+    num=curws.queue[curws.qhead++];
+    if (r_unselected_p(num)) continue;
+    verbatim+=r_dump_obj(num);
+    reached++; spanned+=r_tell()-XE_OFS(xref_at(num)); /* Dat: type 'o' after r_load_objstm() */
+  }
+  if (curws.dedup_p) dd_done();
+  if (curws.stats_p) {
+    struct Stats *st=curws.stats+currs.srci;
+    slen_t used=0;
+    for (i=0; i<currs.xrefc; i++) {
+      if (NULL==(e=xref_at(i))) i|=SPARSE_PAGE-1; /* Dat: skip the empty page */
+      else used+=XE_TYPE(e)!='\0' && XE_TYPE(e)!='f';
+    }
+    st->bytes_verbatim+=verbatim; st->bytes_tokenized+=spanned-verbatim;
+    reached+=curws.ddsavedc-merged0; /* Dat: reached, but merged by --dedup */
+    st->objs_reached+=reached; st->objs_skipped+=used>reached ? used-reached : 0;
+  }
+  #if DEBUG
+    fprintf(stderr, "seeks=%" SLEN_P"u\n", currs.seekc);
+  #endif
+}
+
+/** Builds the (renumbered) trailer dict of the first input in curws.trailer,
+ * without writing to the output, because it must come last.
+ */
+static void w_make_trailer(void) {
+  static char const* const xref_keys[]={"/Prev", "/Size", "/XRefStm",
+    "/Type", "/W", "/Index", "/Filter", "/DecodeParms", "/Length", NULL};
+  char const* const* kp;
+  char tok;
+  r_seek(currs.trailer1ofs); /* Dat: may be the dict of an xref stream */
+  newline();
+  curws.membuf=&curws.trailer; curws.trailer.len=0;
+  memcpy(ibuf, "trailer", 8); ibufb=ibuf+7;
+  copy_token('E'); newline();
+  if (gettok()!='<') erri("trailer dict expected",0);
+  copy_token('<');
+  curws.trailerkeys=curws.trailer.len;
+  while (1) {
+    if ('>'==(tok=gettok())) break;
+    if ('/'!=tok) erri("trailer dict key expected",0);
+    /* Dat: first trailer usually has: /Size /Info /Root /Prev /ID */
+    /* Dat: prev trailers usually have: /Size /ID -- will be ignored */
+    /* Dat: thus our merged trailer will have many /ID fields -- but we don't merge prev trailers */
+    #if DEBUG
+      fprintf(stderr,"trailer_key=(%s)\n",ibuf);
+    #endif
+    for (kp=xref_keys; *kp!=NULL && 0!=strcmp(ibuf,*kp); kp++) {}
+    if (*kp!=NULL) { /* Dat: describes the input xref section */
+      skipstruct(gettok(), FALSE);
+    } else if (curws.append_p) { /* Dat: the old objects keep their numbers */
+      copy_token(tok);
+      skipstruct(gettok(), TRUE);
+    } else {
+      copy_token(tok);
+      wr_enqueue_struct(TRUE); /* renumbering */
+    }
+  }
+  if (curws.append_p) {
+    memcpy(ibuf, "/Prev", 6); ibufb=ibuf+5; copy_token('/');
+    ibufb=fmt_int(ibuf, curws.prevxrefofs); copy_token('1');
+  }
+  curws.membuf=NULL;
+  curws.lastclosed=TRUE; curws.colc=0;
+}
+
+static void w_dump_trailer(void) {
+  newline();
+  w_write(curws.trailer.p, curws.trailer.len);
+  sprintf(ibuf, "/Size %" SLEN_P"u>>\nstartxref\n%" SLEN_P"u\n%%%%EOF\n", curws.txrefc, curws.startxrefofs); /* Dat: must end by "%%EOF\n" */
+  w_puts(ibuf);
+  w_flush();
+  curws.lastclosed=TRUE; curws.colc=0;
+}
+
+/** Writes the kids [a,b) of level l of the page tree as `N 0 R's. */
+static void w_pagetree_kids(unsigned l, slen_t a, slen_t b) {
+  for (; a!=b; a++) {
+    sprintf(ibuf, "%" SLEN_P"u", l==0 ? curws.srcpages_nums[a] : w_pagetree_num(l, a));
+    ibufb=ibuf+strlen(ibuf); copy_token('1');
+    ibuf[0]='0'; ibuf[1]='\0'; ibufb=ibuf+1; copy_token('1');
+    ibuf[0]='R'; ibuf[1]='\0'; ibufb=ibuf+1; copy_token('R');
+  }
+}
+
+/** Writes the top /Pages, and the intermediate /Pages nodes planned by
+ * w_pagetree_plan(), with their /Count summed from the page counts of the
+ * inputs.
+ */
+static void w_dump_toppages(void) {
+  /* Dat: we must say `1 0 obj' for (data flow to) /Parent of /Pages */
+  slen_t *counts, *cl, *cp, c, g, j, a, b;
+  unsigned l;
+  newline();
+  w_obj_begin(curws.toppages_num);
+  if (curws.append_p) {
+    w_write(curws.toppages.p, curws.toppages.len);
+    curws.lastclosed=TRUE; curws.colc=0;
+  } else {
+    sprintf(ibuf, "<</Type/Pages/Count %" SLEN_P"u/Kids[", curws.pagetotal);
+    ibufb=ibuf+strlen(ibuf); copy_token('[');
+  }
+  w_pagetree_kids(curws.ptlevelc, 0, curws.ptsizes[curws.ptlevelc]);
+  if (curws.append_p) sprintf(ibuf, "]/Count %" SLEN_P"u>>", curws.pagetotal);
+                else sprintf(ibuf, "]>>");
+  ibufb=ibuf+strlen(ibuf); copy_token(']');
+  w_obj_end();
+  if (curws.ptlevelc==0) return;
+  /* Dat: counts of level l are at counts+sum(ptsizes[0..l)) */
+  for (c=0, l=0; l<=curws.ptlevelc; l++) c+=curws.ptsizes[l];
+  if (NULL==(cur_ctx->tmp=counts=(slen_t*)malloc(c*sizeof(counts[0])))) errn("out of memory for page tree",0);
+  memcpy(counts, curws.srcpages_nums+curws.srcpages_numc, curws.srcpages_numc*sizeof(counts[0]));
+  for (cl=counts, l=1; l<=curws.ptlevelc; cl+=c, l++) {
+    c=curws.ptsizes[l-1]; g=curws.ptsizes[l];
+    for (cp=cl+c, j=0; j<g; j++) {
+      for (cp[j]=0, a=j*c/g, b=(j+1)*c/g; a<b; a++) cp[j]+=cl[a];
+    }
+  }
+  for (l=curws.ptlevelc; l>=1; l--) {
+    c=curws.ptsizes[l-1]; g=curws.ptsizes[l]; cl-=c; /* Dat: level l is at cl+c */
+    for (j=0; j<g; j++) {
+      newline();
+      w_obj_begin(w_pagetree_num(l, j));
+      sprintf(ibuf, "<</Type/Pages/Parent %" SLEN_P"u 0 R/Count %" SLEN_P"u/Kids[", w_pagetree_parent(l, j), cl[c+j]);
+      ibufb=ibuf+strlen(ibuf); copy_token('[');
+      w_pagetree_kids(l-1, j*c/g, (j+1)*c/g);
+      memcpy(ibuf, "]>>", 4); ibufb=ibuf+3; copy_token(']');
+      w_obj_end();
+    }
+  }
+  free(counts); cur_ctx->tmp=NULL;
+}
+
+/** Opens f (read from the start, closed by r_close()) as currs. */
+static void r_open_file(char const *filename, FILE *f) {
+  currs.xrefpages=NULL; currs.xrefc=0; currs.seekc=0; currs.tokc=0;
+  memset(currs.intcache, '\0', sizeof(currs.intcache));
+  currs.objstms=NULL; currs.objstmc=currs.objstma=0;
+  currs.filename=filename; currs.map=NULL;
+  currs.file=f;
+  if (0!=fseek(currs.file, 0, SEEK_END)) err_file(6, "unseekable", currs.filename, strerror(errno));
+#if USE_MMAP
+  { off_t l=ftello(currs.file);
+#else
+  { long l=ftell(currs.file);
+#endif
+    currs.filesize=(slen_t)l;
+    /* Dat: (slen_t)-1 is reserved, and virtual offsets follow the file */
+    if (l<32 || (double)l!=(double)currs.filesize || currs.filesize>XE_OFS_MAX/2) {
+      sprintf(cur_ctx->err, "%s: invalid filesize for %.*s: %.0f", PROGNAME, ERRPART, currs.filename, (double)l);
+      pc_fail(7);
+    }
+  }
+  currs.map=NULL;
+  currs.buf=currs.bufp=currs.bufend=rbuf; currs.bufofs=currs.filesize;
+  currs.vofsend=currs.filesize+1;
+  currs.uring_p=FALSE;
+#if USE_IO_URING
+  ur_reset();
+  if (curws.uring_p && ur_start()) { currs.uring_p=TRUE; return; } /* Dat: instead of mmap() */
+#endif
+#if USE_MMAP
+  { struct stat st;
+    void *p;
+    /* Dat: falls back to fread() for pipes, devices and mmap() failures */
+    if (0==fstat(fileno(currs.file), &st) && S_ISREG(st.st_mode)
+     && st.st_size+(slen_t)0==currs.filesize
+     && (size_t)currs.filesize==currs.filesize /* Dat: 32-bit address space */
+     && MAP_FAILED!=(p=mmap(NULL, currs.filesize, PROT_READ, MAP_SHARED, fileno(currs.file), 0))
+       ) {
+      currs.map=p;
+      currs.buf=currs.bufp=(unsigned char const*)p;
+      currs.bufend=currs.buf+currs.filesize; currs.bufofs=0;
+    }
+  }
+#endif
+}
+
+static void r_open(char const *filename) {
+  if (!(currs.file=fopen(filename,"rb"))) err_file(3, "open", filename, strerror(errno));
+  r_open_file(filename, currs.file);
+}
+
+static void r_input_status(void) {
+  if (curws.stats_p || curws.statusf==NULL) return; /* Dat: reported by w_output_stats() */
+  if (strlen(currs.filename)>IBUFSIZE-256) erri("filename too long",0);
+  sprintf(ibuf, "Input PDF (%s): filesize=%" SLEN_P"u, xrefc=%" SLEN_P"u, xreftc=%" SLEN_P"u, catalogofs=%" SLEN_P"u, #pages=%" SLEN_P"u, is_binary=%d\n",
+    currs.filename, currs.filesize, currs.xrefc, currs.xreftc, currs.catalogofs, currs.pagecount, currs.is_binary);
+  if (curws.seg!=NULL) { /* printed by seg_stitch(), in order */
+    seg_put('I', strlen(ibuf), 0);
+    fputs(ibuf, curws.seg);
+  } else {
+    fputs(ibuf, curws.statusf);
+  }
+}
+/** Closes currs and frees its buffers, without reporting errors. */
+static void r_free(void) {
+  slen_t i;
+  for (i=0; i<currs.xrefc; i+=SPARSE_PAGE) free(currs.xrefpages[i/SPARSE_PAGE]);
+  free(currs.xrefpages); currs.xrefpages=NULL; currs.xrefc=0;
+  while (currs.objstmc!=0) free(currs.objstms[--currs.objstmc].data);
+  free(currs.objstms); currs.objstms=NULL;
+#if USE_MMAP
+  if (currs.map!=NULL) munmap(currs.map, currs.filesize);
+#endif
+  currs.map=NULL;
+  if (currs.file!=NULL) fclose(currs.file);
+  currs.file=NULL;
+  currs.filename=NULL;
+}
+static void r_close(void) {
+  if (ferror(currs.file)) erri("error reading file: ", currs.filename);
+  r_free();
+}
+
+/** With --append: reads the output PDF to be updated, and opens it for
+ * appending the new objects, a new version of its top /Pages (see
+ * w_dump_toppages()), and an xref section and trailer with /Prev. Its
+ * other objects, including the catalog, are kept.
+ */
+static void w_append_start(void) {
+  char tok;
+  pdfint_t a, b;
+  int c;
+  r_open(curws.filename);
+  r_check_pdf_header();
+  r_seek_xref();
+  curws.prevxrefofs=r_tell();
+  r_read_xref(); /* Dat: adds the old page count to curws.pagetotal */
+  r_seek(currs.catalogofs);
+  r_seek_dictval_must("/Pages");
+  if ('1'!=gettok() || (a=ibuf_int, !gettok_isref(&b))) erri("/Pages of /Catalog must be indirect", 0);
+  if (b!=0) erri("top /Pages must have generation 0 for --append",0);
+  curws.toppages_num=a;
+  curws.membuf=&curws.toppages; curws.lastclosed=TRUE; curws.colc=0;
+  r_seek(currs.uppagesofs);
+  if (gettok()!='<') erri("top pages dict expected",0);
+  copy_token('<');
+  while ('>'!=(tok=gettok())) {
+    if ('/'!=tok) erri("top pages dict key expected",0);
+    if (0==strcmp(ibuf,"/Count") || 0==strcmp(ibuf,"/Kids")) {
+      skipstruct(gettok(), FALSE);
+    } else {
+      copy_token(tok);
+      skipstruct(gettok(), TRUE);
+    }
+  }
+  r_seek(currs.uppagesofs);
+  r_seek_dictval_must("/Kids");
+  copy_token('/');
+  if ('['!=gettok()) erri("/Kids of the top /Pages must be direct for --append",0);
+  copy_token('[');
+  while (']'!=(tok=gettok())) skipstruct(tok, TRUE);
+  if (!curws.lastclosed) wbuf_putc(&curws.toppages, ' ');
+  curws.membuf=NULL;
+  curws.lastclosed=TRUE; curws.colc=0;
+  w_make_trailer();
+  curws.outobjc=currs.xrefc;
+  curws.ofs=curws.oldsize=currs.filesize;
+  curws.is_binary=currs.is_binary;
+  r_seek(currs.filesize-1);
+  c=R_GETC();
+  r_close();
+  if (!(curws.wf=fopen(curws.filename,"ab"))) err_file(5, "open4append", curws.filename, strerror(errno));
+  setvbuf(curws.wf, NULL, _IONBF, 0); /* Dat: buffered by curws.obuf */
+  w_obuf_start();
+  if (c!='\n' && c!='\r') W_PUTC('\n');
+  curws.lastclosed=TRUE; curws.colc=0;
+}
+
+/** After an error with --append: cuts the output back to its old size, so
+ * the half-written update is dropped and the old file stays valid. Only
+ * called while curws.wf is open, i.e. before run_job() has closed it.
+ * Dat: no-op with USE_FTRUNCATE=0
+ */
+static void w_append_undo(void) {
+  if (!curws.append_p || curws.wf==NULL || curws.wf==stdout) return;
+#if USE_FTRUNCATE
+  fflush(curws.wf);
+  if (0!=ftruncate(fileno(curws.wf), (off_t)curws.oldsize)) {} /* Dat: nothing better to do */
+#endif
+}
+
+/* --- Linearization, see `--linearize' */
+
+/** Length of the linearization parameter dict, padded with spaces: its
+ * values are known only after the body is written
+ */
+#define LIN_DICT_LEN 128
+/** In curws.linown: the index+1 of the first page reaching an object, with
+ * LIN_SHARED if other pages reach it too, or LIN_NULL for a page tree
+ * node left out; 0 for the other objects
+ */
+#define LIN_SHARED ((unsigned)1<<31)
+#define LIN_NULL (~(unsigned)0)
+
+/** Layout of the linearized output (PDFRef.pdf F.3): the parameter dict
+ * (object m), the first page xref (objects m...n-1) and trailer, the
+ * catalog (m+1), the hint stream (n-1), the objects of the first page
+ * (m+2...n-2, the page first), then the unshared objects of the other
+ * pages (from 1), the objects shared by them (from first8), the other
+ * objects (from first9), and the main xref (objects 0...m-1; m-1 is
+ * curws.linnull). Body offsets don't count the hint stream, like the
+ * offsets in the hint tables.
+ */
+struct LinLayout {
+  slen_t np; /* number of pages */
+  slen_t c6; /* number of objects of the first page */
+  slen_t m, n;
+  slen_t allc; /* objects reached from the trailer: curws.linv[0...allc) */
+  slen_t catnum, rootnum; /* input numbers of the catalog and the root /Pages */
+  slen_t first8, first9;
+  slen_t dictofs, fxofs; /* offsets of the parameter dict and the first page xref */
+  slen_t p4end; /* end of the catalog, the hint stream is inserted here */
+  slen_t bodyend, hlen, mainofs; /* hlen: length of the hint stream object */
+  slen_t L, E, T; /* see PDFRef.pdf Table F.1 */
+};
+
+/** Bit writer of the hint tables, MSB first */
+struct LinBits {
+  unsigned acc, bitc;
+};
+
+/** Appends input object num to curws.linv. */
+static void lin_push(slen_t num) {
+  if (curws.linc==curws.lina) {
+    curws.lina=curws.lina<1024 ? 1024 : 2*curws.lina;
+    if (NULL==(curws.linv=(slen_t*)realloc(curws.linv, curws.lina*sizeof(curws.linv[0])))) errn("out of memory for linearization",0);
+  }
+  curws.linv[curws.linc++]=num;
+}
+
+/** @return the number of bits needed for v */
+static unsigned lin_nbits(slen_t v) {
+  unsigned n=0;
+  for (; v!=0; v>>=1) n++;
+  return n;
+}
+
+/** Appends the low nbits bits of v to curws.hintbuf. */
+static void lb_put(struct LinBits *lb, slen_t v, unsigned nbits) {
+  while (nbits--!=0) {
+    lb->acc=lb->acc<<1|(unsigned)(v>>nbits&1);
+    if (++lb->bitc==8) { wbuf_putc(&curws.hintbuf, (int)lb->acc); lb->acc=lb->bitc=0; }
+  }
+}
+
+/** Pads the item just written to a whole byte, like qpdf does. */
+static void lb_flush(struct LinBits *lb) {
+  if (lb->bitc!=0) lb_put(lb, 0, 8-lb->bitc);
+}
+
+/** Finds the objects reached from each page (not through other pages or
+ * the catalog) to curws.linv, and their owner pages to curws.linown.
+ */
+static void w_lin_closures(struct LinLayout const *ly) {
+  slen_t k, pg, num, ofs;
+  unsigned own;
+  for (k=0; k<ly->np; k++) {
+    curws.linpgs[k]=curws.linc;
+    sn_free(&curws.tnums); curws.outobjc=2; /* Dat: tnums only marks the objects reached */
+    curws.qhead=curws.qc=curws.qpf=0;
+    pg=curws.selv[k].num;
+    sn_set(&curws.tnums, pg, 1);
+    enq_put(pg);
+    while (curws.qhead!=curws.qc) {
+      num=curws.queue[curws.qhead++];
+      if (LIN_NULL==(own=sn_get(&curws.linown, num))) continue;
+      ofs=r_seek_objval(num);
+      if (num!=pg && (ofs==currs.catalogofs || r_pagenode_p())) continue;
+      lin_push(num);
+      if (own==0) sn_set(&curws.linown, num, k+1);
+      else if ((own&LIN_SHARED)==0) sn_set(&curws.linown, num, own|LIN_SHARED);
+      r_enqueue_obj(num, FALSE);
+    }
   }
+  curws.linpgs[k]=curws.linc;
+  sn_free(&curws.tnums);
 }
 
-static void w_make_trailer(void) {
-  char tok;
-  slen_t pretofs;
-  r_seek(currs.trailer1ofs);
-  if (gettok()!='E' || 0!=strcmp(ibuf,"trailer")) erri("trailer expected for dump",0);
-  newline();
-  pretofs=ftell(curws.wf);
-  copy_token('E'); newline();
-  if (gettok()!='<') erri("trailer dict expected",0);
-  copy_token('<');
-  while (1) {
-    if ('>'==(tok=gettok())) break;
-    if ('/'!=tok) erri("trailer dict key expected",0);
-    /* Dat: first trailer usually has: /Size /Info /Root /Prev /ID */
-    /* Dat: prev trailers usually have: /Size /ID -- will be ignored */
-    /* Dat: thus our merged trailer will have many /ID fields -- but we don't merge prev trailers */
-    #if DEBUG
-      fprintf(stderr,"trailer_key=(%s)\n",ibuf);
-    #endif
-    if (0==strcmp(ibuf,"/Prev") || 0==strcmp(ibuf,"/Size")) {
-      skipstruct(gettok(), FALSE);
-    } else {
-      copy_token(tok);
-      wr_enqueue_struct(TRUE); /* renumbering */
+/** Writes the root /Pages of the linearized output as object t, with all
+ * the pages as its kids.
+ */
+static void w_lin_root(slen_t t) {
+  slen_t i;
+  w_obj_begin(t);
+  sprintf(ibuf, "<</Type/Pages/Count %" SLEN_P"u/Kids[", curws.selc);
+  ibufb=ibuf+strlen(ibuf); copy_token('[');
+  for (i=0; i<curws.selc; i++) w_ref(sn_get(&curws.tnums, curws.selv[i].num));
+  memcpy(ibuf, "]>>", 4); ibufb=ibuf+3; copy_token(']');
+  w_obj_end();
+}
+
+/** Numbers input object num as t, or if dump_p, dumps it. */
+static void w_lin_put(struct LinLayout const *ly, slen_t num, slen_t t, sbool dump_p) {
+  if (!dump_p) sn_set(&curws.tnums, num, t);
+  else if (num==ly->rootnum) w_lin_root(t);
+  else { assert(sn_get(&curws.tnums, num)==t); r_dump_obj(num); }
+}
+
+/** Numbers the objects after the first page from 1 in layout order, or if
+ * dump_p, dumps them in that order. Sets the first number of each page in
+ * curws.linpgs[np+1...]. @return the next number
+ */
+static slen_t w_lin_main(struct LinLayout *ly, sbool dump_p) {
+  slen_t *secs=curws.linpgs+ly->np+1;
+  slen_t t=1, k, j, num;
+  for (k=1; k<ly->np; k++) {
+    secs[k]=t;
+    for (j=curws.linpgs[k]; j<curws.linpgs[k+1]; j++) {
+      if (sn_get(&curws.linown, num=curws.linv[j])==k+1) w_lin_put(ly, num, t++, dump_p);
     }
   }
-  if (0!=fseek(curws.wf, pretofs, SEEK_SET)) errn("cannot seek pretofs: ",curws.filename);
-  curws.lastclosed=TRUE; curws.colc=0;
+  secs[ly->np]=ly->first8=t;
+  for (k=1; k<ly->np; k++) {
+    for (j=curws.linpgs[k]; j<curws.linpgs[k+1]; j++) {
+      if (sn_get(&curws.linown, num=curws.linv[j])==((k+1)|LIN_SHARED)) w_lin_put(ly, num, t++, dump_p);
+    }
+  }
+  ly->first9=t;
+  for (j=0; j<ly->allc; j++) {
+    if (sn_get(&curws.linown, num=curws.linv[j])==0) w_lin_put(ly, num, t++, dump_p);
+  }
+  return t;
 }
 
-static void w_dump_trailer(void) {
-  newline();
-  fwrite(curws.trailer, 1, curws.trailerlen, curws.wf);
-  fprintf(curws.wf,"/Size %" SLEN_P"u>>\nstartxref\n%" SLEN_P"u\n%%%%EOF\n", curws.txrefc, curws.startxrefofs); /* Dat: must end by "%%EOF\n" */
-  fflush(curws.wf);
-  curws.lastclosed=TRUE; curws.colc=0;
+/** @return the number of objects of page k, and its length in *lenp */
+static slen_t lin_page(struct LinLayout const *ly, slen_t k, slen_t *lenp) {
+  slen_t const *secs=curws.linpgs+ly->np+1;
+  if (k==0) { *lenp=curws.txrefs[1]-ly->p4end; return ly->c6; }
+  *lenp=curws.txrefs[secs[k+1]]-curws.txrefs[secs[k]];
+  return secs[k+1]-secs[k];
 }
 
-/** curws now contains a trailer dict. Read it to memory. ftruncate() isn't
- * necessary, because final output will be longer than the trailer */
-static void w_pull_trailer(void) {
-  slen_t ofs=ftell(curws.wf);
-  if (0!=fseek(curws.wf, 0, SEEK_END)) { seekerr: errn("cannot seek: ", curws.filename); }
-  if (NULL==(curws.trailer=(char*)malloc(1+(curws.trailerlen=ftell(curws.wf)-ofs)))) errn("out of memory for trailer",0);
-  if (0!=fseek(curws.wf, ofs, SEEK_SET)) goto seekerr;
-  if (curws.trailerlen!=fread(curws.trailer, 1, curws.trailerlen, curws.wf)) errn("cannot read trailer: ", curws.filename);
-  if (0!=fseek(curws.wf, ofs, SEEK_SET)) goto seekerr; /* superfluous, but ANSI needs it */
+/** @return the length of shared object group g: each object of the first
+ * page, then each shared object is a group of its own
+ */
+static slen_t lin_group_len(struct LinLayout const *ly, slen_t g) {
+  slen_t t;
+  if (g<ly->c6) {
+    t=ly->m+2+g;
+    return (g+1<ly->c6 ? curws.txrefs[t+1] : curws.txrefs[1])-curws.txrefs[t];
+  }
+  t=ly->first8+g-ly->c6;
+  return curws.txrefs[t+1]-curws.txrefs[t];
 }
 
-static void w_dump_toppages(void) {
-  /* Dat: we must say `1 0 obj' for (data flow to) /Parent of /Pages */
-  slen_t srci;
-  newline();
-  w_xref_aset(1, ftell(curws.wf));
-  sprintf(ibuf, "1 0 obj\n<</Type/Pages/Count %" SLEN_P"u/Kids[", curws.pagetotal);
-  ibufb=ibuf+strlen(ibuf); copy_token('[');
-  srci=0; while (srci!=curws.srcpages_numc) {
-    sprintf(ibuf, "%" SLEN_P"u", curws.srcpages_nums[srci++]);
-    ibufb=ibuf+strlen(ibuf); copy_token('1');
-    ibuf[0]='0'; ibuf[1]='\0'; ibufb=ibuf+1; copy_token('1');
-    ibuf[0]='R'; ibuf[1]='\0'; ibufb=ibuf+1; copy_token('R');
+/** Writes the shared object groups used by page k (none for the first
+ * page) to lb in nbits bits each, or if lb is NULL, finds the largest one
+ * to *maxgp. @return their number
+ */
+static slen_t lin_page_shared(struct LinLayout const *ly, slen_t k, struct LinBits *lb, unsigned nbits, slen_t *maxgp) {
+  slen_t j, t, g, c=0;
+  if (k==0) return 0;
+  for (j=curws.linpgs[k]; j<curws.linpgs[k+1]; j++) {
+    if (sn_get(&curws.linown, curws.linv[j])==k+1) continue;
+    t=sn_get(&curws.tnums, curws.linv[j]);
+    g=t>ly->m ? t-(ly->m+2) : ly->c6+t-ly->first8;
+    if (lb!=NULL) lb_put(lb, g, nbits);
+    else if (*maxgp<g) *maxgp=g;
+    c++;
   }
-  sprintf(ibuf, "]>>"); ibufb=ibuf+strlen(ibuf); copy_token(']');
-  sprintf(ibuf, "endobj"); ibufb=ibuf+strlen(ibuf); copy_token('E');
+  return c;
 }
 
-static void r_open(char const *filename) {
-  currs.xrefs=NULL; currs.xrefc=0; currs.lastofs=0;
-  currs.filename=filename;
-  if (!(currs.file=fopen(currs.filename,"rb"))) {
-    fprintf(stderr, "%s: open %s: %s\n", PROGNAME, currs.filename, strerror(errno));
-    exit(3);
+/** Builds the page offset and the shared object hint tables (PDFRef.pdf
+ * F.4) in curws.hintbuf from the body offsets in curws.txrefs. Content
+ * streams are taken as the whole page, without fractional positions.
+ * @return the offset of the shared object hint table
+ */
+static slen_t w_lin_hints(struct LinLayout const *ly) {
+  struct LinBits lb;
+  slen_t k, c, len, s, minc=(slen_t)-1, maxc=0, minl=(slen_t)-1, maxl=0, maxs=0, maxg=0;
+  slen_t gc=ly->c6+ly->first9-ly->first8;
+  unsigned nbc, nbl, nbg;
+  lb.acc=lb.bitc=0; curws.hintbuf.len=0;
+  for (k=0; k<ly->np; k++) {
+    c=lin_page(ly, k, &len);
+    if (minc>c) minc=c;
+    if (maxc<c) maxc=c;
+    if (minl>len) minl=len;
+    if (maxl<len) maxl=len;
+    if (maxs<(c=lin_page_shared(ly, k, NULL, 0, &maxg))) maxs=c;
   }
-  if (0!=fseek(currs.file, 0, SEEK_END)) {
-    fprintf(stderr, "%s: unseekable %s: %s\n", PROGNAME, currs.filename, strerror(errno));
-    exit(6);
+  nbc=lin_nbits(maxc-minc); nbl=lin_nbits(maxl-minl); nbg=lin_nbits(maxg);
+  lb_put(&lb, minc, 32); lb_put(&lb, ly->p4end, 32); lb_put(&lb, nbc, 16);
+  lb_put(&lb, minl, 32); lb_put(&lb, nbl, 16);
+  lb_put(&lb, 0, 32); lb_put(&lb, 0, 16); /* content stream offsets */
+  lb_put(&lb, minl, 32); lb_put(&lb, nbl, 16); /* content stream lengths */
+  lb_put(&lb, lin_nbits(maxs), 16); lb_put(&lb, nbg, 16);
+  lb_put(&lb, 0, 16); lb_put(&lb, 4, 16); /* Dat: numerators of 0 bits */
+  for (k=0; k<ly->np; k++) lb_put(&lb, lin_page(ly, k, &len)-minc, nbc);
+  lb_flush(&lb);
+  for (k=0; k<ly->np; k++) { lin_page(ly, k, &len); lb_put(&lb, len-minl, nbl); }
+  lb_flush(&lb);
+  for (k=0; k<ly->np; k++) lb_put(&lb, lin_page_shared(ly, k, NULL, 0, &maxg), lin_nbits(maxs));
+  lb_flush(&lb);
+  for (k=0; k<ly->np; k++) lin_page_shared(ly, k, &lb, nbg, NULL);
+  lb_flush(&lb);
+  for (k=0; k<ly->np; k++) { lin_page(ly, k, &len); lb_put(&lb, len-minl, nbl); }
+  lb_flush(&lb);
+  s=curws.hintbuf.len;
+  minl=(slen_t)-1; maxl=0;
+  for (k=0; k<gc; k++) {
+    len=lin_group_len(ly, k);
+    if (minl>len) minl=len;
+    if (maxl<len) maxl=len;
   }
-  { long l=ftell(currs.file); currs.filesize=l;
-    if (l<32 || currs.filesize!=l+0UL) {
-      fprintf(stderr, "%s: invalid filesize for %s: %ld\n", PROGNAME, currs.filename, l);
-      exit(7);
-    }
+  nbl=lin_nbits(maxl-minl);
+  c=ly->first9!=ly->first8;
+  lb_put(&lb, c ? ly->first8 : 0, 32); lb_put(&lb, c ? curws.txrefs[ly->first8] : 0, 32);
+  lb_put(&lb, ly->c6, 32); lb_put(&lb, gc, 32);
+  lb_put(&lb, 0, 16); /* Dat: a single object in each group */
+  lb_put(&lb, minl, 32); lb_put(&lb, nbl, 16);
+  for (k=0; k<gc; k++) lb_put(&lb, lin_group_len(ly, k)-minl, nbl);
+  lb_flush(&lb);
+  for (k=0; k<gc; k++) lb_put(&lb, 0, 1); /* no MD5 signatures */
+  lb_flush(&lb);
+  return s;
+}
+
+/** Writes the header, the parameter dict and the first page xref section
+ * with its trailer. The length doesn't depend on the values in ly.
+ */
+static void w_lin_prefix(char const *header, struct LinLayout const *ly) {
+  slen_t len;
+  w_puts(header);
+  if (curws.is_binary) w_puts("%\xE1\xE9\xF3\xFA\n");
+  sprintf(ibuf, "%" SLEN_P"u 0 obj\n", ly->m);
+  w_puts(ibuf);
+  sprintf(ibuf, "<</Linearized 1/L %" SLEN_P"u/H[%" SLEN_P"u %" SLEN_P"u]/O %" SLEN_P"u/E %" SLEN_P"u/N %" SLEN_P"u/T %" SLEN_P"u>>",
+    ly->L, ly->p4end, ly->hlen, ly->m+2, ly->E, ly->np, ly->T);
+  if ((len=strlen(ibuf))>LIN_DICT_LEN) errn("linearization dict too long",0);
+  memset(ibuf+len, ' ', LIN_DICT_LEN-len);
+  memcpy(ibuf+LIN_DICT_LEN, "\nendobj\n", 8);
+  w_write(ibuf, LIN_DICT_LEN+8);
+  sprintf(ibuf, "xref\n%" SLEN_P"u %" SLEN_P"u\n", ly->m, ly->n-ly->m);
+  w_puts(ibuf);
+  w_xref_entries(ly->m, ly->n);
+  w_write(curws.trailer.p, curws.trailer.len);
+  sprintf(ibuf, "/Size %" SLEN_P"u/Prev %-10" SLEN_P"u>>\nstartxref\n0\n%%%%EOF\n", ly->n, ly->mainofs);
+  w_puts(ibuf);
+}
+
+/** Rewrites the merged output in the temporary file curws.wf as a
+ * linearized PDF (Fast Web View) to curws.linwf: reads it back, flattens
+ * its page tree, finds the objects of each page, and numbers the objects
+ * in the order of struct LinLayout. Writes the body to another temporary
+ * file, builds the hint tables from its offsets, then writes the prefix
+ * and copies the body with the hint stream inserted.
+ */
+static void w_linearize(void) {
+  struct LinLayout ly;
+  char header[sizeof(currs.pdf_header)];
+  slen_t pagetotal=curws.pagetotal, num, ofs, t, s, p;
+  FILE *f;
+  if (ferror(curws.wf)) errn("error writing temporary file",0);
+  f=curws.wf; curws.wf=NULL; /* Dat: closed by r_close() */
+  r_open_file("(linearize pass 1)", f);
+  r_check_pdf_header();
+  memcpy(header, currs.pdf_header, sizeof(header));
+  if (0>memcmp(header, "%PDF-1.2", 8)) memcpy(header, "%PDF-1.2", 8);
+  r_seek_xref();
+  r_read_xref();
+  if (currs.pagecount==0) erri("no pages to linearize",0);
+  curws.selc=0; sn_free(&curws.selmark);
+  r_select_pages("1-z");
+  curws.pagetotal=pagetotal;
+  ly.np=curws.selc;
+  curws.linnull=(slen_t)-1; /* Dat: for now; references to the pages left out by the merge dangle */
+  curws.linc=0;
+  sn_free(&curws.tnums); sn_free(&curws.linown);
+  curws.outobjc=2; curws.qhead=curws.qc=curws.qpf=0;
+  r_seek(currs.trailer1ofs);
+  wr_enqueue_struct(FALSE);
+  ly.catnum=ly.rootnum=0;
+  while (curws.qhead!=curws.qc) {
+    num=curws.queue[curws.qhead++];
+    if (r_unselected_p(num)) { sn_set(&curws.linown, num, LIN_NULL); lin_push(num); continue; }
+    ofs=r_enqueue_obj(num, FALSE);
+    if (ofs==currs.catalogofs) { ly.catnum=num; continue; }
+    if (ofs==currs.uppagesofs) ly.rootnum=num;
+    lin_push(num);
+  }
+  ly.allc=curws.linc;
+  if (NULL==(curws.linpgs=(slen_t*)realloc(curws.linpgs, 2*(ly.np+1)*sizeof(curws.linpgs[0])))) errn("out of memory for linearization",0);
+  w_lin_closures(&ly);
+
+  for (t=num=0; num<ly.allc; num++) t+=sn_get(&curws.linown, curws.linv[num])!=LIN_NULL;
+  ly.c6=curws.linpgs[1]-curws.linpgs[0];
+  ly.m=t-ly.c6+2; ly.n=ly.m+3+ly.c6;
+  curws.linnull=ly.m-1;
+  sn_set(&curws.tnums, ly.catnum, ly.m+1);
+  for (t=0; t<ly.c6; t++) sn_set(&curws.tnums, curws.linv[curws.linpgs[0]+t], ly.m+2+t);
+  for (t=0; t<ly.allc; t++) {
+    if (LIN_NULL==sn_get(&curws.linown, num=curws.linv[t])) sn_set(&curws.tnums, num, curws.linnull);
   }
+  t=w_lin_main(&ly, FALSE);
+  assert(t==curws.linnull);
+  curws.lastclosed=TRUE; curws.colc=0;
+  w_make_trailer();
+
+  /* Dat: the prefix has the same length with the final values */
+  ly.p4end=ly.bodyend=ly.hlen=ly.mainofs=ly.L=ly.E=ly.T=0;
+  ly.dictofs=strlen(header)+(curws.is_binary ? 6 : 0);
+  sprintf(ibuf, "%" SLEN_P"u 0 obj\n", ly.m);
+  ly.fxofs=ly.dictofs+strlen(ibuf)+LIN_DICT_LEN+8;
+  w_xref_aset(ly.n-1, 0);
+  curws.membuf=&curws.objbuf; curws.objbuf.len=0;
+  w_lin_prefix(header, &ly);
+  curws.membuf=NULL;
+  p=curws.objbuf.len;
+
+  if (NULL==(curws.wf=tmpfile())) errn("tmpfile: ", strerror(errno));
+  setvbuf(curws.wf, NULL, _IONBF, 0); /* Dat: buffered by curws.obuf */
+  curws.ofs=0; w_obuf_start();
+  curws.txrefc=0;
+  w_write(curws.objbuf.p, p); /* Dat: a placeholder, so body offsets are final */
+  curws.lastclosed=TRUE; curws.colc=0;
+  curws.toppages_num=sn_get(&curws.tnums, ly.rootnum);
+  curws.qhead=curws.qc=curws.qpf=0;
+  r_dump_obj(ly.catnum);
+  newline();
+  ly.p4end=curws.ofs;
+  for (t=0; t<ly.c6; t++) r_dump_obj(curws.linv[curws.linpgs[0]+t]);
+  w_lin_main(&ly, TRUE);
+  newline();
+  ly.bodyend=curws.ofs;
+  assert(curws.qhead==curws.qc); /* Dat: no object was left unnumbered */
+  w_flush(); fflush(curws.wf);
+  if (ferror(curws.wf)) errn("error writing temporary file",0);
+
+  s=w_lin_hints(&ly);
+  z_deflate((unsigned char const*)curws.hintbuf.p, curws.hintbuf.len);
+  sprintf(ibuf, "%" SLEN_P"u 0 obj\n<</S %" SLEN_P"u/Filter/FlateDecode/Length %" SLEN_P"u>>stream\n", ly.n-1, s, zd.outlen);
+  ly.hlen=strlen(ibuf)+zd.outlen+strlen("\nendstream\nendobj\n");
+  ly.E=curws.txrefs[1]+ly.hlen;
+  ly.mainofs=ly.bodyend+ly.hlen;
+  sprintf(ibuf, "xref\n0 %" SLEN_P"u", ly.m);
+  ly.T=ly.mainofs+strlen(ibuf);
+  sprintf(ibuf, "trailer\n<</Size %" SLEN_P"u>>\nstartxref\n%" SLEN_P"u\n%%%%EOF\n", ly.m, ly.fxofs);
+  ly.L=ly.T+1+20*ly.m+strlen(ibuf);
+  if (ly.L>>16>>16!=0) errn("output too large for --linearize",0);
+  w_xref_aset(ly.n-1, ly.p4end);
+  for (t=1; t<ly.n-1; t++) if (t!=ly.m+1 && curws.txrefs[t]!=0) curws.txrefs[t]+=ly.hlen;
+  curws.txrefs[ly.m]=ly.dictofs;
+
+  r_close();
+  f=curws.wf; curws.wf=curws.linwf; curws.linwf=NULL;
+  r_open_file("(linearize pass 2)", f);
+  curws.ofs=0; w_obuf_start();
+  w_lin_prefix(header, &ly);
+  assert(curws.ofs==p);
+  r_seek(p);
+  if (r_copy_out(ly.p4end-p)!=ly.p4end-p) erri("body too short",0);
+  sprintf(ibuf, "%" SLEN_P"u 0 obj\n<</S %" SLEN_P"u/Filter/FlateDecode/Length %" SLEN_P"u>>stream\n", ly.n-1, s, zd.outlen);
+  w_puts(ibuf);
+  w_write((char const*)zd.out, zd.outlen);
+  w_puts("\nendstream\nendobj\n");
+  if (r_copy_out(ly.bodyend-ly.p4end)!=ly.bodyend-ly.p4end) erri("body too short",0);
+  r_close();
+  sprintf(ibuf, "xref\n0 %" SLEN_P"u\n", ly.m);
+  w_puts(ibuf);
+  w_xref_entries(0, ly.m);
+  sprintf(ibuf, "trailer\n<</Size %" SLEN_P"u>>\nstartxref\n%" SLEN_P"u\n%%%%EOF\n", ly.m, ly.fxofs);
+  w_puts(ibuf);
+  w_flush();
+  assert(curws.ofs==ly.L);
+  curws.linnull=0; sn_free(&curws.linown); sn_free(&curws.tnums);
+  curws.selc=0; sn_free(&curws.selmark);
 }
 
-static void r_input_status(void) {
-  fprintf(stdout, "Input PDF (%s): filesize=%" SLEN_P"u, xrefc=%" SLEN_P"u, xreftc=%" SLEN_P"u, catalogofs=%" SLEN_P"u, #pages=%" SLEN_P"u, is_binary=%d\n",
-    currs.filename, currs.filesize, currs.xrefc, currs.xreftc, currs.catalogofs, currs.pagecount, currs.is_binary);
+/* --- Statistics */
+
+static double stats_wall(void) {
+#if USE_MMAP
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec+tv.tv_usec/1e6;
+#else
+  time_t t=time(NULL);
+  return (double)t;
+#endif
 }
-static void r_close(void) {
-  free(currs.xrefs); currs.xrefs=NULL;
-  if (ferror(currs.file)) erri("error reading file: ", currs.filename);
-  fclose(currs.file); currs.file=NULL;
-  currs.filename=NULL;
+
+static double stats_cpu(void) {
+  clock_t c=clock();
+  return (double)c/CLOCKS_PER_SEC;
 }
 
-static void w_output_status(void) {
-  fprintf(stdout, "Output PDF (%s): filesize=%lu, xrefc=%" SLEN_P"u, subfiles=%" SLEN_P"u, #pages=%" SLEN_P"u, is_binary=%d\n",
-    curws.filename, (long)ftell(curws.wf), curws.txrefc, curws.srcpages_numc, curws.pagetotal, curws.is_binary);
+/** Adds the wall and CPU time since the previous call to phase ph of st (if
+ * not NULL). No-op without --stats=json.
+ */
+static void stats_lap(struct Stats *st, int ph) {
+  double wall, cpu;
+  if (!curws.stats_p) return;
+  wall=stats_wall(); cpu=stats_cpu();
+  if (st!=NULL) {
+    st->wall[ph]+=wall-curws.stats_wall0;
+    st->cpu[ph]+=cpu-curws.stats_cpu0;
+  }
+  curws.stats_wall0=wall; curws.stats_cpu0=cpu;
 }
 
-/* --- Main */
+/** Copies the counters of the current input to its struct Stats. */
+static void r_input_stats(void) {
+  struct Stats *st=curws.stats+currs.srci;
+  if (!curws.stats_p) return;
+  st->filesize=currs.filesize; st->xrefc=currs.xrefc; st->pagecount=curws.selc!=0 ? curws.selc : currs.pagecount;
+  st->tokens=currs.tokc; st->seeks=currs.seekc;
+}
 
-int main(int argc, char const* const*argv) {
-  char const*const* ap;
+static void stats_json_string(char const *p) {
+  putc('"', curws.statusf);
+  for (; *p!='\0'; p++) {
+    if (*p=='"' || *p=='\\') fprintf(curws.statusf, "\\%c", *p);
+    else if ((unsigned char)*p<32) fprintf(curws.statusf, "\\u%04x", (unsigned char)*p);
+    else putc(*p, curws.statusf);
+  }
+  putc('"', curws.statusf);
+}
+
+static void stats_json(struct Stats const *st, char const *indent) {
+  static char const* const phase_names[PH_C]={"header", "seek_xref",
+    "read_xref", "dump_reachable", "trailer", "stitch", "xref_dump"};
+  int ph;
+  FILE *f=curws.statusf;
+  fprintf(f, "%s\"phases\": {", indent);
+  for (ph=0; ph<PH_C; ph++) {
+    fprintf(f, "%s\"%s\": {\"wall\": %.6f, \"cpu\": %.6f}", ph==0 ? "" : ", ",
+      phase_names[ph], st->wall[ph], st->cpu[ph]);
+  }
+  fprintf(f, "},\n%s\"filesize\": %" SLEN_P"u, \"xrefc\": %" SLEN_P"u, \"pages\": %" SLEN_P"u,\n", indent, st->filesize, st->xrefc, st->pagecount);
+  fprintf(f, "%s\"tokens\": %" SLEN_P"u, \"seeks\": %" SLEN_P"u, \"bytes_verbatim\": %" SLEN_P"u, \"bytes_tokenized\": %" SLEN_P"u,\n", indent, st->tokens, st->seeks, st->bytes_verbatim, st->bytes_tokenized);
+  fprintf(f, "%s\"objs_reached\": %" SLEN_P"u, \"objs_skipped\": %" SLEN_P"u", indent, st->objs_reached, st->objs_skipped);
+}
+
+/** Prints the --stats=json report to curws.statusf: a struct Stats for each
+ * input, their sum in "total", and the output counters. Times are in seconds.
+ * Dat: with -j, the times of the inputs overlap, so "total" may exceed "wall".
+ */
+static void w_output_stats(char const* const* inputs) {
+  struct Stats total;
   slen_t srci;
-  (void)argc; (void)argv;
-  if (argc<3 || 0!=strcmp(argv[1],"-o")) {
-    fprintf(stderr, "Usage: %s -o <output.pdf> <input1.pdf> [...]\n", argv[0]);
-    exit(2);
+  int ph;
+  long maxrss=-1;
+  FILE *f=curws.statusf;
+#if USE_MMAP
+  struct rusage ru;
+  if (0==getrusage(RUSAGE_SELF, &ru)) maxrss=ru.ru_maxrss;
+  if (0==getrusage(RUSAGE_CHILDREN, &ru) && ru.ru_maxrss>maxrss) maxrss=ru.ru_maxrss;
+#endif
+  memset(&total, 0, sizeof(total));
+  fputs("{\"inputs\": [\n", f);
+  for (srci=0; srci<curws.srcpages_numc; srci++) {
+    struct Stats const *st=curws.stats+srci;
+    for (ph=0; ph<PH_C; ph++) { total.wall[ph]+=st->wall[ph]; total.cpu[ph]+=st->cpu[ph]; }
+    total.filesize+=st->filesize; total.xrefc+=st->xrefc; total.pagecount+=st->pagecount;
+    total.tokens+=st->tokens; total.seeks+=st->seeks;
+    total.bytes_verbatim+=st->bytes_verbatim; total.bytes_tokenized+=st->bytes_tokenized;
+    total.objs_reached+=st->objs_reached; total.objs_skipped+=st->objs_skipped;
+    fputs("  {\"file\": ", f); stats_json_string(inputs[srci]); fputs(",\n", f);
+    stats_json(st, "   "); fprintf(f, "}%s\n", srci+1==curws.srcpages_numc ? "" : ",");
   }
+  for (ph=0; ph<PH_C; ph++) { total.wall[ph]+=curws.ostats.wall[ph]; total.cpu[ph]+=curws.ostats.cpu[ph]; }
+  fputs("],\n\"total\": {\n", f);
+  stats_json(&total, " ");
+  fputs("},\n\"output\": {\"file\": ", f); stats_json_string(curws.filename);
+  fprintf(f, ", \"filesize\": %" SLEN_P"u, \"xrefc\": %" SLEN_P"u, \"subfiles\": %" SLEN_P"u, \"pages\": %" SLEN_P"u,\n",
+    curws.ofs, curws.txrefc, curws.srcpages_numc, curws.pagetotal);
+  fprintf(f, " \"xref_dump\": {\"wall\": %.6f, \"cpu\": %.6f}", curws.ostats.wall[PH_XREF_DUMP], curws.ostats.cpu[PH_XREF_DUMP]);
+  if (curws.dedup_p) fprintf(f, ",\n \"dedup_merged\": %" SLEN_P"u, \"dedup_saved\": %" SLEN_P"u", curws.ddsavedc, curws.ddsaved);
+  fprintf(f, "},\n\"wall\": %.6f, \"cpu\": %.6f, \"peak_rss_kb\": %ld}\n",
+    stats_wall()-curws.stats_start, stats_cpu(), maxrss);
+}
 
-  curws.colc=0; curws.lastclosed=TRUE; curws.pagetotal=0;
-  curws.filename=argv[2];
-  { ap=argv+3;
-    while (*ap) if (0==strcmp(curws.filename, *ap++)) {
-      fprintf(stderr, "%s: may not append to existing PDF: %s\n", PROGNAME, curws.filename);
-      exit(4);
-    }
-    curws.srcpages_numc=ap-argv-3;
-    /* fprintf(stderr,"%d\n", curws.srcpages_numc); */
+static void w_output_status(void) {
+  if (curws.stats_p || curws.statusf==NULL) return; /* Dat: reported by w_output_stats() */
+  fprintf(curws.statusf, "Output PDF (%s): filesize=%" SLEN_P"u, xrefc=%" SLEN_P"u, subfiles=%" SLEN_P"u, #pages=%" SLEN_P"u, is_binary=%d\n",
+    curws.filename, curws.ofs, curws.txrefc, curws.srcpages_numc, curws.pagetotal, curws.is_binary);
+  if (curws.dedup_p) fprintf(curws.statusf, "Dedup: merged objects=%" SLEN_P"u, input bytes saved=%" SLEN_P"u\n",
+    curws.ddsavedc, curws.ddsaved);
+}
+
+/* --- Input cache */
+
+/** An input used more than once (by several jobs of --manifest, or
+ * several times in a job): it is opened and its xref is read only once,
+ * and it is kept open until the last use.
+ */
+struct InputCache {
+  char const *filename;
+  slen_t uses; /* uses left */
+  sbool loaded_p; /* rs is valid */
+  struct ReadState rs; /* currs */
+};
+
+
+static int cmp_str(void const *a, void const *b) {
+  return strcmp(*(char const* const*)a, *(char const* const*)b);
+}
+
+/** Creates the caches for inputs used more than once by the jobv[0..jobc),
+ * each being `output, input1, ..., NULL'. Inputs which are also outputs
+ * are not cached, because they may change.
+ */
+static void r_cache_init(char const* const* jobv, slen_t jobc) {
+  char const **ins, **outs;
+  slen_t inc=0, outc=0, i, j, k;
+  char const* const* p;
+  for (p=jobv, i=jobc; i!=0; i--) { outc++; while (*++p!=NULL) inc++; p++; }
+  if (NULL==(cur_ctx->tmp=ins=(char const**)malloc((inc+outc)*sizeof(ins[0])))) errn("out of memory for input cache",0);
+  outs=ins+inc;
+  for (p=jobv, i=jobc, inc=outc=0; i!=0; i--) { outs[outc++]=*p; while (*++p!=NULL) ins[inc++]=*p; p++; }
+  qsort(ins, inc, sizeof(ins[0]), cmp_str);
+  qsort(outs, outc, sizeof(outs[0]), cmp_str);
+  for (i=0, k=0; i<inc; i=j) {
+    for (j=i+1; j<inc && 0==strcmp(ins[i], ins[j]); j++) {}
+    if (j-i<2) continue;
+    while (k<outc && 0>strcmp(outs[k], ins[i])) k++;
+    if (k<outc && 0==strcmp(outs[k], ins[i])) continue;
+    if (NULL==(caches=(struct InputCache*)realloc(caches, (cachec+1)*sizeof(caches[0])))) errn("out of memory for input cache",0);
+    caches[cachec].filename=ins[i];
+    caches[cachec].uses=j-i;
+    caches[cachec++].loaded_p=FALSE;
   }
-  if (!(curws.wf=fopen(curws.filename,"wb+"))) {
-    fprintf(stderr, "%s: open4write %s: %s\n", PROGNAME, curws.filename, strerror(errno));
-    exit(5);
+  free(ins); cur_ctx->tmp=NULL;
+}
+
+/** @return the cache of filename, or NULL if it is used only once */
+static struct InputCache *r_cache_find(char const *filename) {
+  slen_t lo=0, hi=cachec, mid;
+  int c;
+  while (lo<hi) {
+    mid=lo+(hi-lo)/2;
+    if (0==(c=strcmp(filename, caches[mid].filename))) return caches+mid;
+    if (c<0) hi=mid; else lo=mid+1;
   }
-  if (NULL==(curws.srcpages_nums=(slen_t*)malloc(sizeof(curws.srcpages_nums[0])*curws.srcpages_numc))) errn("out of memory for srcpages_nums",0);
+  return NULL;
+}
 
-  r_open(argv[3]);
+/** Opens filename as currs and reads its xref, or takes it from the cache.
+ * Adds its page count to curws.pagetotal.
+ */
+static void r_load(char const *filename, struct Stats *st) {
+  struct InputCache *c=r_cache_find(filename);
+  slen_t srci=currs.srci;
+  stats_lap(NULL, 0);
+  sn_free(&curws.tnums);
+  if (c!=NULL && c->loaded_p) {
+    currs=c->rs; currs.srci=srci;
+    currs.seekc=currs.tokc=0;
+    if (currs.map!=NULL) { /* Dat: rbuf may contain another file */
+      currs.buf=(unsigned char const*)currs.map; currs.bufend=currs.buf+currs.filesize; currs.bufofs=0;
+    } else {
+      currs.buf=currs.bufend=rbuf; currs.bufofs=currs.filesize;
+    }
+    currs.bufp=currs.buf;
+#if USE_IO_URING
+    ur_reset();
+#endif
+    curws.pagetotal+=currs.pagecount;
+    stats_lap(st, PH_READ_XREF);
+    return;
+  }
+  r_open(filename);
   r_check_pdf_header();
+  stats_lap(st, PH_HEADER);
   r_seek_xref();
+  stats_lap(st, PH_SEEK_XREF);
   r_read_xref();
+  stats_lap(st, PH_READ_XREF);
+}
+
+/** Counts a use of the cached c, and closes it after the last one. */
+static void r_cache_done(struct InputCache *c) {
+  if (--c->uses==0 && c->loaded_p) {
+    currs=c->rs; c->loaded_p=FALSE;
+    r_close();
+  }
+}
+
+/** Closes currs, or keeps it in the cache if it is used again. */
+static void r_unload(void) {
+  struct InputCache *c=r_cache_find(currs.filename);
+  if (c==NULL) { r_close(); return; }
+  c->rs=currs; c->loaded_p=TRUE;
+  r_cache_done(c);
+}
+
+/** Copies all objects reachable from a subsequent (not the first) input. */
+static void r_dump_input(char const *filename) {
+  struct Stats *st=curws.stats_p ? curws.stats+currs.srci : NULL;
+  r_load(filename, st);
   r_input_status();
-  w_dump_start();
   r_dump_reachable();
-  w_make_trailer();
-  w_pull_trailer();
+  stats_lap(st, PH_DUMP);
+  r_input_stats();
+  r_unload();
+}
+
+/* --- Parallel segments */
+
+/** The segment of an input, written by a worker process. With `-j <jobs>',
+ * subsequent inputs are parsed by worker processes in parallel, while the
+ * main process copies the segments to the output in input order.
+ */
+struct Segment {
+  FILE *seg; /* NULL: the input is processed sequentially */
+#if USE_FORK
+  pid_t pid;
+#endif
+};
+
+/** Starts a worker process writing the segment of input filename. Leaves
+ * sg->seg==NULL if it can't.
+ */
+static void seg_start(struct Segment *sg, char const *filename, slen_t srci) {
+#if USE_FORK
+  struct InputCache *c=r_cache_find(filename);
+#endif
+  sg->seg=NULL;
+#if USE_FORK
+  if (c!=NULL && !c->loaded_p) { /* Dat: load it once, for all workers */
+    slen_t pagetotal=curws.pagetotal;
+    r_load(filename, NULL);
+    curws.pagetotal=pagetotal;
+    c->rs=currs; c->loaded_p=TRUE;
+  }
+  fflush(NULL); /* Dat: the worker mustn't inherit unflushed output */
+  if (NULL==(sg->seg=tmpfile())) return;
+  if ((sg->pid=fork())<0) { fclose(sg->seg); sg->seg=NULL; return; }
+  if (sg->pid==0) { /* worker process */
+    cur_ctx->worker_p=TRUE;
+#if USE_IO_URING
+    if (cur_ctx->pc_ur!=NULL) ur_close(); /* Dat: it sets up its own */
+#endif
+    curws.seg=sg->seg;
+    curws.outobjc=SEG_OBJ_BASE; curws.pagetotal=0;
+    curws.ddslots=NULL; curws.ddslota=curws.ddslotc=0; /* Dat: only this input */
+    curws.ddsavedc=curws.ddsaved=0;
+    currs.srci=srci;
+    r_dump_input(filename);
+    if (curws.dedup_p) seg_put('D', curws.ddsavedc, curws.ddsaved);
+    if (curws.stats_p) {
+      seg_put('X', sizeof(struct Stats), 0);
+      fwrite(curws.stats+srci, sizeof(struct Stats), 1, curws.seg);
+    }
+    seg_put('P', curws.pagetotal, curws.lastsrcpages_num);
+    seg_put('E', curws.outobjc, 0);
+    _exit(0!=fflush(curws.seg) || ferror(curws.seg) ? 5 : 0);
+    /* Dat: errors call _exit(), and the main process fails with that code */
+  }
+#else
+  (void)filename; (void)srci;
+#endif
+}
+
+/** Kills and reaps the worker processes still running (after an error), and
+ * closes their segments. The segments are tmpfile()s, so they are already
+ * unlinked.
+ */
+static void seg_kill_all(void) {
+  slen_t i;
+#if USE_FORK
+  int status;
+#endif
+  if (curws.sgs==NULL) return;
+  for (i=0; i<curws.srcpages_numc; i++) if (curws.sgs[i].seg!=NULL) {
+#if USE_FORK
+    if (curws.sgs[i].pid>0) {
+      kill(curws.sgs[i].pid, SIGKILL);
+      while (waitpid(curws.sgs[i].pid, &status, 0)<0 && errno==EINTR) {}
+      curws.sgs[i].pid=0;
+    }
+#endif
+    fclose(curws.sgs[i].seg); curws.sgs[i].seg=NULL;
+  }
+  free(curws.sgs); curws.sgs=NULL;
+}
+
+/** Copies the segment of input srci to the output, renumbering objects from
+ * SEG_OBJ_BASE on to curws.outobjc on. Stream bodies are copied from the
+ * input file. The result is byte-identical to r_dump_input(), because
+ * copy_token(), w_ref(), w_obj_begin(), w_obj_end() and w_stream() are called
+ * the same way. With --dedup, objects are renumbered by the 'H' records
+ * instead, and the objects merged with earlier inputs are skipped.
+ */
+static void seg_stitch(struct Segment *sg, char const *filename, slen_t srci) {
+#if USE_FORK
+  int status, type;
+  slen_t a, b, base=curws.outobjc-SEG_OBJ_BASE;
+  unsigned char hu[DD_HASHLEN+1];
+  slen_t firstnum=curws.outobjc, olda;
+  sbool skip_p=FALSE;
+  struct DedupSlot *sl;
+  struct Stats stitch;
+  struct InputCache *c;
+  /** Target object number of segment object number a */
+#define SEG_NUM(a) (curws.dedup_p ? ((a)<curws.segmapa && curws.segmap[a]!=0 ? curws.segmap[a] : (errn("bad segment object for ", filename), 0)) : (a)+base)
+  while (waitpid(sg->pid, &status, 0)<0) {
+    if (errno!=EINTR) errn("waitpid: ", strerror(errno));
+  }
+  sg->pid=0;
+  if (!WIFEXITED(status)) errn("worker process killed: ", filename);
+  if (WEXITSTATUS(status)!=0) { /* error already reported */
+    cur_ctx->err[0]='\0'; pc_fail(WEXITSTATUS(status));
+  }
+  if (curws.segmap!=NULL) memset(curws.segmap, '\0', curws.segmapa*sizeof(curws.segmap[0]));
+  stats_lap(NULL, 0); /* Dat: don't count the wait */
+  rewind(sg->seg);
+  r_open(filename);
+  while ((type=getc(sg->seg))>=0) {
+    if (1!=fread(&a, sizeof(a), 1, sg->seg)
+     || 1!=fread(&b, sizeof(b), 1, sg->seg)) errn("truncated segment for ", filename);
+    switch (type) {
+     case 'T':
+      if (b>IBUFSIZE || b!=fread(ibuf, 1, b, sg->seg)) errn("bad segment token for ", filename);
+      ibufb=ibuf+b; if (!skip_p) copy_token((char)a);
+      break;
+     case 'R': if (!skip_p) w_ref(SEG_NUM(a)); break;
+     case 'V':
+      if (b>IBUFSIZE || b!=fread(ibuf, 1, b, sg->seg)) errn("bad segment span for ", filename);
+      if (!skip_p) w_span(ibuf, b, a!=0);
+      break;
+     case 'O':
+      if (SEG_NUM(a)<firstnum) skip_p=TRUE; /* Dat: merged with an earlier input */
+                          else w_obj_begin(SEG_NUM(a));
+      break;
+     case 'C': if (skip_p) skip_p=FALSE; else w_obj_end(); break;
+     case 'S': if (!skip_p) { r_seek(a); w_stream(b); } break;
+     case 'H': /* Dat: like wr_enqueue_ref() */
+      if (sizeof(hu)!=fread(hu, 1, sizeof(hu), sg->seg)) errn("truncated segment for ", filename);
+      if (a>=curws.segmapa) {
+        olda=curws.segmapa; curws.segmapa=a<256 ? 512 : 2*a;
+        if (NULL==(curws.segmap=(slen_t*)realloc(curws.segmap, curws.segmapa*sizeof(curws.segmap[0])))) errn("out of memory for segment",0);
+        memset(curws.segmap+olda, '\0', (curws.segmapa-olda)*sizeof(curws.segmap[0]));
+      }
+      sl=NULL;
+      if (hu[DD_HASHLEN]==0 && (sl=dd_slot(hu))->num!=0) {
+        curws.segmap[a]=sl->num; curws.ddsavedc++; curws.ddsaved+=b;
+      } else {
+        curws.segmap[a]=curws.outobjc++;
+        if (sl!=NULL) { memcpy(sl->h, hu, DD_HASHLEN); sl->num=curws.segmap[a]; curws.ddslotc++; }
+      }
+      break;
+     case 'D': curws.ddsavedc+=a; curws.ddsaved+=b; break;
+     case 'X': /* Dat: only with --stats=json */
+      if (a!=sizeof(struct Stats) || !curws.stats_p
+       || 1!=fread(&stitch, sizeof(stitch), 1, sg->seg)) errn("bad segment stats for ", filename);
+      stitch.wall[PH_STITCH]=curws.stats[srci].wall[PH_STITCH];
+      stitch.cpu[PH_STITCH]=curws.stats[srci].cpu[PH_STITCH];
+      curws.stats[srci]=stitch;
+      break;
+     case 'I':
+      if (a>=IBUFSIZE || a!=fread(ibuf, 1, a, sg->seg)) errn("bad segment status for ", filename);
+      fwrite(ibuf, 1, a, curws.statusf);
+      break;
+     case 'P': curws.pagetotal+=a; curws.srcpages_nums[srci]=SEG_NUM(b); break;
+     case 'E': if (!curws.dedup_p) curws.outobjc=a+base; break;
+     default: errn("bad segment record for ", filename);
+    }
+  }
+  if (ferror(sg->seg)) errn("error reading segment for ", filename);
+#undef SEG_NUM
   r_close();
-  curws.srcpages_nums[0]=curws.lastsrcpages_num;
-
-  ap=argv+4; srci=1;
-  while (*ap) {
-    r_open(*ap++);
-    r_check_pdf_header();
-    r_seek_xref();
-    r_read_xref();
+  stats_lap(curws.stats_p ? curws.stats+srci : NULL, PH_STITCH);
+  if (NULL!=(c=r_cache_find(filename))) r_cache_done(c);
+  fclose(sg->seg); sg->seg=NULL;
+#else
+  (void)sg; (void)filename; (void)srci;
+#endif
+}
+
+/* --- Jobs */
+
+/** Merges inputs (NULL-terminated) to output, with the options in curws.
+ * Buffers of curws are kept for the next job.
+ */
+static void run_job(char const *output, char const* const* inputs, char const* const* sels, pdfint_t jobs) {
+  char const*const* ap;
+  slen_t srci, first=1; /* first: the first input copied by r_dump_input() */
+  slen_t pagetotal;
+  FILE *wf;
+  curws.colc=0; curws.lastclosed=TRUE; curws.pagetotal=0; curws.toppages_num=1;
+  curws.membuf=NULL; curws.trailer.len=0; curws.toppages.len=0;
+  curws.txrefc=0; curws.objstmc=0; curws.stmc=0; curws.stmbuf.len=0;
+  curws.ddsavedc=curws.ddsaved=0; curws.ddslotc=0;
+  if (curws.ddslots!=NULL) memset(curws.ddslots, '\0', curws.ddslota*sizeof(curws.ddslots[0]));
+  memset(&curws.ostats, '\0', sizeof(curws.ostats));
+#if USE_FORK
+  curws.zpid=0;
+#endif
+  curws.filename=output; curws.pagesels=sels;
+  { ap=inputs;
+    while (*ap) if (0==strcmp(curws.filename, *ap++)) {
+      sprintf(cur_ctx->err, "%s: may not append to existing PDF: %.*s", PROGNAME, ERRPART, curws.filename);
+      pc_fail(4);
+    }
+    curws.srcpages_numc=ap-inputs;
+    /* fprintf(stderr,"%d\n", curws.srcpages_numc); */
+  }
+  if (curws.lin_p && (curws.append_p || curws.objstm_p)) errn("--linearize doesn't work with --append or --objstm",0);
+  curws.ofs=0;
+  if (0==strcmp(curws.filename, "-")) { /* Dat: single pass, no seeking back */
+    if (curws.append_p) errn("--append needs an output file",0);
+    curws.filename="(stdout)"; curws.wf=stdout; curws.statusf=stderr;
+#if defined(_WIN32) && !defined(__TINYC__)
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    w_obuf_start();
+  } else if (curws.append_p) {
+    curws.statusf=stdout;
+    w_append_start();
+    first=0;
+  } else if (!(curws.wf=fopen(curws.filename,"wb"))) {
+    err_file(5, "open4write", curws.filename, strerror(errno));
+  } else {
+    curws.statusf=stdout;
+    setvbuf(curws.wf, NULL, _IONBF, 0); /* Dat: buffered by curws.obuf */
+    w_obuf_start();
+  }
+  if (curws.quiet_p) curws.statusf=NULL;
+  if (curws.lin_p) { /* Dat: w_linearize() reads the merge back */
+    curws.linwf=curws.wf;
+    if (NULL==(curws.wf=tmpfile())) errn("tmpfile: ", strerror(errno));
+    setvbuf(curws.wf, NULL, _IONBF, 0); /* Dat: buffered by curws.obuf */
+  }
+  if (NULL==(curws.srcpages_nums=(slen_t*)malloc(2*sizeof(curws.srcpages_nums[0])*curws.srcpages_numc))) errn("out of memory for srcpages_nums",0);
+  if (!curws.append_p) curws.outobjc=2; /* Dat: 1 is the top /Pages */
+  w_pagetree_plan();
+  if (curws.stats_p) {
+    if (NULL==(curws.stats=(struct Stats*)calloc(curws.srcpages_numc, sizeof(curws.stats[0])))) errn("out of memory for stats",0);
+    curws.stats_start=stats_wall(); stats_lap(NULL, 0);
+  }
+  if (jobs>1 && curws.srcpages_numc>first) {
+    if (NULL==(curws.sgs=(struct Segment*)calloc(curws.srcpages_numc, sizeof(curws.sgs[0])))) errn("out of memory for segments",0);
+    for (srci=first; srci<curws.srcpages_numc && srci<first+(slen_t)jobs; srci++) seg_start(curws.sgs+srci, inputs[srci], srci);
+  }
+
+  if (!curws.append_p) {
+    currs.srci=0; pagetotal=curws.pagetotal;
+    r_load(inputs[0], curws.stats);
     r_input_status();
+    w_dump_start();
     r_dump_reachable();
-    r_close();
-    curws.srcpages_nums[srci++]=curws.lastsrcpages_num;
+    stats_lap(curws.stats, PH_DUMP);
+    w_make_trailer();
+    stats_lap(curws.stats, PH_TRAILER);
+    r_input_stats();
+    r_unload();
+    curws.srcpages_nums[0]=curws.lastsrcpages_num;
+    curws.srcpages_nums[curws.srcpages_numc]=curws.pagetotal-pagetotal;
+  }
+
+  for (srci=first; srci<curws.srcpages_numc; srci++) {
+    pagetotal=curws.pagetotal;
+    if (curws.sgs!=NULL && curws.sgs[srci].seg!=NULL) {
+      seg_stitch(curws.sgs+srci, inputs[srci], srci);
+      if (srci+jobs<curws.srcpages_numc) seg_start(curws.sgs+srci+jobs, inputs[srci+jobs], srci+jobs);
+    } else {
+      currs.srci=srci;
+      r_dump_input(inputs[srci]);
+      curws.srcpages_nums[srci]=curws.lastsrcpages_num;
+    }
+    curws.srcpages_nums[curws.srcpages_numc+srci]=curws.pagetotal-pagetotal;
   }
+  free(curws.sgs); curws.sgs=NULL;
 
+  stats_lap(NULL, 0);
   w_dump_toppages();
-  w_dump_xref();
-  w_dump_trailer();
-  fflush(curws.wf);
+  if (curws.objstm_p) {
+    w_dump_objstms();
+    w_dump_xref_stream();
+  } else {
+    w_dump_xref();
+    w_dump_trailer();
+  }
+  w_flush(); fflush(curws.wf);
+  if (curws.lin_p) w_linearize();
+  stats_lap(&curws.ostats, PH_XREF_DUMP);
   w_output_status();
+  if (curws.stats_p && curws.statusf!=NULL) w_output_stats(inputs);
   if (ferror(curws.wf)) errn("error writing output file: ", curws.filename);
-  if (fclose(curws.wf)) errn("error closing output file: ", curws.filename);
-  free(curws.trailer);
-  free(curws.srcpages_nums);
-  if (curws.txrefs!=NULL) free(curws.txrefs);
+  wf=curws.wf; curws.wf=NULL; /* Dat: pc_cleanup() mustn't close it again */
+  if (wf==stdout ? fflush(stdout) : fclose(wf)) errn("error closing output file: ", curws.filename);
+  free(curws.srcpages_nums); curws.srcpages_nums=NULL;
+  free(curws.stats); curws.stats=NULL;
+}
+
+/** Reads the --manifest file: a job on each line, `<output.pdf>
+ * <input1.pdf> [...]', separated by whitespace. Empty lines and lines
+ * starting with `#' are ignored. The words are NUL-terminated in place, in
+ * cur_ctx->mfbuf.
+ * @return the jobs in cur_ctx->mfjobv, each being `output, input1, ..., NULL'
+ */
+static char const **read_manifest(char const *filename, slen_t *jobcp) {
+  FILE *f;
+  char *p, *pend;
+  slen_t len=0, a=0, got, jobc=0, c=0, jobva=0, job;
+  if (0==strcmp(filename, "-")) f=stdin;
+  else if (!(f=fopen(filename, "rb"))) err_file(3, "open", filename, strerror(errno));
+  do {
+    if (len==a && NULL==(cur_ctx->mfbuf=(char*)realloc(cur_ctx->mfbuf, (a=a<4096 ? 4096 : 2*a)+1))) {
+      if (f!=stdin) fclose(f);
+      errn("out of memory for manifest",0);
+    }
+    len+=got=fread(cur_ctx->mfbuf+len, 1, a-len, f);
+  } while (got!=0);
+  got=ferror(f);
+  if (f!=stdin) fclose(f);
+  if (got) errn("error reading manifest: ", filename);
+  cur_ctx->mfbuf[len]='\0';
+  for (p=cur_ctx->mfbuf, pend=p+len; p!=pend; ) {
+    if (*p=='#') { while (p!=pend && *p!='\n' && *p!='\r') p++; }
+    job=c;
+    while (p!=pend && *p!='\n' && *p!='\r') {
+      if (is_ps_white(*p) || *p=='\0') { *p++='\0'; continue; }
+      if (c+2>=jobva && NULL==(cur_ctx->mfjobv=(char const**)realloc(cur_ctx->mfjobv, (jobva=jobva<256 ? 256 : 2*jobva)*sizeof(cur_ctx->mfjobv[0])))) errn("out of memory for manifest",0);
+      cur_ctx->mfjobv[c++]=p;
+      while (p!=pend && !is_ps_white(*p) && *p!='\0') p++;
+    }
+    if (p!=pend) *p++='\0';
+    if (c==job) continue; /* empty line */
+    if (c==job+1) errn("missing inputs in manifest line for: ", cur_ctx->mfjobv[job]);
+    cur_ctx->mfjobv[c++]=NULL; jobc++;
+  }
+  *jobcp=jobc;
+  return cur_ctx->mfjobv;
+}
+
+/** Splits the page ranges off the inputs in jobv[0..jobc) (see
+ * r_select_pages()): `in.pdf:1-3,7' becomes `in.pdf', unless a file is
+ * named so. The ranges go to cur_ctx->mfselv, parallel to jobv.
+ * @return cur_ctx->mfselv, or NULL if there are no page ranges
+ */
+static char const **split_pagesels(char const **jobv, slen_t jobc) {
+  char const **p, *q;
+  char *b;
+  slen_t n, len=0;
+  FILE *f;
+  if (jobc==0) return NULL;
+  for (p=jobv, n=jobc; n!=0; n--) { while (*++p!=NULL) {} p++; }
+  if (NULL==(cur_ctx->mfselv=(char const**)calloc(p-jobv, sizeof(p[0])))) errn("out of memory for page ranges",0);
+  for (p=jobv, n=jobc; n!=0; n--) {
+    while (*++p!=NULL) {
+      if (NULL==(q=strrchr(*p, ':')) || q==*p || q[1]=='\0'
+       || q[1+strspn(q+1, "0123456789,-z")]!='\0') continue;
+      if (NULL!=(f=fopen(*p, "rb"))) { fclose(f); continue; }
+      cur_ctx->mfselv[p-jobv]=q+1; len+=q-*p+1;
+    }
+    p++;
+  }
+  if (len==0) { free(cur_ctx->mfselv); return cur_ctx->mfselv=NULL; }
+  if (NULL==(cur_ctx->selbuf=b=(char*)malloc(len))) errn("out of memory for page ranges",0);
+  for (n=0; jobv+n!=p; n++) if (NULL!=(q=cur_ctx->mfselv[n])) {
+    memcpy(b, jobv[n], q-1-jobv[n]); b[q-1-jobv[n]]='\0';
+    jobv[n]=b; b+=strlen(b)+1;
+  }
+  return cur_ctx->mfselv;
+}
+
+/** Releases everything of the current run still held by cur_ctx (after an
+ * error, or the input caches and the manifest after success). Buffers
+ * reused by the next run are kept, see pdfconcat_free().
+ */
+static void pc_cleanup(void) {
+  slen_t i;
+  struct ReadState rs; /* currs */
+#if USE_FORK
+  int status;
+#endif
+  for (i=0; i<cachec; i++) if (caches[i].loaded_p) {
+    if (caches[i].rs.file==currs.file) currs.file=NULL; /* Dat: shared with the cache */
+    rs=currs; currs=caches[i].rs; r_free(); currs=rs;
+  }
+  free(caches); caches=NULL; cachec=0;
+  if (currs.file!=NULL) r_free();
+  free(currs.ddnodes); currs.ddnodes=NULL; currs.ddnodea=0;
+  free(currs.ddkids); currs.ddkids=NULL; currs.ddkida=0;
+  sn_free(&currs.ddnode);
+  free(cur_ctx->tmp); cur_ctx->tmp=NULL;
+  free(zs.out); zs.out=NULL;
+  seg_kill_all();
+  if (curws.zpipe!=NULL) { fclose(curws.zpipe); curws.zpipe=NULL; }
+#if USE_FORK
+  if (curws.zpid>0) {
+    while (waitpid(curws.zpid, &status, 0)<0 && errno==EINTR) {}
+    curws.zpid=-1;
+  }
+#endif
+  if (curws.zf!=NULL) { fclose(curws.zf); curws.zf=NULL; }
+  w_append_undo();
+  if (curws.wf!=NULL && curws.wf!=stdout) fclose(curws.wf);
+  if (curws.linwf!=NULL && curws.linwf!=stdout) fclose(curws.linwf);
+  curws.wf=curws.linwf=NULL; curws.membuf=NULL; curws.obufc=0;
+  free(curws.srcpages_nums); curws.srcpages_nums=NULL;
+  free(curws.stats); curws.stats=NULL;
+  free(cur_ctx->mfjobv); cur_ctx->mfjobv=NULL;
+  free(cur_ctx->mfbuf); cur_ctx->mfbuf=NULL;
+  free(cur_ctx->mfselv); cur_ctx->mfselv=NULL;
+  free(cur_ctx->selbuf); cur_ctx->selbuf=NULL;
+  sn_free(&curws.tnums); curws.qhead=curws.qc=0;
+  sn_free(&curws.selmark); curws.selc=0; curws.pagesels=NULL;
+  sn_free(&curws.linown); curws.linnull=0;
+  pbc=0;
+}
+
+/* --- Library API, see pdfconcat.h */
+
+pdfconcat_ctx *pdfconcat_new(void) {
+  struct pdfconcat_ctx *ctx=(struct pdfconcat_ctx*)calloc(1, sizeof(*ctx));
+  if (ctx==NULL) return NULL;
+  ctx->ws=(struct WriteState*)calloc(1, sizeof(*ctx->ws));
+  ctx->pc_zs=(struct InflateState*)calloc(1, sizeof(*ctx->pc_zs));
+  ctx->pc_zd=(struct DeflateState*)calloc(1, sizeof(*ctx->pc_zd));
+  if (ctx->ws==NULL || ctx->pc_zs==NULL || ctx->pc_zd==NULL) { pdfconcat_free(ctx); return NULL; }
+  ctx->jobs=1;
+  ctx->ws->obufsize=OBUF_SIZE;
+  ctx->ws->fanout=PAGETREE_FANOUT;
+  return ctx;
+}
+
+void pdfconcat_free(pdfconcat_ctx *ctx) {
+  struct WriteState *ws; /* curws */
+  if (ctx==NULL) return;
+  if (NULL!=(ws=ctx->ws)) {
+    free(ws->trailer.p); free(ws->toppages.p);
+    free(ws->txrefs); free(ws->txrefstm);
+    free(ws->objbuf.p); free(ws->stmbuf.p); free(ws->obuf);
+    free(ws->ddslots); free(ws->segmap); free(ws->queue); free(ws->selv);
+    sn_free(&ws->tnums); sn_free(&ws->selmark);
+    free(ws->linv); free(ws->linpgs); free(ws->hintbuf.p); sn_free(&ws->linown);
+    free(ws);
+  }
+#if USE_IO_URING
+  cur_ctx=ctx; ur_free(); cur_ctx=NULL;
+#endif
+  if (ctx->pc_zd!=NULL) free(ctx->pc_zd->out);
+  free(ctx->pc_zd); free(ctx->pc_zs);
+  free(ctx);
+}
+
+int pdfconcat_set(pdfconcat_ctx *ctx, char const *option, char const *value) {
+  pdfint_t n;
+  if (0==strcmp(option,"-j")) {
+    if (value==NULL || '1'!=scan_number(value, value+strlen(value), &n) || n<=0) return 2;
+    ctx->jobs=n;
+  } else if (0==strcmp(option,"--bufsize")) {
+    if (value==NULL || '1'!=scan_number(value, value+strlen(value), &n) || n<512) return 2;
+    ctx->ws->obufsize=n;
+  } else if (0==strcmp(option,"--fanout")) {
+    if (value==NULL || '1'!=scan_number(value, value+strlen(value), &n) || n<2) return 2;
+    ctx->ws->fanout=n;
+  } else if (0==strcmp(option,"--objstm")) {
+    ctx->ws->objstm_p=TRUE;
+  } else if (0==strcmp(option,"--dedup")) {
+    ctx->ws->dedup_p=TRUE;
+  } else if (0==strcmp(option,"--stats=json")) {
+    ctx->ws->stats_p=TRUE;
+  } else if (0==strcmp(option,"--append")) {
+    ctx->ws->append_p=TRUE;
+  } else if (0==strcmp(option,"--sequential")) {
+    ctx->ws->seq_p=TRUE;
+  } else if (0==strcmp(option,"--uring")) {
+    ctx->ws->uring_p=TRUE; /* Dat: ignored without USE_IO_URING */
+  } else if (0==strcmp(option,"--linearize")) {
+    ctx->ws->lin_p=TRUE;
+  } else if (0==strcmp(option,"--verbatim")) {
+    ctx->ws->verbatim_p=TRUE;
+  } else if (0==strcmp(option,"--quiet")) {
+    ctx->ws->quiet_p=TRUE;
+  } else return 2;
+  return 0;
+}
+
+int pdfconcat_run(pdfconcat_ctx *ctx, char const *output, char const* const* inputs) {
+  char const* const* ap;
+  char const **jobv, **sels;
+#if USE_SETJMP
+  int code;
+#endif
+  cur_ctx=ctx; ctx->err[0]='\0';
+#if USE_SETJMP
+  if (0!=(code=setjmp(ctx->jmp))) { pc_cleanup(); return code; }
+#endif
+  if (inputs[0]==NULL) errn("no inputs",0);
+  for (ap=inputs; *ap!=NULL; ap++) {}
+  /* Dat: r_cache_init() needs the job as `output, input1, ..., NULL' */
+  if (NULL==(ctx->mfjobv=jobv=(char const**)malloc((ap-inputs+2)*sizeof(jobv[0])))) errn("out of memory for inputs",0);
+  jobv[0]=output;
+  memcpy(jobv+1, inputs, (ap-inputs+1)*sizeof(jobv[0]));
+  sels=split_pagesels(jobv, 1);
+  r_cache_init(jobv, 1);
+  run_job(output, jobv+1, sels!=NULL ? sels+1 : NULL, ctx->jobs);
+  pc_cleanup();
+  return 0;
+}
+
+int pdfconcat_run_manifest(pdfconcat_ctx *ctx, char const *manifest) {
+  char const **jobv, **sels, **ap;
+  slen_t jobc;
+#if USE_SETJMP
+  int code;
+#endif
+  cur_ctx=ctx; ctx->err[0]='\0';
+#if USE_SETJMP
+  if (0!=(code=setjmp(ctx->jmp))) { pc_cleanup(); return code; }
+#endif
+  ap=jobv=read_manifest(manifest, &jobc);
+  sels=split_pagesels(jobv, jobc);
+  r_cache_init(jobv, jobc);
+  for (; jobc--!=0; ap++) {
+    run_job(ap[0], ap+1, sels!=NULL ? sels+(ap+1-jobv) : NULL, ctx->jobs);
+    while (*ap!=NULL) ap++;
+  }
+  pc_cleanup();
   return 0;
 }
+
+char const *pdfconcat_errmsg(pdfconcat_ctx const *ctx) {
+  return ctx->err;
+}
+
+/* --- Main */
+
+#ifndef PDFCONCAT_NO_MAIN
+static int usage(char const *argv0) {
+  fprintf(stderr, "Usage: %s [-j <jobs>] [--bufsize <bytes>] [--fanout <kids>] [--objstm] [--dedup] [--stats=json] [--append] [--sequential] [--uring] [--linearize] [--verbatim] [--quiet] -o <output.pdf>|- <input1.pdf>[:<pages>] [...]\n", argv0);
+  fprintf(stderr, "   or: %s [<options>] --manifest <jobs.txt>|-\n", argv0);
+  return 2;
+}
+
+int main(int argc, char const* const*argv) {
+  char const*const* ap;
+  char const* manifest=NULL;
+  sbool append_p=FALSE;
+  pdfconcat_ctx *ctx;
+  int code;
+  (void)argc;
+  if (NULL==(ctx=pdfconcat_new())) {
+    fprintf(stderr, "%s: error: out of memory\n", PROGNAME);
+    return 3;
+  }
+  for (ap=argv+1; *ap!=NULL && 0!=strcmp(*ap,"-o"); ap++) {
+    if ((0==strcmp(*ap,"-j") || 0==strcmp(*ap,"--bufsize") || 0==strcmp(*ap,"--fanout"))
+     && ap[1]!=NULL && 0==pdfconcat_set(ctx, *ap, ap[1])) {
+      ap++;
+    } else if (0==strcmp(*ap,"--manifest") && ap[1]!=NULL) {
+      manifest=*++ap;
+    } else if (0!=strcmp(*ap,"-j") && 0!=strcmp(*ap,"--bufsize") && 0!=strcmp(*ap,"--fanout") && 0==pdfconcat_set(ctx, *ap, NULL)) {
+      if (0==strcmp(*ap,"--append")) append_p=TRUE;
+    } else { code=usage(argv[0]); goto done; }
+  }
+  if (manifest!=NULL) {
+    if (*ap!=NULL) { code=usage(argv[0]); goto done; }
+    code=pdfconcat_run_manifest(ctx, manifest);
+  } else {
+    if (*ap==NULL || ap[1]==NULL || ap[2]==NULL
+     || (append_p && 0==strcmp(ap[1], "-"))) { code=usage(argv[0]); goto done; }
+    code=pdfconcat_run(ctx, ap[1], ap+2);
+  }
+  if (code!=0 && pdfconcat_errmsg(ctx)[0]!='\0') {
+    fflush(stdout);
+    fprintf(stderr, "%s\n", pdfconcat_errmsg(ctx));
+  }
+ done:
+  pdfconcat_free(ctx);
+  return code;
+}
+#endif
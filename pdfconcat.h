@@ -0,0 +1,61 @@
+/* pdfconcat.h: library interface of pdfconcat.c
+ *
+ * Compile pdfconcat.c with -DPDFCONCAT_NO_MAIN to link it into a program.
+ * A context owns all reader and writer state of a merge: independent
+ * contexts can be used from different threads at the same time (if
+ * compiled with USE_TLS=1, the default with GCC and Clang), and a context
+ * can be reused for many merges, keeping its buffers. Errors are returned
+ * as the exit codes of the pdfconcat command, they don't exit the process:
+ * 2: bad option, 3: bad input or out of memory, 4: the output is also an
+ * input, 5: error writing the output, 6: unseekable input, 7: bad input
+ * file size.
+ *
+ * Dat: with `-j' and --objstm, worker processes are started with fork(2),
+ *      which is only safe in a multithreaded program if the other threads
+ *      don't hold locks in the meantime (e.g. in malloc()).
+ */
+#ifndef PDFCONCAT_H
+#define PDFCONCAT_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct pdfconcat_ctx pdfconcat_ctx;
+
+/** @return a new context with the default options, or NULL if out of memory */
+pdfconcat_ctx *pdfconcat_new(void);
+
+/** Frees ctx and everything it owns. NULL is OK. */
+void pdfconcat_free(pdfconcat_ctx *ctx);
+
+/** Sets a command-line option for the subsequent runs of ctx, e.g
+ * ("--dedup", NULL) or ("-j", "4"). Additional option: ("--quiet", NULL)
+ * omits the status lines (and --stats=json).
+ * @return 0, or 2 if the option or its value is invalid
+ */
+int pdfconcat_set(pdfconcat_ctx *ctx, char const *option, char const *value);
+
+/** Merges the NULL-terminated inputs to output ("-" for stdout), like
+ * `pdfconcat -o output inputs...'. An input can have page ranges, e.g
+ * "in.pdf:1-3,z".
+ * @return 0 on success, or the exit code of the command on error
+ */
+int pdfconcat_run(pdfconcat_ctx *ctx, char const *output, char const* const* inputs);
+
+/** Runs the merges listed in the manifest file ("-" for stdin), like
+ * `pdfconcat --manifest manifest'. Stops at the first error.
+ * @return 0 on success, or the exit code of the command on error
+ */
+int pdfconcat_run_manifest(pdfconcat_ctx *ctx, char const *manifest);
+
+/** @return the message of the last error of ctx, "" if none (e.g. if it
+ * has been printed by a worker process)
+ */
+char const *pdfconcat_errmsg(pdfconcat_ctx const *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PDFCONCAT_H */